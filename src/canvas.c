@@ -221,79 +221,52 @@ void init_status_bar()
 }
 
 
-void commit_paste(int swap, int *update)
-{
-	image_info ti;
-	unsigned char *image, *xbuf, *mask, *alpha = NULL;
+typedef struct {
+	image_info *ti;
 	unsigned char *old_image, *old_alpha;
-	int op = 255, opacity = tool_opacity, bpp = MEM_BPP;
-	int fx, fy, fw, fh, fx2, fy2;		// Screen coords
-	int i, ua, cmask, ofs, iofs, upd = UPD_IMGP, fail = TRUE;
-
+	int fx, fy, fw, bpp, ua, op, opacity, swap, alpha;
+} pasted;
 
-	fx = marq_x1 > 0 ? marq_x1 : 0;
-	fy = marq_y1 > 0 ? marq_y1 : 0;
-	fx2 = marq_x2 < mem_width ? marq_x2 : mem_width - 1;
-	fy2 = marq_y2 < mem_height ? marq_y2 : mem_height - 1;
-
-	fw = fx2 - fx + 1;
-	fh = fy2 - fy + 1;
-
-	mask = multialloc(MA_SKIP_ZEROSIZE, &mask, fw, &alpha,
-		((mem_channel == CHN_IMAGE) && RGBA_mode && mem_img[CHN_ALPHA] &&
-		!mem_clip_alpha && !channel_dis[CHN_ALPHA]) * fw,
-		&xbuf, NEED_XBUF_PASTE * fw * bpp, NULL);
-	if (!mask) goto quit; // Not enough memory
-	if (alpha) memset(alpha, channel_col_A[CHN_ALPHA], fw);
-
-	/* Ignore clipboard alpha if disabled */
-	ua = channel_dis[CHN_ALPHA] | !mem_clip_alpha;
+static void paste_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	pasted *pd = data;
+	image_info *ti = pd->ti;
+	unsigned char *image, *xbuf, *mask, *alpha = NULL;
+	int i, ofs, iofs, fw = pd->fw, bpp = pd->bpp;
 
-	if (swap) /* Prepare to convert image contents into new clipboard */
+	mask = buf;
+	xbuf = buf + fw;
+	if (pd->alpha)
 	{
-		cmask = CMASK_IMAGE | CMASK_SEL;
-		if ((mem_channel == CHN_IMAGE) && mem_img[CHN_ALPHA] &&
-			 !channel_dis[CHN_ALPHA]) cmask |= CMASK_ALPHA;
-		if (!mem_alloc_image(AI_CLEAR | AI_NOINIT, &ti, fw, fh, MEM_BPP,
-			cmask, NULL)) goto quit;
-		copy_area(&ti, &mem_image, fx, fy);
+		alpha = xbuf;
+		xbuf += fw;
+		memset(alpha, channel_col_A[CHN_ALPHA], fw);
 	}
 
 	/* Offset in memory */
-	ofs = (fy - marq_y1) * mem_clip_w + (fx - marq_x1);
+	ofs = (pd->fy + start - marq_y1) * mem_clip_w + (pd->fx - marq_x1);
 	image = mem_clipboard + ofs * mem_clip_bpp;
-	iofs = fy * mem_width + fx;
+	iofs = (pd->fy + start) * mem_width + pd->fx;
 
-	mem_undo_next(UNDO_PASTE);	// Do memory stuff for undo
-
-	old_image = mem_img[mem_channel];
-	old_alpha = mem_img[CHN_ALPHA];
-	if (mem_undo_opacity)
-	{
-		old_image = mem_undo_previous(mem_channel);
-		old_alpha = mem_undo_previous(CHN_ALPHA);
-	}
-	if (IS_INDEXED) op = opacity = 0;
-
-	for (i = 0; i < fh; i++)
+	for (i = start; i < start + cnt; i++)
 	{
-		unsigned char *wa = ua ? alpha : mem_clip_alpha + ofs;
+		unsigned char *wa = pd->ua ? alpha : mem_clip_alpha + ofs;
 		unsigned char *wm = mem_clip_mask ? mem_clip_mask + ofs : NULL;
 		unsigned char *img = image;
 
-		row_protected(fx, fy + i, fw, mask);
-		if (swap)
+		row_protected(pd->fx, pd->fy + i, fw, mask);
+		if (pd->swap)
 		{
-			unsigned char *ws = ti.img[CHN_SEL] + i * fw;
+			unsigned char *ws = ti->img[CHN_SEL] + i * fw;
 
 			memcpy(ws, mask, fw);
 			process_mask(0, 1, fw, ws, NULL, NULL,
-				ti.img[CHN_ALPHA] ? NULL : wa, wm, op, 0);
+				ti->img[CHN_ALPHA] ? NULL : wa, wm, pd->op, 0);
 		}
 
 		process_mask(0, 1, fw, mask, mem_img[CHN_ALPHA] && wa ?
-			mem_img[CHN_ALPHA] + iofs : NULL, old_alpha + iofs,
-			wa, wm, opacity, 0);
+			mem_img[CHN_ALPHA] + iofs : NULL, pd->old_alpha + iofs,
+			wa, wm, pd->opacity, 0);
 
 		if (mem_clip_bpp < bpp)
 		{
@@ -304,12 +277,76 @@ void commit_paste(int swap, int *update)
 		}
 
 		process_img(0, 1, fw, mask, mem_img[mem_channel] + iofs * bpp,
-			old_image + iofs * bpp, img, xbuf, bpp, 0);
+			pd->old_image + iofs * bpp, img, xbuf, bpp, 0);
 
 		image += mem_clip_w * mem_clip_bpp;
 		ofs += mem_clip_w;
 		iofs += mem_width;
 	}
+}
+
+void commit_paste(int swap, int *update)
+{
+	image_info ti;
+	pasted pd;
+	unsigned char *buf;
+	int fx, fy, fw, fh, fx2, fy2;		// Screen coords
+	int l, cmask, bpp = MEM_BPP, upd = UPD_IMGP, fail = TRUE;
+
+
+	fx = marq_x1 > 0 ? marq_x1 : 0;
+	fy = marq_y1 > 0 ? marq_y1 : 0;
+	fx2 = marq_x2 < mem_width ? marq_x2 : mem_width - 1;
+	fy2 = marq_y2 < mem_height ? marq_y2 : mem_height - 1;
+
+	fw = fx2 - fx + 1;
+	fh = fy2 - fy + 1;
+
+	memset(&pd, 0, sizeof(pd));
+	pd.ti = &ti;
+	pd.fx = fx;
+	pd.fy = fy;
+	pd.fw = fw;
+	pd.bpp = bpp;
+	pd.swap = swap;
+	pd.op = 255;
+	pd.opacity = tool_opacity;
+	pd.alpha = (mem_channel == CHN_IMAGE) && RGBA_mode && mem_img[CHN_ALPHA] &&
+		!mem_clip_alpha && !channel_dis[CHN_ALPHA];
+
+	/* Row buffers: mask, alpha if needed, extra buffer if needed */
+	l = fw * (1 + pd.alpha + NEED_XBUF_PASTE * bpp);
+	if (!(buf = malloc(l))) goto quit; // Not enough memory
+
+	/* Ignore clipboard alpha if disabled */
+	pd.ua = channel_dis[CHN_ALPHA] | !mem_clip_alpha;
+
+	if (swap) /* Prepare to convert image contents into new clipboard */
+	{
+		cmask = CMASK_IMAGE | CMASK_SEL;
+		if ((mem_channel == CHN_IMAGE) && mem_img[CHN_ALPHA] &&
+			 !channel_dis[CHN_ALPHA]) cmask |= CMASK_ALPHA;
+		if (!mem_alloc_image(AI_CLEAR | AI_NOINIT, &ti, fw, fh, MEM_BPP,
+			cmask, NULL)) goto quit;
+		copy_area(&ti, &mem_image, fx, fy);
+	}
+
+	mem_undo_next(UNDO_PASTE);	// Do memory stuff for undo
+
+	pd.old_image = mem_img[mem_channel];
+	pd.old_alpha = mem_img[CHN_ALPHA];
+	if (mem_undo_opacity)
+	{
+		pd.old_image = mem_undo_previous(mem_channel);
+		pd.old_alpha = mem_undo_previous(CHN_ALPHA);
+	}
+	if (IS_INDEXED) pd.op = pd.opacity = 0;
+
+	/* Build the blend tables here, before threads get to them */
+	process_img(0, 1, 0, buf, mem_img[mem_channel], mem_img[mem_channel],
+		mem_img[mem_channel], buf, bpp, 0);
+	/* Rows are independent, so large pastes go in parallel bands */
+	if (!mem_bands(paste_rows, &pd, fw, fh, l)) paste_rows(&pd, buf, 0, fh);
 
 	if (swap)
 	{
@@ -329,7 +366,7 @@ void commit_paste(int swap, int *update)
 	}
 
 	fail = FALSE;
-quit:	free(mask);
+quit:	free(buf);
 
 	if (fail) memory_errors(1); /* Warn and not update */
 	else if (!update) /* Update right now */
@@ -1293,6 +1330,10 @@ void update_stuff(int flags)
 		if ((marq_status >= MARQUEE_PASTE) && show_paste) flags |= CF_DRAW;
 	if (flags & CF_GMODE)
 		if ((tool_type == TOOL_GRADIENT) && grad_opacity) flags |= CF_DRAW;
+	if (flags & CF_VDRAW) /* Image changed, decimated copies are stale */
+		mem_mip_dirty(NULL, 0, 0, 0, 0);
+	if (flags & CF_DRAW) /* Rendered tiles are stale, even if redraw waits */
+		canvas_tiles_dirty(NULL);
 
 	/* The next parts can be done later in a cumulative update */
 	flags |= update_later;
@@ -1521,7 +1562,7 @@ typedef struct {
 	int mode, fpmode;
 	int fmask, ftype, ftypes[NUM_FTYPES];
 	int need_save, need_anim, need_undo, need_icc, script;
-	int jpeg_c, png_c, tga_c, jp2_c, xtrans[3], xx[3], xy[3];
+	int jpeg_c, png_c, png_p, tga_c, jp2_c, xtrans[3], xx[3], xy[3];
 	int tiff_m, lzma_c, zstd_c;
 	int webp_p, webp_q, webp_c;
 	int lbm_c, lbm_p;
@@ -1767,6 +1808,7 @@ void init_ls_settings(ls_settings *settings, void **wdata)
 	settings->req_w = settings->req_h = 0;
 	settings->jpeg_quality = jpeg_quality;
 	settings->png_compression = png_compression;
+	settings->png_profile = png_profile;
 	settings->lzma_preset = lzma_preset;
 	settings->zstd_level = zstd_level;
 	settings->tiff_type = -1; /* Use default */
@@ -1788,6 +1830,7 @@ void init_ls_settings(ls_settings *settings, void **wdata)
 		settings->hot_y = dt->xy[0];
 		settings->jpeg_quality = dt->jpeg_c;
 		settings->png_compression = dt->png_c;
+		settings->png_profile = dt->png_p;
 		settings->lzma_preset = dt->lzma_c;
 		settings->zstd_level = dt->zstd_c;
 		settings->tiff_type = dt->tiff_m;
@@ -1842,6 +1885,8 @@ static void store_ls_settings(ls_settings *settings)
 			jpeg_quality = settings->jpeg_quality;
 		if (xflags & (XF_COMPZ | XF_COMPZT))
 			png_compression = settings->png_compression;
+		if (xflags & XF_COMPZ)
+			png_profile = settings->png_profile;
 		if (xflags & XF_COMPLZ)
 			lzma_preset = settings->lzma_preset;
 		if (xflags & XF_COMPZS)
@@ -2109,6 +2154,8 @@ static void *fselector_code[] = {
 		MLABELr(_("PNG Compression (0=None)")), ACTMAP(XF_COMPZ),
 			SPIN(png_c, 0, 9), ACTMAP(XF_COMPZ | XF_COMPZT),
 			ALTNAME("ZIP Compression (0=None)"),
+		MLABELr(_("PNG Save Profile")), ACTMAP(XF_COMPZ),
+			OPT(png_profiles, 0, png_p), ACTMAP(XF_COMPZ),
 		MLABELr(_("LZMA2 Compression (0=None)")), ACTMAP(XF_COMPLZ),
 			SPIN(lzma_c, 0, 9), ACTMAP(XF_COMPLZ),
 		MLABELr(_("ZSTD Compression Level")), ACTMAP(XF_COMPZS),
@@ -2144,7 +2191,7 @@ static void *fselector_code[] = {
 		CHECK("Load into Layers", load_lr),
 		uPATHSTR(ex_path), OPNAME("Explode Frames"),
 		OPTv(modes_txt, 3, anim_mode), OPNAME("Frames"),
-		/* For loading scalable images */
+		/* For loading scalable images, or reduced JPEG, JPEG2000 and WebP */
 		SPIN(w, 0, MAX_WIDTH), OPNAME("Width"),
 		SPIN(h, 0, MAX_HEIGHT), OPNAME("Height"),
 	ENDIF(1),
@@ -2314,6 +2361,7 @@ void file_selector_x(int action_type, void **xdata)
 
 	tdata.jpeg_c = jpeg_quality;
 	tdata.png_c = png_compression;
+	tdata.png_p = png_profile;
 	tdata.tga_c = tga_RLE;
 	tdata.jp2_c = jp2_rate;
 	tdata.lzma_c = lzma_preset;
@@ -2804,10 +2852,12 @@ void do_tool_action(int cmd, int x, int y, int pressure)
 			{
 				int oldmode = mem_undo_opacity;
 				mem_undo_opacity = TRUE;
+				init_spans();
 				f_circle(line_x1, line_y1, tool_size);
 				f_circle(line_x2, line_y2, tool_size);
 				// Draw tool_size thickness line from 1-2
 				tline(line_x1, line_y1, line_x2, line_y2, tool_size);
+				render_spans();
 				mem_undo_opacity = oldmode;
 			}
 			else sline(line_x1, line_y1, line_x2, line_y2);
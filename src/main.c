@@ -33,6 +33,7 @@
 #include "prefs.h"
 #include "csel.h"
 #include "spawn.h"
+#include "thread.h"
 
 static int compare_names(const void *s1, const void *s2)
 {
@@ -353,11 +354,124 @@ static gboolean run_init_script()
 	return (FALSE); // Do not run again (if idle handler)
 }
 
+#ifndef WIN32
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+enum {
+	JOB_OK = 0,
+	JOB_FAILED,
+	JOB_NOLOAD,
+	JOB_CRASHED,
+	JOB_NOTRUN
+};
+
+/* Run script over every file in its own process, "jobs" at once; image state
+ * is global, so a separate process is what gives each job a context of its
+ * own. Returns the number of failed files */
+static int run_jobs(int jobs)
+{
+	static char *msgs[] = { "", "Script failed", "Could not load file",
+		"Terminated abnormally", "Not run" };
+	GTimer *timer;
+	pid_t pid, *pids;
+	double *times, now, total = 0.0, worst = -1.0;
+	int *jobfile, *res;
+	int i, j, n, status, fails = 0, running = 0, next = 0, slow = 0;
+
+	if (jobs > files_passed) jobs = files_passed;
+	if (!multialloc(MA_ALIGN_DOUBLE, &times, files_passed * sizeof(double),
+		&res, files_passed * sizeof(int), &pids, jobs * sizeof(pid_t),
+		&jobfile, jobs * sizeof(int), NULL))
+	{
+		memory_errors(1);
+		return (files_passed);
+	}
+	for (i = 0; i < files_passed; i++) res[i] = JOB_NOTRUN;
+	memset(pids, 0, jobs * sizeof(pid_t));
+
+	/* Share the helper threads between the jobs */
+	n = helper_threads() / jobs;
+
+	timer = g_timer_new();
+	while ((next < files_passed) || running)
+	{
+		/* Fill up free slots */
+		while ((running < jobs) && (next < files_passed))
+		{
+			fflush(stdout);
+			fflush(stderr);
+			pid = fork();
+			if (pid < 0) break; // Retry after some job finishes
+			if (!pid) // Child
+			{
+				maxthreads = n > 1 ? n : 1;
+				i = JOB_NOLOAD;
+				if (!do_a_load(file_args[next], FALSE))
+				{
+					update_menus();
+					run_script(script_cmds);
+					i = user_break ? JOB_FAILED : JOB_OK;
+				}
+				spawn_quit();
+				fflush(stdout);
+				fflush(stderr);
+				_exit(i);
+			}
+			for (j = 0; pids[j]; j++);
+			pids[j] = pid;
+			jobfile[j] = next;
+			times[next++] = g_timer_elapsed(timer, NULL);
+			running++;
+		}
+		if (!running) break; // Cannot start anything at all
+
+		pid = wait(&status);
+		if (pid < 0)
+		{
+			if (errno == EINTR) continue;
+			break; // Lost the children somehow
+		}
+		for (j = 0; (j < jobs) && (pids[j] != pid); j++);
+		if (j >= jobs) continue; // Not one of ours
+		pids[j] = 0;
+		running--;
+		i = jobfile[j];
+		times[i] = g_timer_elapsed(timer, NULL) - times[i];
+		res[i] = WIFEXITED(status) && (WEXITSTATUS(status) < JOB_CRASHED) ?
+			WEXITSTATUS(status) : JOB_CRASHED;
+	}
+	now = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	/* Report failures, then the totals */
+	for (i = 0; i < files_passed; i++)
+	{
+		if (res[i] == JOB_NOTRUN) times[i] = 0.0;
+		total += times[i];
+		if (times[i] > worst) worst = times[i] , slow = i;
+		if (res[i] == JOB_OK) continue;
+		fails++;
+		printf("%s: %s (%.3f s)\n", file_args[i], msgs[res[i]], times[i]);
+	}
+	printf("%d files, %d failed, %d jobs: %.3f s elapsed, %.3f s per file\n",
+		files_passed, fails, jobs, now, total / files_passed);
+	printf("Slowest: %s (%.3f s)\n", file_args[slow], worst);
+
+	free(times);
+	return (fails);
+}
+
+#endif
+
 int main( int argc, char *argv[] )
 {
 	char *env;
 	glob_t globdata;
 	int file_arg_start = argc, new_empty = TRUE, get_screenshot = FALSE;
+	int jobs = 0;
 	int i, j, l, nf, nw, nl, w0, pass, fmode, dosort = FALSE;
 
 	if (argc > 1)
@@ -377,6 +491,7 @@ int main( int argc, char *argv[] )
 				"  --flist         Read a list of files\n"
 				"  --sort          Sort files passed as arguments\n"
 				"  --cmd           Commandline scripting mode, no GUI\n"
+				"  --cmd -j N      Run the script over each file, N files at once\n"
 				"  -s              Grab screenshot\n"
 				"  -v              Start in viewer mode\n"
 				"  --              End of options\n\n"
@@ -387,6 +502,16 @@ int main( int argc, char *argv[] )
 		{
 			cmd_mode = TRUE;
 			script_cmds = argv + 2;
+			if ((argc > 2) && !strcmp(argv[2], "-j")) // Parallel jobs
+			{
+				if ((argc < 4) || (sscanf(argv[3], "%i", &jobs) != 1) ||
+					(jobs < 1))
+				{
+					printf("Usage: mtpaint --cmd -j N ..., N must be 1 or more\n");
+					exit(1);
+				}
+				script_cmds = argv + 4;
+			}
 		}
 	}
 
@@ -593,6 +718,16 @@ int main( int argc, char *argv[] )
 	}
 	main_init();					// Create main window
 
+#ifndef WIN32
+	/* Batch of files to process in parallel */
+	if (cmd_mode && (jobs > 0) && (files_passed > 0) && !get_screenshot)
+	{
+		i = run_jobs(jobs);
+		spawn_quit();
+		return (!!i);
+	}
+#endif
+
 	if ( get_screenshot )
 	{
 		do_new_chores(FALSE);
@@ -145,6 +145,8 @@ static inilist ini_bool[] = {
 static inilist ini_int[] = {
 	{ "jpegQuality",	&jpeg_quality,		85  },
 	{ "pngCompression",	&png_compression,	9   },
+	{ "pngProfile",		&png_profile,		0   },
+	{ "pngTimeBudget",	&png_budget,		0   },
 	{ "jpeg2000Rate",	&jp2_rate,		1   },
 	{ "lzmaPreset",		&lzma_preset,		9   },
 	{ "zstdLevel",		&zstd_level,		9   },
@@ -458,6 +460,7 @@ static void clipboard_export_fn(main_dd *dt, void **wdata, int what, void **wher
 	settings.mode = FS_CLIPBOARD;
 	settings.ftype = type = (int)cdata->format->id;
 	settings.png_compression = 1; // Speed is of the essence
+	settings.png_profile = 0;
 
 	res = save_mem_image(&buf, &len, &settings);
 	if (res) return; // No luck creating in-memory image
@@ -978,15 +981,17 @@ static void draw_arrow(int mode)
 
 	// Draw arrow lines & circles
 	mem_undo_opacity = TRUE;
+	init_spans();
 	f_circle(xa1, ya1, tool_size);
 	f_circle(xa2, ya2, tool_size);
 	tline(xa1, ya1, line_x2, line_y2, tool_size);
 	tline(xa2, ya2, line_x2, line_y2, tool_size);
+	if (mode == 3) tline(xa1, ya1, xa2, ya2, tool_size);
+	render_spans();
 
 	if (mode == 3)
 	{
-		// Draw 3rd line and fill arrowhead
-		tline(xa1, ya1, xa2, ya2, tool_size );
+		// Fill arrowhead
 		poly_points = 0;
 		poly_add(line_x2, line_y2);
 		poly_add(xa1, ya1);
@@ -1037,6 +1042,8 @@ void var_init()
 		*(ilp->var) = inifile_get_gboolean(ilp->name, ilp->defv);
 	for (ilp = ini_int; ilp->name; ilp++)
 		*(ilp->var) = inifile_get_gint32(ilp->name, ilp->defv);
+	/* Profile is used as an index */
+	png_profile = png_profile < 0 ? 0 : png_profile > 3 ? 3 : png_profile;
 
 	/* Initialize undo memory space */
 	if (mem_undo_limit <= 0)
@@ -1930,6 +1937,42 @@ void setup_row(renderstate *r, int x0, int width, int zoom, int scale, int mw,
 	*r = rr;
 }
 
+/* Replicate RGB pixel at dest to fill n pixels, in doubling blocks */
+static inline void rgb_fill(unsigned char *dest, int n)
+{
+	int l = 3;
+
+	for (n *= 3; l + l <= n; l += l) memcpy(dest + l, dest, l);
+	if (l < n) memcpy(dest + l, dest, n - l);
+}
+
+/* Blend color over n pixels of varying background, such as chequers, with
+ * opacity k; a pixel same as the one before it gets the same result */
+static void rgb_blend_run(unsigned char *dest, int n, unsigned char *rgb, int k)
+{
+	unsigned char *d0 = dest, bk[3];
+	int j;
+
+	for (; n > 0; n-- , dest += 3)
+	{
+		if ((dest > d0) && (dest[0] == bk[0]) && (dest[1] == bk[1]) &&
+			(dest[2] == bk[2]))
+		{
+			dest[0] = dest[-3];
+			dest[1] = dest[-2];
+			dest[2] = dest[-1];
+			continue;
+		}
+		bk[0] = dest[0]; bk[1] = dest[1]; bk[2] = dest[2];
+		j = 255 * dest[0] + k * (rgb[0] - dest[0]);
+		dest[0] = (j + (j >> 8) + 1) >> 8;
+		j = 255 * dest[1] + k * (rgb[1] - dest[1]);
+		dest[1] = (j + (j >> 8) + 1) >> 8;
+		j = 255 * dest[2] + k * (rgb[2] - dest[2]);
+		dest[2] = (j + (j >> 8) + 1) >> 8;
+	}
+}
+
 void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 	int x, int y, chanlist xtra_img)
 {
@@ -1974,13 +2017,13 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 			}
 			px = *src;
 			src += rr.zoom;
-			for(; i < ii; i++)
-			{
-				dest[0] = rr.pal[px].red;
-				dest[1] = rr.pal[px].green;
-				dest[2] = rr.pal[px].blue;
-				dest += 3;
-			}
+			if (i >= ii) continue;
+			dest[0] = rr.pal[px].red;
+			dest[1] = rr.pal[px].green;
+			dest[2] = rr.pal[px].blue;
+			rgb_fill(dest, ii - i);
+			dest += (ii - i) * 3;
+			i = ii;
 		}
 	}
 
@@ -2002,7 +2045,6 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 				i = ii;
 				continue;
 			}
-rr2_as:
 			if (rr.opac == 255)
 			{
 				dest[0] = rr.pal[px].red;
@@ -2011,21 +2053,17 @@ rr2_as:
 			}
 			else
 			{
-				j = 255 * dest[0] + rr.opac * (rr.pal[px].red - dest[0]);
-				dest[0] = (j + (j >> 8) + 1) >> 8;
-				j = 255 * dest[1] + rr.opac * (rr.pal[px].green - dest[1]);
-				dest[1] = (j + (j >> 8) + 1) >> 8;
-				j = 255 * dest[2] + rr.opac * (rr.pal[px].blue - dest[2]);
-				dest[2] = (j + (j >> 8) + 1) >> 8;
+				unsigned char crgb[3] = { rr.pal[px].red,
+					rr.pal[px].green, rr.pal[px].blue };
+
+				/* Over varying background, blend each pixel */
+				rgb_blend_run(dest, async_bk ? ii - i : 1, crgb,
+					rr.opac);
 			}
-rr2_s:
-			dest += 3;
-			if (++i >= ii) continue;
-			if (async_bk) goto rr2_as;
-			dest[0] = *(dest - 3);
-			dest[1] = *(dest - 2);
-			dest[2] = *(dest - 1);
-			goto rr2_s;
+			/* Opaque or same background all over - replicate */
+			if ((rr.opac == 255) || !async_bk) rgb_fill(dest, ii - i);
+			dest += (ii - i) * 3;
+			i = ii;
 		}
 	}
 
@@ -2039,13 +2077,13 @@ rr2_s:
 				if (i > rr.width) break;
 				ii += rr.xwid;
 			}
-			for(; i < ii; i++)
-			{
-				dest[0] = src[0];
-				dest[1] = src[1];
-				dest[2] = src[2];
-				dest += 3;
-			}
+			if (i >= ii) continue;
+			dest[0] = src[0];
+			dest[1] = src[1];
+			dest[2] = src[2];
+			rgb_fill(dest, ii - i);
+			dest += (ii - i) * 3;
+			i = ii;
 		}
 	}
 
@@ -2067,30 +2105,18 @@ rr2_s:
 			}
 			k = rr.opac * alpha[0];
 			k = (k + (k >> 8) + 1) >> 8;
-rr4_as:
 			if (k == 255)
 			{
 				dest[0] = src[0];
 				dest[1] = src[1];
 				dest[2] = src[2];
 			}
-			else
-			{
-				j = 255 * dest[0] + k * (src[0] - dest[0]);
-				dest[0] = (j + (j >> 8) + 1) >> 8;
-				j = 255 * dest[1] + k * (src[1] - dest[1]);
-				dest[1] = (j + (j >> 8) + 1) >> 8;
-				j = 255 * dest[2] + k * (src[2] - dest[2]);
-				dest[2] = (j + (j >> 8) + 1) >> 8;
-			}
-rr4_s:
-			dest += 3;
-			if (++i >= ii) continue;
-			if (async_bk) goto rr4_as;
-			dest[0] = *(dest - 3);
-			dest[1] = *(dest - 2);
-			dest[2] = *(dest - 1);
-			goto rr4_s;
+			/* Over varying background, blend each pixel */
+			else rgb_blend_run(dest, async_bk ? ii - i : 1, src, k);
+			/* Opaque or same background all over - replicate */
+			if ((k == 255) || !async_bk) rgb_fill(dest, ii - i);
+			dest += (ii - i) * 3;
+			i = ii;
 		}
 	}
 }
@@ -2099,7 +2125,7 @@ void overlay_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 	int x, int y, chanlist xtra_img)
 {
 	renderstate rr = *r;
-	unsigned char *alpha, *sel, *mask, *dest;
+	unsigned char *alpha, *sel, *mask, *dest, *d0, bk[3];
 	int i, j, k, ii, dw, opA, opS, opM, t0, t1, t2, t3;
 
 	if (xtra_img)
@@ -2165,22 +2191,36 @@ void overlay_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 			t2 += j * channel_rgb[CHN_MASK][1];
 			t3 += j * channel_rgb[CHN_MASK][2];
 		}
+		if (!t0) /* Blending would leave pixels unchanged */
+		{
+			dest += (ii - i) * 3;
+			i = ii;
+			continue;
+		}
 		j = (256 * 255) - t0;
-or_as:
-		k = t1 + j * dest[0];
-		dest[0] = (k + (k >> 8) + 0x100) >> 16;
-		k = t2 + j * dest[1];
-		dest[1] = (k + (k >> 8) + 0x100) >> 16;
-		k = t3 + j * dest[2];
-		dest[2] = (k + (k >> 8) + 0x100) >> 16;
-or_s:
-		dest += 3;
-		if (++i >= ii) continue;
-		if (async_bk) goto or_as;
-		dest[0] = *(dest - 3);
-		dest[1] = *(dest - 2);
-		dest[2] = *(dest - 1);
-		goto or_s;
+		/* Over varying background, blend each pixel; a pixel same
+		 * as the one before it gets the same result */
+		for (k = async_bk ? ii - i : 1 , d0 = dest; k > 0; k-- , dest += 3)
+		{
+			if ((dest > d0) && (dest[0] == bk[0]) &&
+				(dest[1] == bk[1]) && (dest[2] == bk[2]))
+			{
+				dest[0] = dest[-3];
+				dest[1] = dest[-2];
+				dest[2] = dest[-1];
+				continue;
+			}
+			bk[0] = dest[0]; bk[1] = dest[1]; bk[2] = dest[2];
+			t0 = t1 + j * dest[0];
+			dest[0] = (t0 + (t0 >> 8) + 0x100) >> 16;
+			t0 = t2 + j * dest[1];
+			dest[1] = (t0 + (t0 >> 8) + 0x100) >> 16;
+			t0 = t3 + j * dest[2];
+			dest[2] = (t0 + (t0 >> 8) + 0x100) >> 16;
+		}
+		if (!async_bk) rgb_fill(dest - 3, ii - i);
+		dest = d0 + (ii - i) * 3;
+		i = ii;
 	}
 }
 
@@ -2190,7 +2230,7 @@ void overlay_preview(renderstate *r, unsigned char *rgb, unsigned char *map,
 {
 	renderstate rr = *r;
 	unsigned char *dest, crgb[3] = {INT_2_R(col), INT_2_G(col), INT_2_B(col)};
-	int i, j, k, ii, dw;
+	int i, k, ii, dw;
 
 	dest = rgb;
 	ii = rr.dx;
@@ -2203,21 +2243,11 @@ void overlay_preview(renderstate *r, unsigned char *rgb, unsigned char *map,
 		}
 		k = opacity * map[dw];
 		k = (k + (k >> 8) + 1) >> 8;
-op_as:
-		j = 255 * dest[0] + k * (crgb[0] - dest[0]);
-		dest[0] = (j + (j >> 8) + 1) >> 8;
-		j = 255 * dest[1] + k * (crgb[1] - dest[1]);
-		dest[1] = (j + (j >> 8) + 1) >> 8;
-		j = 255 * dest[2] + k * (crgb[2] - dest[2]);
-		dest[2] = (j + (j >> 8) + 1) >> 8;
-op_s:
-		dest += 3;
-		if (++i >= ii) continue;
-		if (async_bk) goto op_as;
-		dest[0] = *(dest - 3);
-		dest[1] = *(dest - 2);
-		dest[2] = *(dest - 1);
-		goto op_s;
+		/* Over varying background, blend each pixel */
+		rgb_blend_run(dest, async_bk ? ii - i : 1, crgb, k);
+		if (!async_bk) rgb_fill(dest, ii - i);
+		dest += (ii - i) * 3;
+		i = ii;
 	}
 }
 
@@ -2521,7 +2551,8 @@ static void main_render(u_render_state *u, int py, int ph)
 	grad_render_state grstate;
 	renderstate rs;
 	unsigned char *rgb, **tlist = r.tlist, *overlay = u->m.overlay;
-	int j, jj, j0, l, pw2, pw;
+	unsigned char **img = mem_img, **mip;
+	int j, jj, j0, l, pw2, pw, step = 1;
 
 	/* ****** Init phase ****** */
 
@@ -2550,9 +2581,15 @@ static void main_render(u_render_state *u, int py, int ph)
 	/* Paste preview */
 	if (u->pflag) init_paste_render(&u->m, &u->p, &r);
 
+	/* Decimated copy will do if nothing else reads the image */
+	if (!(u->tflag | u->xflag | u->gflag | u->pflag) && !overlay &&
+		(mip = mem_mip_get(&mem_image, mem_mip_step(r.zoom))))
+		img = mip , step = mem_mip_step(r.zoom);
+
 	/* Start rendering */
 	pw2 = r.rxy[2] - r.rxy[0];
-	setup_row(&rs, r.rxy[0], pw2, r.zoom, r.scale, mem_width, r.xpm, r.lop,
+	setup_row(&rs, r.rxy[0], pw2, r.zoom / step, r.scale,
+		ceil_div(mem_width, step), r.xpm, r.lop,
 		u->gflag && grstate.rgb ? 3 : mem_img_bpp, mem_pal);
 	rs.cmask = (hide_image ? CMASK_IMAGE : 0) |
 		(channel_dis[CHN_ALPHA] ? CMASK_ALPHA : 0) |
@@ -2621,8 +2658,8 @@ static void main_render(u_render_state *u, int py, int ph)
 			memcpy(rgb, rgb - pw, pw2);
 			continue;
 		}
-		render_row(&rs, rgb, mem_img, r.dx, j, tlist);
-		if (!overlay) overlay_row(&rs, rgb, mem_img, r.dx, j, tlist);
+		render_row(&rs, rgb, img, r.dx / step, j / step, tlist);
+		if (!overlay) overlay_row(&rs, rgb, img, r.dx / step, j / step, tlist);
 		else overlay_preview(&rs, rgb, overlay, csel_preview, csel_preview_a);
 	}
 }
@@ -3094,13 +3131,13 @@ static void do_canvas_render(tcb *thread)
 
 int kpix_threads;	// Min kpixels per render thread
 
-static int paint_canvas(void *dt, void **wdata, int what, void **where,
-	rgbcontext *ctx)
+/* Render image, layers and background; return TRUE if paste is shown */
+static int render_canvas(rgbcontext *ctx)
 {
 	u_render_state u;
 	unsigned char *irgb, *rgb = ctx->rgb;
-	int rect[4], vxy[4];
-	int i, px, py, pw, ph, zoom = 1, scale = 1, paste_f = FALSE;
+	int rect[4];
+	int px, py, pw, ph, zoom = 1, scale = 1, paste_f = FALSE;
 
 	pw = ctx->xy[2] - (px = ctx->xy[0]);
 	ph = ctx->xy[3] - (py = ctx->xy[1]);
@@ -3132,6 +3169,17 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 		paste_f = u.pflag;
 	}
 
+	/* Refresh cached composites and copies, before threads get to them */
+	if (u.lr) prepare_flat();
+	if (zoom > 1)
+	{
+		mem_mip_prepare(NULL, 0);
+		if (irgb && !(u.tflag | u.xflag | u.gflag | u.pflag) &&
+			!u.m.overlay_s)
+			mem_mip_prepare(&mem_image, mem_mip_step(zoom));
+		if (u.lr) prepare_layers(zoom, 0, layers_total, FALSE);
+	}
+
 	if (bkg_flag && bkg_rgb) async_bk = render_bkg(ctx); /* Tracing image */
 	else if (!u.lr) /* Render default background if no layers shown */
 	{
@@ -3221,6 +3269,219 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 		break;
 	}
 
+	async_bk = FALSE;
+	return (paste_f);
+}
+
+/// RENDERED TILE CACHE
+
+/* Expose events mostly repaint what was on screen already, so fully rendered
+ * tiles of canvas are kept for reuse; overlays like the grid and marquee get
+ * drawn over them anew each time */
+
+#define CTILE_SIZE  256
+#define CTILE_BYTES (CTILE_SIZE * CTILE_SIZE * 3)
+#define CTILE_MIN   64	/* Slots to start with */
+#define CTILE_SHARE 16	/* Part of undo memory limit the tiles may take */
+
+typedef struct {
+	unsigned char *rgb;	// Rendered pixels
+	int x, y;		// Tile position on canvas, in tiles
+	int use;		// LRU stamp
+} canvas_tile;
+
+static canvas_tile *ctiles;
+static double ctile_zoom;
+static int ctile_slots, ctile_margins[2], ctile_stamp, ctile_cnt;
+
+/* Drop tiles in canvas area; NULL means all */
+void canvas_tiles_dirty(int *rxy)
+{
+	canvas_tile *t;
+	int i, x0, y0, x1, y1;
+
+	if (rxy)
+	{
+		x0 = floor_div(rxy[0], CTILE_SIZE);
+		y0 = floor_div(rxy[1], CTILE_SIZE);
+		x1 = floor_div(rxy[2] - 1, CTILE_SIZE);
+		y1 = floor_div(rxy[3] - 1, CTILE_SIZE);
+	}
+	for (i = 0; i < ctile_slots; i++)
+	{
+		t = ctiles + i;
+		if (!t->rgb) continue;
+		if (rxy && ((t->x < x0) || (t->x > x1) ||
+			(t->y < y0) || (t->y > y1))) continue;
+		free(t->rgb);
+		t->rgb = NULL;
+		ctile_cnt--;
+	}
+}
+
+/* Release all the cache memory */
+void canvas_tiles_free()
+{
+	canvas_tiles_dirty(NULL);
+	free(ctiles);
+	ctiles = NULL;
+	ctile_slots = 0;
+}
+
+size_t canvas_tiles_size()
+{
+	return ((size_t)ctile_cnt * CTILE_BYTES);
+}
+
+/* Have slots for all tiles in viewport, lest they evict each other on every
+ * repaint; return FALSE if the viewport is too big to cache in the memory
+ * budget */
+static int fit_tiles()
+{
+	canvas_tile *tmp;
+	int n, nmax, vxy[4];
+
+	cmd_peekv(drawing_canvas, vxy, sizeof(vxy), CANVAS_VPORT);
+	/* Unaligned viewport can touch one more tile each way */
+	n = ((vxy[2] - vxy[0] + CTILE_SIZE - 1) / CTILE_SIZE + 1) *
+		((vxy[3] - vxy[1] + CTILE_SIZE - 1) / CTILE_SIZE + 1);
+	nmax = ((size_t)mem_undo_limit * (1024 * 1024) / CTILE_SHARE) /
+		CTILE_BYTES;
+	if (n > nmax) return (FALSE);
+	if (n < CTILE_MIN) n = CTILE_MIN;
+	if (n > nmax) n = nmax;
+	if (ctile_slots > nmax) canvas_tiles_free(); // Budget got lowered
+	if (n <= ctile_slots) return (TRUE);
+	if (!(tmp = realloc(ctiles, n * sizeof(canvas_tile)))) return (FALSE);
+	memset(tmp + ctile_slots, 0, (n - ctile_slots) * sizeof(canvas_tile));
+	ctiles = tmp;
+	ctile_slots = n;
+	return (TRUE);
+}
+
+/* Only plain rendering gets cached, not previews */
+static int canvas_cacheable()
+{
+	return (!(bkg_flag && bkg_rgb) && !mem_preview && !xhold_preview &&
+		!noise_preview && !csel_overlay &&
+		!((tool_type == TOOL_GRADIENT) && grad_opacity) &&
+		!(show_paste && (marq_status >= MARQUEE_PASTE)));
+}
+
+static canvas_tile *get_tile(int x, int y, int render)
+{
+	rgbcontext tctx;
+	canvas_tile *t, *slot = ctiles;
+	int i;
+
+	for (i = 0; i < ctile_slots; i++)
+	{
+		t = ctiles + i;
+		if (!t->rgb)
+		{
+			if (slot->rgb) slot = t;
+			continue;
+		}
+		if ((t->x == x) && (t->y == y)) break;
+		if (slot->rgb && (t->use - slot->use < 0)) slot = t;
+	}
+
+	if (i >= ctile_slots) /* Render a new one */
+	{
+		if (!render) return (NULL);
+		t = slot;
+		if (!t->rgb)
+		{
+			/* Short of memory - let go of what is there */
+			if (!(t->rgb = malloc(CTILE_BYTES)))
+			{
+				canvas_tiles_dirty(NULL);
+				return (NULL);
+			}
+			ctile_cnt++;
+		}
+		t->x = x;
+		t->y = y;
+		tctx.xy[2] = (tctx.xy[0] = x * CTILE_SIZE) + CTILE_SIZE;
+		tctx.xy[3] = (tctx.xy[1] = y * CTILE_SIZE) + CTILE_SIZE;
+		tctx.rgb = t->rgb;
+		render_canvas(&tctx);
+	}
+	t->use = ++ctile_stamp;
+	return (t);
+}
+
+/* Fill context from cached tiles, rendering those missing; parts too small
+ * to be worth a full tile get rendered apart */
+static int render_tiles(rgbcontext *ctx)
+{
+	rgbcontext pctx;
+	canvas_tile *t;
+	unsigned char *src, *dest;
+	int i, j, k, w, l, rxy[4];
+	int pw = (ctx->xy[2] - ctx->xy[0]) * 3;
+
+	if (!fit_tiles()) return (FALSE);
+	if ((ctile_zoom != can_zoom) || (ctile_margins[0] != margin_main_x) ||
+		(ctile_margins[1] != margin_main_y))
+	{
+		canvas_tiles_dirty(NULL);
+		ctile_zoom = can_zoom;
+		ctile_margins[0] = margin_main_x;
+		ctile_margins[1] = margin_main_y;
+	}
+
+	for (j = floor_div(ctx->xy[1], CTILE_SIZE);
+		j * CTILE_SIZE < ctx->xy[3]; j++)
+	for (i = floor_div(ctx->xy[0], CTILE_SIZE);
+		i * CTILE_SIZE < ctx->xy[2]; i++)
+	{
+		clip(rxy, i * CTILE_SIZE, j * CTILE_SIZE, (i + 1) * CTILE_SIZE,
+			(j + 1) * CTILE_SIZE, ctx->xy);
+		w = (rxy[2] - rxy[0]) * 3;
+		dest = ctx->rgb + (rxy[1] - ctx->xy[1]) * pw +
+			(rxy[0] - ctx->xy[0]) * 3;
+
+		if ((t = get_tile(i, j, (rxy[2] - rxy[0]) * (rxy[3] - rxy[1]) *
+			4 >= CTILE_SIZE * CTILE_SIZE)))
+		{
+			src = t->rgb + ((rxy[1] - j * CTILE_SIZE) * CTILE_SIZE +
+				rxy[0] - i * CTILE_SIZE) * 3;
+			l = CTILE_SIZE * 3;
+		}
+		else /* Render directly */
+		{
+			if (!(pctx.rgb = malloc(w * (rxy[3] - rxy[1]))))
+				return (FALSE);
+			copy4(pctx.xy, rxy);
+			render_canvas(&pctx);
+			src = pctx.rgb;
+			l = w;
+		}
+		for (k = rxy[1]; k < rxy[3]; k++ , src += l , dest += pw)
+			memcpy(dest, src, w);
+		if (!t) free(pctx.rgb);
+	}
+	return (TRUE);
+}
+
+static int paint_canvas(void *dt, void **wdata, int what, void **where,
+	rgbcontext *ctx)
+{
+	unsigned char *irgb, *rgb = ctx->rgb;
+	int rect[4], vxy[4];
+	int i, px, py, pw, ph, scale = 1, paste_f = FALSE;
+
+	pw = ctx->xy[2] - (px = ctx->xy[0]);
+	ph = ctx->xy[3] - (py = ctx->xy[1]);
+
+	if (!canvas_cacheable() || !render_tiles(ctx))
+		paste_f = render_canvas(ctx);
+
+	irgb = clip_to_image(rect, rgb, ctx->xy);
+	/* !!! This uses the fact that zoom factor is either N or 1/N !!! */
+	if (can_zoom >= 1.0) scale = rint(can_zoom);
+
 	/* No grid at all */
 	if (!mem_show_grid || (scale < mem_grid_min));
 	/* No paste - single area */
@@ -3255,8 +3516,6 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 	if (seg_preview && irgb) draw_segments(irgb, rect[0], rect[1],
 		rect[2] - rect[0], rect[3] - rect[1], pw);
 
-	async_bk = FALSE;
-
 /* !!! All other over-the-image things have to be redrawn here as well !!! */
 	prepare_line_clip(vxy, ctx->xy, scale);
 	/* Redraw gradient line if needed */
@@ -3298,6 +3557,7 @@ void main_update_area(int x, int y, int w, int h)
 {
 	int zoom, scale, rxy[4];
 
+	mem_mip_dirty(&mem_image, x, y, w, h);
 	if (can_zoom < 1.0)
 	{
 		zoom = rint(1.0 / can_zoom);
@@ -3322,6 +3582,7 @@ void main_update_area(int x, int y, int w, int h)
 
 	rxy[2] = (rxy[0] = x + margin_main_x) + w;
 	rxy[3] = (rxy[1] = y + margin_main_y) + h;
+	canvas_tiles_dirty(rxy);
 	cmd_setv(drawing_canvas, rxy, CANVAS_REPAINT);
 }
 
@@ -4950,6 +5211,8 @@ void action_dispatch(int action, int mode, int state, int kbd)
 		pressed_xhold(); break;
 	case DLG_NOISE:
 		pressed_noise(); break;
+	case DLG_CONVERT:
+		pressed_convert(); break;
 	case FILT_2RGB:
 		if (mem_img_bpp == 1) pressed_convert_rgb();
 		// Allow a noop in script mode
@@ -5176,6 +5439,7 @@ static void *main_menu_code[] = {
 	MENUITEMis(_("//Save"), ACTMOD(ACT_SAVE, 0), XPM_ICON(save)),
 		SHORTCUT(s, C),
 	MENUITEMs(_("//Save As ..."), ACTMOD(DLG_FSEL, FS_PNG_SAVE)),
+	uMENUITEMs("//convert", ACTMOD(DLG_CONVERT, 0)), // for scripting
 	MENUSEP, //
 	MENUITEMs(_("//Export Undo Images ..."), ACTMOD(DLG_FSEL, FS_EXPORT_UNDO)),
 		ACTMAP(NEED_UNDO),
@@ -134,6 +134,7 @@ enum { // To let constants renumber themselves when adding new ones
 	DLG_KEYS,
 	DLG_XHOLD,
 	DLG_NOISE,
+	DLG_CONVERT,
 
 	FILT_2RGB,
 	FILT_INVERT,
@@ -334,6 +335,9 @@ void canvas_size(int *w, int *h);	// Get zoomed canvas size
 void prepare_line_clip(int *lxy, int *vxy, int scale);	// Map clipping rectangle to line-space
 void main_update_area(int x, int y, int w, int h);	// Update x,y,w,h area of current image
 void repaint_canvas( int px, int py, int pw, int ph );		// Redraw area of canvas
+void canvas_tiles_dirty(int *rxy);	// Drop cached render of canvas area
+void canvas_tiles_free();		// Release canvas render cache
+size_t canvas_tiles_size();		// Memory used by canvas render cache
 void grad_stroke(int x, int y);		// Update stroke gradient
 
 int async_bk;
@@ -814,6 +814,7 @@ static size_t undo_free_x(undo_item **undo_)
 	j = undo->size;
 	undo_free_data(undo);
 	free(undo->pal_);
+	mem_mip_free(undo->img);
 	mem_free_chanlist(undo->img);
 	memset(undo, 0, sizeof(undo_item));
 	freechunk(&undo_items, undo);
@@ -891,6 +892,7 @@ void mem_free_image(image_info *image, int mode)
 	/* Delete current image (don't rely on undo frame being up to date) */
 	if (mode & FREE_IMAGE)
 	{
+		mem_mip_free(image->img);
 		mem_free_chanlist(image->img);
 		memset(image->img, 0, sizeof(chanlist));
 		image->width = image->height = 0;
@@ -1491,8 +1493,12 @@ static int mem_undo_space(size_t mem_req)
 	/* All done if no common area */
 	if (!csz) return (0);
 
-	mem_req += mem_undo_lsize();
+	mem_req += mem_undo_lsize() + mem_mip_size() + canvas_tiles_size();
 	if (mem_req <= mem_max) return (0); // No need to trim other layers yet
+	/* Rendered canvas tiles are the cheapest to lose */
+	mem_req -= canvas_tiles_size();
+	canvas_tiles_free();
+	if (mem_req <= mem_max) return (0);
 	mem_lim -= mem_max * (mem_undo_common * 0.01); // Reserved space per layer
 
 	/* Build heap of undo stacks */
@@ -1885,7 +1891,8 @@ size_t mem_used()
 /* Return the number of bytes used in image + undo in all layers */
 size_t mem_used_layers()
 {
-	return (mem_used() + mem_undo_lsize());
+	return (mem_used() + mem_undo_lsize() + mem_mip_size() +
+		canvas_tiles_size());
 }
 
 /* Fast approximate atan2() function, returning result in degrees. This code is
@@ -2291,7 +2298,11 @@ void mem_get_histogram(int channel)	// Calculate how many of each colour index i
 
 typedef struct {
 	int last_gamma, last_br, last_co, last_ps;
+	int key[8];	// Parameters the composed tables were built for
 	unsigned char gamma_table[256], bc_table[256], ps_table[256];
+	/* Composed tables: before hue, after hue, after saturation, and
+	 * all-in-one per-channel ones for when no cross-channel ops are done */
+	unsigned char pre[256], mid[256], post[256], sep[3][256];
 } transform_cache;
 
 void do_transform(int start, int step, int cnt, unsigned char *mask,
@@ -2302,8 +2313,8 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	static transform_cache tc[2];
 	int do_gamma, do_bc, /*do_sa,*/ do_ps;
 	unsigned char rgb[3];
-	int br, co, sa;
-	int dH, sH, tH, ix0, ix1, ix2, c0, c1, c2, dc = 0, ops = 0;
+	int br, co, sa, key[8];
+	int dH, sH, tH, ix0, ix1, ix2, c0, c1, c2, dc = 0, xch, ops = 0;
 	int j, mstep, r, g, b;
 	transform_cache *tp = tc;
 	transform_state *mp = mem_bcsp;
@@ -2386,6 +2397,33 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 		}
 	}
 	ix0 = ixx[dc]; ix1 = ixx[dc + 1]; ix2 = ixx[dc + 2];
+	xch = dH | dc; // Hue shift or channel rotation
+
+	/* Compose the per-channel stages into as few lookups as possible:
+	 * gamma goes before hue, brightness-contrast before saturation, and
+	 * posterize last; with neither hue nor saturation, everything
+	 * including channel masking collapses into one table per channel */
+	key[0] = TRUE; key[1] = do_gamma; key[2] = do_bc ? br : 0;
+	key[3] = do_bc ? co : 256; key[4] = do_ps; key[5] = !!xch;
+	key[6] = !!sa; key[7] = ops;
+	if (memcmp(key, tp->key, sizeof(key)))
+	{
+		int i, v;
+
+		for (i = 0; i < 256; i++)
+		{
+			v = do_gamma ? tp->gamma_table[i] : i;
+			if (!xch && do_bc) v = tp->bc_table[v];
+			tp->pre[i] = v;
+			tp->mid[i] = xch && do_bc ? tp->bc_table[i] : i;
+			tp->post[i] = do_ps ? tp->ps_table[i] : i;
+			if (do_ps) v = tp->ps_table[v];
+			tp->sep[0][i] = ops & 0xFF ? i : v;
+			tp->sep[1][i] = ops & 0xFF00 ? i : v;
+			tp->sep[2][i] = ops & 0xFF0000 ? i : v;
+		}
+		memcpy(tp->key, key, sizeof(key));
+	}
 
 	/* Use fake mask if no real one provided */
 	if (!mask) mask = &fmask , mstep = 0;
@@ -2394,20 +2432,73 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	start *= 3; step *= 3; // Step by triples
 	img0 += start - step;
 	imgr += start - step;
+
+	/* The loops below stay scalar C: their work is table lookups, which
+	 * portable vector code cannot do any faster, and the tree carries no
+	 * per-architecture code; speedup comes from threads instead */
+
+	/* Only per-channel transforms - a table lookup per channel */
+	if (!xch && !sa)
+	{
+		unsigned char *l0 = tp->sep[0], *l1 = tp->sep[1], *l2 = tp->sep[2];
+
+		while (cnt-- > 0)
+		{
+			img0 += step; imgr += step; mask += mstep;
+			if (*mask == (unsigned char)m0) continue;
+			r = l0[img0[0]];
+			g = l1[img0[1]];
+			b = l2[img0[2]];
+			imgr[0] = r;
+			imgr[1] = g;
+			imgr[2] = b;
+		}
+		return;
+	}
+
+	/* No hue transform - saturation between two composed tables */
+	if (!xch)
+	{
+		unsigned char *pre = tp->pre, *post = tp->post;
+
+		while (cnt-- > 0)
+		{
+			img0 += step; imgr += step; mask += mstep;
+			if (*mask == (unsigned char)m0) continue;
+			r = pre[img0[0]];
+			g = pre[img0[1]];
+			b = pre[img0[2]];
+			j = (299 * r + 587 * g + 114 * b) / 1000;
+			r = r * 256 + (r - j) * sa;
+			r = r < 0 ? 0 : r > (255 * 256) ? 255 : r >> 8;
+			g = g * 256 + (g - j) * sa;
+			g = g < 0 ? 0 : g > (255 * 256) ? 255 : g >> 8;
+			b = b * 256 + (b - j) * sa;
+			b = b < 0 ? 0 : b > (255 * 256) ? 255 : b >> 8;
+			r = post[r];
+			g = post[g];
+			b = post[b];
+			if (ops)
+			{
+				r ^= (r ^ img0[0]) & ops;
+				g ^= (g ^ img0[1]) & (ops >> 8);
+				b ^= (b ^ img0[2]) & (ops >> 16);
+			}
+			imgr[0] = r;
+			imgr[1] = g;
+			imgr[2] = b;
+		}
+		return;
+	}
+
+	/* Full transform, with hue */
 	while (cnt-- > 0)
 	{
 		img0 += step; imgr += step; mask += mstep;
 		if (*mask == (unsigned char)m0) continue;
-		rgb[0] = img0[0];
-		rgb[1] = img0[1];
-		rgb[2] = img0[2];
-		/* If we do gamma transform */
-		if (do_gamma)
-		{
-			rgb[0] = tp->gamma_table[rgb[0]];
-			rgb[1] = tp->gamma_table[rgb[1]];
-			rgb[2] = tp->gamma_table[rgb[2]];
-		}
+		rgb[0] = tp->pre[img0[0]];
+		rgb[1] = tp->pre[img0[1]];
+		rgb[2] = tp->pre[img0[2]];
 		/* If we do hue transform & colour has a hue */
 		if (dH && ((rgb[0] ^ rgb[1]) | (rgb[0] ^ rgb[2])))
 		{
@@ -2441,16 +2532,10 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 				rgb[c0] -= j + g - b;
 			}
 		}
-		r = rgb[ix0];
-		g = rgb[ix1];
-		b = rgb[ix2];
-		/* If we do brightness/contrast transform */
-		if (do_bc)
-		{
-			r = tp->bc_table[r];
-			g = tp->bc_table[g];
-			b = tp->bc_table[b];
-		}
+		/* Brightness/contrast comes after hue here */
+		r = tp->mid[rgb[ix0]];
+		g = tp->mid[rgb[ix1]];
+		b = tp->mid[rgb[ix2]];
 		/* If we do saturation transform */
 		if (sa)
 		{
@@ -2462,13 +2547,9 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 			b = b * 256 + (b - j) * sa;
 			b = b < 0 ? 0 : b > (255 * 256) ? 255 : b >> 8;
 		}
-		/* If we do posterize transform */
-		if (do_ps)
-		{
-			r = tp->ps_table[r];
-			g = tp->ps_table[g];
-			b = tp->ps_table[b];
-		}
+		r = tp->post[r];
+		g = tp->post[g];
+		b = tp->post[b];
 		/* If we do channel masking */
 		if (ops)
 		{
@@ -2482,6 +2563,55 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	}
 }
 
+typedef struct {
+	unsigned char *mask, *xbuf;
+} xformd;
+
+static void transform_rows(tcb *thread)
+{
+	xformd *xd = thread->data;
+	unsigned char *mask0 = NULL, *img, *mask = xd->mask, *xbuf = xd->xbuf;
+	int i, ii, cnt = thread->nsteps;
+
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	{
+		if (!channel_dis[CHN_MASK] && mem_img[CHN_MASK])
+			mask0 = mem_img[CHN_MASK] + i * mem_width;
+		img = mem_img[CHN_IMAGE] + i * mem_width * 3;
+		prep_mask(0, 1, mem_width, mask, mask0, img);
+		do_transform(0, 1, mem_width, mask, xbuf, img, 255);
+		process_img(0, 1, mem_width, mask, img, img, xbuf,
+			NULL, 3, BLENDF_SET | BLENDF_INVM);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+/* Apply colour transform to whole RGB image, using helper threads */
+void mem_transform_image()
+{
+	xformd xd;
+	threaddata *tdata;
+
+	if (mem_img_bpp != 3) return;
+	tdata = talloc(MA_ALIGN_DEFAULT,
+		image_threads(mem_width, mem_height),
+		&xd, sizeof(xd),
+		NULL,
+		&xd.mask, mem_width,
+		&xd.xbuf, mem_width * 3,
+		NULL);
+	if (!tdata)
+	{
+		memory_errors(1);
+		return;
+	}
+	/* Build the tables here, before threads get to them */
+	do_transform(0, 0, 0, NULL, NULL, NULL, 255);
+	launch_threads(transform_rows, tdata, NULL, mem_height);
+	free(tdata);
+}
+
 static unsigned char pal_dupes[256];
 
 int scan_duplicates()	// Find duplicate palette colours, return number found
@@ -3547,24 +3677,343 @@ int mem_quantize( unsigned char *old_mem_image, int target_cols, int type )
 	return 0;
 }
 
+typedef struct {
+	band_func what;
+	void *data;
+	unsigned char *buf;
+} bandd;
+
+static void do_bands(tcb *thread)
+{
+	bandd *bd = thread->data;
+
+	bd->what(bd->data, bd->buf, thread->step0, thread->nsteps);
+	thread_done(thread);
+}
+
+/* Run an operation over cnt rows of w pixels, in bands on helper threads;
+ * each thread gets its own buffer of bsize bytes. Without a buffer, the
+ * operation runs unthreaded if threads cannot be set up, or if called from
+ * a thread already doing some launch's work */
+int mem_bands(band_func what, void *data, int w, int cnt, int bsize)
+{
+	bandd bd;
+	threaddata *tdata;
+
+	if (cnt <= 0) return (TRUE);
+	if (!bsize && thread_nested())
+	{
+		what(data, NULL, 0, cnt);
+		return (TRUE);
+	}
+	bd.what = what;
+	bd.data = data;
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(w, cnt), &bd, sizeof(bd),
+		NULL,
+		&bd.buf, bsize,
+		NULL);
+	if (!tdata)
+	{
+		if (bsize) return (FALSE);
+		what(data, NULL, 0, cnt);
+		return (TRUE);
+	}
+	tdata->silent = TRUE;
+	launch_threads(do_bands, tdata, NULL, cnt);
+	free(tdata);
+	return (TRUE);
+}
+
+/// DECIMATED IMAGE CACHE
+
+/* Zoomed-out views show every Nth pixel of every Nth row; a copy of the image
+ * decimated by a power of 2 dividing N renders exactly the same, but from far
+ * fewer cache lines. Copies are rebuilt lazily, and only where changed */
+
+#define MIP_SLOTS   16	/* Cached copies */
+#define MIP_MAXSTEP 64	/* Coarsest decimation kept */
+
+typedef struct {
+	chanlist src;		// Source channels, as cache key
+	chanlist img;		// Decimated channels
+	unsigned char *mem;	// Memory block holding them
+	size_t size;		// Its size
+	int w, h, bpp;		// Source geometry
+	int step, lw, lh;	// Decimation step and copy geometry
+	int dirty[4];		// Source area to refresh: x0, y0, x1, y1
+	int frame;		// Last frame it was used in
+} mip_level;
+
+static mip_level mips[MIP_SLOTS];
+static size_t mip_mem;
+static int mip_frame;
+
+static void mip_drop(mip_level *m)
+{
+	free(m->mem);
+	mip_mem -= m->size;
+	memset(m, 0, sizeof(mip_level));
+}
+
+/* Drop copies of image channels about to be freed */
+void mem_mip_free(chanlist img)
+{
+	mip_level *m;
+
+	if (!img[CHN_IMAGE]) return;
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+		if (m->mem && (m->src[CHN_IMAGE] == img[CHN_IMAGE])) mip_drop(m);
+}
+
+/* Memory the copies take, to count it with the undo */
+size_t mem_mip_size()
+{
+	return (mip_mem);
+}
+
+/* Decimation step for given zoom, or 0 if not worth caching */
+int mem_mip_step(int zoom)
+{
+	int step = zoom & -zoom; /* Largest power of 2 dividing it */
+
+	if ((zoom < 4) || (step < 2)) return (0);
+	return (step > MIP_MAXSTEP ? MIP_MAXSTEP : step);
+}
+
+static int mip_match(mip_level *m, image_info *image)
+{
+	return (m->mem && (m->w == image->width) && (m->h == image->height) &&
+		(m->bpp == image->bpp) &&
+		!memcmp(m->src, image->img, sizeof(chanlist)));
+}
+
+/* Mark area of image as changed; NULL image means all of every image */
+void mem_mip_dirty(image_info *image, int x, int y, int w, int h)
+{
+	mip_level *m;
+	int x1, y1, *d;
+
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+	{
+		if (!m->mem) continue;
+		d = m->dirty;
+		if (!image)
+		{
+			d[0] = d[1] = 0;
+			d[2] = m->w;
+			d[3] = m->h;
+			continue;
+		}
+		if (m->src[CHN_IMAGE] != image->img[CHN_IMAGE]) continue;
+		x1 = x + w; y1 = y + h;
+		if (x < 0) x = 0;
+		if (y < 0) y = 0;
+		if (x1 > m->w) x1 = m->w;
+		if (y1 > m->h) y1 = m->h;
+		if ((x >= x1) || (y >= y1)) continue;
+		if (d[0] >= d[2]) /* Was clean */
+		{
+			d[0] = x; d[1] = y; d[2] = x1; d[3] = y1;
+			continue;
+		}
+		if (d[0] > x) d[0] = x;
+		if (d[1] > y) d[1] = y;
+		if (d[2] < x1) d[2] = x1;
+		if (d[3] < y1) d[3] = y1;
+	}
+}
+
+typedef struct {
+	mip_level *m;
+	unsigned char **src;	// Source channels
+	int sw, sstep;		// Source row length, and decimation to apply
+	int x0, x1, y0;		// Area of copy to refresh
+} mipd;
+
+static void mip_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	mipd *d = data;
+	mip_level *m = d->m;
+	unsigned char *src, *dest;
+	int i, j, k, bpp, n = d->x1 - d->x0, step = d->sstep;
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!m->img[i]) continue;
+		bpp = i == CHN_IMAGE ? m->bpp : 1;
+		for (j = d->y0 + start; j < d->y0 + start + cnt; j++)
+		{
+			src = d->src[i] + ((size_t)j * step * d->sw +
+				d->x0 * step) * bpp;
+			dest = m->img[i] + ((size_t)j * m->lw + d->x0) * bpp;
+			if (bpp == 1) for (k = 0; k < n; k++ , src += step)
+				*dest++ = *src;
+			else for (k = 0; k < n; k++ , src += step * 3)
+			{
+				dest[0] = src[0];
+				dest[1] = src[1];
+				dest[2] = src[2];
+				dest += 3;
+			}
+		}
+	}
+}
+
+/* Bring decimated copy of image up to date; NULL image starts a new frame.
+ * Call only from main thread, before render threads get to the copies */
+void mem_mip_prepare(image_info *image, int step)
+{
+	mip_level *m, *f = NULL, *slot = NULL;
+	mipd d;
+	size_t l;
+	int i, n, *dt;
+
+	if (!image)
+	{
+		mip_frame++;
+		return;
+	}
+	if (!step || !image->img[CHN_IMAGE]) return;
+
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+	{
+		if (mip_match(m, image))
+		{
+			if (m->step == step) break;
+			/* Clean finer copy can serve as source */
+			if ((m->step < step) && (m->dirty[0] >= m->dirty[2]) &&
+				(!f || (f->step < m->step))) f = m;
+		}
+		else if (m->mem && (m->src[CHN_IMAGE] == image->img[CHN_IMAGE]))
+		{
+			/* Stale copy of reallocated image */
+			mip_drop(m);
+		}
+		/* Prefer empty slots, then least recently used */
+		if (!slot || (slot->mem && (!m->mem ||
+			(m->frame - slot->frame < 0)))) slot = m;
+	}
+
+	/* Set up a new copy */
+	if (m >= mips + MIP_SLOTS)
+	{
+		if (!(m = slot) || (m->mem && (m->frame == mip_frame))) return;
+		if (m == f) f = NULL;
+		mip_drop(m);
+		m->lw = (image->width + step - 1) / step;
+		m->lh = (image->height + step - 1) / step;
+		l = (size_t)m->lw * m->lh;
+		for (n = i = 0; i < NUM_CHANNELS; i++)
+			if (image->img[i]) n += i == CHN_IMAGE ? image->bpp : 1;
+		if (!(m->mem = malloc(l * n))) return;
+		mip_mem += m->size = l * n;
+		for (n = i = 0; i < NUM_CHANNELS; i++)
+		{
+			if (!image->img[i]) continue;
+			m->img[i] = m->mem + l * n;
+			n += i == CHN_IMAGE ? image->bpp : 1;
+		}
+		memcpy(m->src, image->img, sizeof(chanlist));
+		m->w = image->width;
+		m->h = image->height;
+		m->bpp = image->bpp;
+		m->step = step;
+		m->dirty[2] = m->w;
+		m->dirty[3] = m->h;
+	}
+	m->frame = mip_frame;
+
+	/* Refresh the changed part */
+	dt = m->dirty;
+	if (dt[0] >= dt[2]) return;
+	d.m = m;
+	d.src = image->img;
+	d.sw = image->width;
+	d.sstep = step;
+	if (f)
+	{
+		d.src = f->img;
+		d.sw = f->lw;
+		d.sstep = step / f->step;
+	}
+	d.x0 = (dt[0] + step - 1) / step;
+	d.x1 = (dt[2] + step - 1) / step;
+	d.y0 = (dt[1] + step - 1) / step;
+	if (d.x0 < d.x1) mem_bands(mip_rows, &d, d.x1 - d.x0,
+		(dt[3] + step - 1) / step - d.y0, 0);
+	dt[0] = dt[1] = dt[2] = dt[3] = 0;
+}
+
+/* Get decimated copy of image, if one is ready */
+unsigned char **mem_mip_get(image_info *image, int step)
+{
+	mip_level *m;
+
+	if (step) for (m = mips; m < mips + MIP_SLOTS; m++)
+	{
+		if ((m->step == step) && mip_match(m, image) &&
+			(m->dirty[0] >= m->dirty[2])) return (m->img);
+	}
+	return (NULL);
+}
+
 /* Linear brightness for palette color */
 double pal2B(png_color *c)
 {
 	return (rgb2B(gamma256[c->red], gamma256[c->green], gamma256[c->blue]));
 }
 
-/* Convert image to greyscale */
-void mem_greyscale(int gcor)
+static void greyscale_rows(void *data, unsigned char *mask, int y0, int cnt)
 {
-	unsigned char *mask, *img = mem_img[CHN_IMAGE];
-	int i, j, k, v, ch;
+	unsigned char *img;
+	int i, j, k, v, gcor = *(int *)data;
 
-	mask = malloc(mem_width);
-	if (!mask)
+	img = mem_img[CHN_IMAGE] + y0 * mem_width * 3;
+	for (i = y0; i < y0 + cnt; i++)
 	{
-		memory_errors(1);
-		return;
+		row_protected(0, i, mem_width, mask);
+		for (j = 0; j < mem_width; j++)
+		if (paint_gamma && mask[j] && (mask[j] != 255))
+		{
+			double d, d0, d1, d2, m;
+			m = 1.0 - mask[j] / 255.0;
+			d0 = gamma256[img[0]];
+			d1 = gamma256[img[1]];
+			d2 = gamma256[img[2]];
+			/* Gamma + H-K effect / Usual */
+			d = gcor ? rgb2B(d0, d1, d2) :
+				gamma256[(299 * img[0] + 587 * img[1] +
+				114 * img[2] + 500) / 1000];
+			d0 += (d - d0) * m;
+			d1 += (d - d1) * m;
+			d2 += (d - d2) * m;
+			*img++ = UNGAMMA256(d0);
+			*img++ = UNGAMMA256(d1);
+			*img++ = UNGAMMA256(d2);
+		}
+		else
+		{
+			/* Gamma + H-K effect / Usual */
+			v = gcor ? UNGAMMA256(rgb2B(gamma256[img[0]],
+				gamma256[img[1]], gamma256[img[2]])) :
+				(299 * img[0] + 587 * img[1] +
+				114 * img[2] + 500) / 1000;
+			v *= 255 - mask[j];
+			k = *img * mask[j] + v;
+			*img++ = (k + (k >> 8) + 1) >> 8;
+			k = *img * mask[j] + v;
+			*img++ = (k + (k >> 8) + 1) >> 8;
+			k = *img * mask[j] + v;
+			*img++ = (k + (k >> 8) + 1) >> 8;
+		}
 	}
+}
+
+/* Convert image to greyscale */
+void mem_greyscale(int gcor)
+{
+	int i, v, ch;
+
 	if (mem_img_bpp == 1)
 	{
 		for (i = 0; i < 256; i++)
@@ -3588,47 +4037,10 @@ void mem_greyscale(int gcor)
 	{
 		ch = mem_channel;
 		mem_channel = CHN_IMAGE;
-		for (i = 0; i < mem_height; i++)
-		{
-			row_protected(0, i, mem_width, mask);
-			for (j = 0; j < mem_width; j++)
-			if (paint_gamma && mask[j] && (mask[j] != 255))
-			{
-				double d, d0, d1, d2, m;
-				m = 1.0 - mask[j] / 255.0;
-				d0 = gamma256[img[0]];
-				d1 = gamma256[img[1]];
-				d2 = gamma256[img[2]];
-				/* Gamma + H-K effect / Usual */
-				d = gcor ? rgb2B(d0, d1, d2) :
-					gamma256[(299 * img[0] + 587 * img[1] +
-					114 * img[2] + 500) / 1000];
-				d0 += (d - d0) * m;
-				d1 += (d - d1) * m;
-				d2 += (d - d2) * m;
-				*img++ = UNGAMMA256(d0);
-				*img++ = UNGAMMA256(d1);
-				*img++ = UNGAMMA256(d2);
-			}
-			else
-			{
-				/* Gamma + H-K effect / Usual */
-				v = gcor ? UNGAMMA256(rgb2B(gamma256[img[0]],
-					gamma256[img[1]], gamma256[img[2]])) :
-					(299 * img[0] + 587 * img[1] +
-					114 * img[2] + 500) / 1000;
-				v *= 255 - mask[j];
-				k = *img * mask[j] + v;
-				*img++ = (k + (k >> 8) + 1) >> 8;
-				k = *img * mask[j] + v;
-				*img++ = (k + (k >> 8) + 1) >> 8;
-				k = *img * mask[j] + v;
-				*img++ = (k + (k >> 8) + 1) >> 8;
-			}
-		}
+		if (!mem_bands(greyscale_rows, &gcor, mem_width, mem_height,
+			mem_width)) memory_errors(1);
 		mem_channel = ch;
 	}
-	free(mask);
 }
 
 /* Valid for x=0..5, which is enough here */
@@ -3813,11 +4225,17 @@ void mem_pal_sort( int a, int i1, int i2, int rev )		// Sort colours in palette
 	mem_col_B = map[mem_col_B];
 }
 
+static void invert_band(void *data, unsigned char *buf, int start, int cnt)
+{
+	unsigned char *img = (unsigned char *)data + start;
+
+	while (cnt-- > 0) *img++ ^= 255;
+}
+
 void mem_invert()			// Invert the palette
 {
 	int i, j;
 	png_color *col = mem_pal;
-	unsigned char *img;
 
 	if ((mem_channel == CHN_IMAGE) && (mem_img_bpp == 1))
 	{
@@ -3835,11 +4253,7 @@ void mem_invert()			// Invert the palette
 
 		j = mem_width * mem_height;
 		if (mem_channel == CHN_IMAGE) j *= 3;
-		img = mem_img[mem_channel];
-		for (i = 0; i < j; i++)
-		{
-			*img++ ^= 255;
-		}
+		mem_bands(invert_band, mem_img[mem_channel], 1, j, 0);
 		if (mask)
 		{
 			mask_merge(mem_undo_previous(mem_channel), mem_channel, mask);
@@ -3848,13 +4262,41 @@ void mem_invert()			// Invert the palette
 	}
 }
 
+typedef struct {
+	unsigned char *img, *map;
+} normd;
+
+static void normalize_scan(void *data, unsigned char *buf, int start, int cnt)
+{
+	normd *nd = data;
+	unsigned char *img = nd->img + start;
+	int i;
+	DEF_MUTEX(norm_lock);
+
+	/* Collect values locally, then merge */
+	memset(buf, 0, 256);
+	while (cnt-- > 0) buf[*img++] = 1;
+	LOCK_MUTEX(norm_lock);
+	for (i = 0; i < 256; i++) nd->map[i] |= buf[i];
+	UNLOCK_MUTEX(norm_lock);
+}
+
+static void normalize_band(void *data, unsigned char *buf, int start, int cnt)
+{
+	normd *nd = data;
+
+	do_xlate(nd->map, nd->img + start, cnt);
+}
+
 void mem_normalize()		// Normalize contrast in image or palette
 {
+	normd nd;
 	unsigned char map[256], *img = NULL;
 	png_color *col;
 	int i, uninit_(j), k, k0, k1;
 
 	memset(map, 0, 256);
+	nd.map = map;
 	if ((mem_channel == CHN_IMAGE) && (mem_img_bpp == 1))
 	{
 		for (i = 0 , col = mem_pal; i < mem_cols; i++ , col++)
@@ -3868,8 +4310,12 @@ void mem_normalize()		// Normalize contrast in image or palette
 	{
 		j = mem_width * mem_height;
 		if (mem_channel == CHN_IMAGE) j *= 3;
-		img = mem_img[mem_channel];
-		for (i = 0; i < j; i++) map[img[i]] = 1;
+		nd.img = img = mem_img[mem_channel];
+		if (!mem_bands(normalize_scan, &nd, 1, j, 256))
+		{
+			memory_errors(1);
+			return;
+		}
 	}
 
 	/* Range */
@@ -3885,7 +4331,7 @@ void mem_normalize()		// Normalize contrast in image or palette
 	{
 		unsigned char *mask = calloc(1, mem_width);
 
-		do_xlate(map, img, j);
+		mem_bands(normalize_band, &nd, 1, j, 0);
 		if (mask)
 		{
 			mask_merge(mem_undo_previous(mem_channel), mem_channel, mask);
@@ -3931,10 +4377,16 @@ void mem_prepare_map(unsigned char *map, int how)
 	}
 }
 
-void mem_remap_rgb(unsigned char *map, int what) // Remap V/R/G/B to color
+typedef struct {
+	unsigned char *map;
+	int what;
+} remapd;
+
+static void remap_band(void *data, unsigned char *buf, int start, int cnt)
 {
-	unsigned char *w, *img = mem_img[CHN_IMAGE];
-	int cnt = mem_width * mem_height;
+	remapd *rd = data;
+	unsigned char *w, *map = rd->map, *img = mem_img[CHN_IMAGE] + start * 3;
+	int what = rd->what;
 
 	/* Value */
 	if (!what) while (cnt-- > 0)
@@ -3954,6 +4406,16 @@ void mem_remap_rgb(unsigned char *map, int what) // Remap V/R/G/B to color
 		*img++ = w[1];
 		*img++ = w[2];
 	}
+}
+
+void mem_remap_rgb(unsigned char *map, int what) // Remap V/R/G/B to color
+{
+	remapd rd;
+	unsigned char *w;
+
+	rd.map = map;
+	rd.what = what;
+	mem_bands(remap_band, &rd, 1, mem_width * mem_height, 0);
 
 	w = calloc(1, mem_width);
 	if (w)
@@ -4235,6 +4697,79 @@ void g_para( int x1, int y1, int x2, int y2, int xv, int yv )
 	draw_quad(line1, line2, line3, line4);
 }
 
+/* Span collector: rows drawn while it is active are merged, to then draw each
+ * covered span only once, instead of overdrawing where brush shapes overlap;
+ * rows with a selection mask cannot be merged, so get drawn right away */
+
+static int *row_spans, span_cnt, span_max;
+static void (*span_put)(int x, int y, int len, unsigned char *xsel);
+
+static void put_pixel_row_span(int x, int y, int len, unsigned char *xsel)
+{
+	int n, *tmp;
+
+	if (len <= 0) return;
+	if (xsel) /* Selective rows go through as-is */
+	{
+		span_put(x, y, len, xsel);
+		return;
+	}
+	if (span_cnt >= span_max)
+	{
+		n = span_max ? span_max * 2 : 1024;
+		tmp = realloc(row_spans, n * 3 * sizeof(int));
+		if (!tmp) /* Not enough memory - just draw it now */
+		{
+			span_put(x, y, len, xsel);
+			return;
+		}
+		row_spans = tmp;
+		span_max = n;
+	}
+	tmp = row_spans + span_cnt++ * 3;
+	tmp[0] = y;
+	tmp[1] = x;
+	tmp[2] = x + len;
+}
+
+static int cmp_row_spans(const void *span1, const void *span2)
+{
+	const int *s1 = span1, *s2 = span2;
+	return (s1[0] != s2[0] ? s1[0] - s2[0] : s1[1] - s2[1]);
+}
+
+void init_spans()
+{
+	span_put = put_pixel_row;
+	put_pixel_row = put_pixel_row_span;
+	span_cnt = 0;
+}
+
+void render_spans()
+{
+	int i, y, x0, x1, *span = row_spans;
+
+	put_pixel_row = span_put;
+	if (!span_cnt) return;
+
+	qsort(row_spans, span_cnt, 3 * sizeof(int), cmp_row_spans);
+	for (i = 0; i < span_cnt; )
+	{
+		y = span[0];
+		x0 = span[1];
+		x1 = span[2];
+		/* Merge overlapping & adjacent spans on same row */
+		for (i++ , span += 3; (i < span_cnt) && (span[0] == y) &&
+			(span[1] <= x1); i++ , span += 3)
+			if (x1 < span[2]) x1 = span[2];
+		span_put(x0, y, x1 - x0, NULL);
+	}
+
+	free(row_spans);
+	row_spans = NULL;
+	span_cnt = span_max = 0;
+}
+
 /* Shapeburst engine */
 
 int sb_dist = DIST_L1;
@@ -4355,7 +4890,8 @@ typedef struct {
 	int x, e, v, w;
 } par_data;
 
-static void dist_pass1(int w, int h, uint32_t *dmap)
+/* Process columns x0 to x1-1 */
+static void dist_pass1(int w, int h, uint32_t *dmap, int x0, int x1)
 {
 	uint32_t m, *r0;
 	int i, j, dy;
@@ -4366,12 +4902,12 @@ static void dist_pass1(int w, int h, uint32_t *dmap)
 	while (TRUE)
 	{
 		/* First row */
-		for (i = 0; i < w; i++) if (r0[i]) r0[i] = 1;
+		for (i = x0; i < x1; i++) if (r0[i]) r0[i] = 1;
 		/* Other rows */
 		for (j = 1; j < h; j++)
 		{
 			r0 += dy;
-			for (i = 0; i < w; i++)
+			for (i = x0; i < x1; i++)
 			{
 				m = r0[i - dy];
 				if (r0[i] > m) r0[i] = m + 1;
@@ -4436,14 +4972,46 @@ static int dist_pass2_e2(int w, int h, uint32_t *dmap, par_data *pb)
 	return (mx);
 }
 
+/* Both passes work on each column, or row, independently of others, so can
+ * be split between threads */
+
+typedef struct {
+	uint32_t *dmap;
+	int w, h, mx;
+} distd;
+
+static void dist_cols(void *data, unsigned char *buf, int start, int cnt)
+{
+	distd *dd = data;
+
+	dist_pass1(dd->w, dd->h, dd->dmap, start, start + cnt);
+}
+
+static void dist_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	distd *dd = data;
+	int mx = dist_pass2_e2(dd->w, cnt, dd->dmap + start * dd->w, (void *)buf);
+	DEF_MUTEX(dist_lock);
+
+	LOCK_MUTEX(dist_lock);
+	if (dd->mx < mx) dd->mx = mx;
+	UNLOCK_MUTEX(dist_lock);
+}
+
 /* Euclidean (L2 metric) distance transform of binary image map */
 static int shapeburst_m()
 {
-	int maxd, w = sb_rect[2], h = sb_rect[3];
+	distd dd;
+	int w = sb_rect[2], h = sb_rect[3];
 
-	dist_pass1(w, h, sb_buf2);
-	maxd = dist_pass2_e2(w, h, sb_buf2, sb_mem);
-	return (ceil(sqrt(maxd)));
+	dd.dmap = sb_buf2;
+	dd.w = w;
+	dd.h = h;
+	dd.mx = 0;
+	mem_bands(dist_cols, &dd, h, w, 0);
+	if (!mem_bands(dist_rows, &dd, w, h, (w + 3) * sizeof(par_data)))
+		dist_rows(&dd, sb_mem, 0, h); // Use the preallocated buffer
+	return (ceil(sqrt(dd.mx)));
 }
 
 int init_sb()
@@ -4472,7 +5040,7 @@ int init_sb()
 void render_sb(unsigned char *mask)
 {
 	grad_info svgrad, *grad = gradient + mem_channel;
-	int i, maxd;
+	int maxd;
 
 	if (!sb_mem) return; /* Uninitialized */
 	put_pixel = put_pixel_def;
@@ -4485,9 +5053,8 @@ void render_sb(unsigned char *mask)
 		if (!grad->len) grad->len = maxd - (maxd > 1);
 		grad_update(grad);
 
-		for (i = 0; i < sb_rect[3]; i++)
-			put_pixel_row(sb_rect[0], sb_rect[1] + i, sb_rect[2],
-				mask ? mask + sb_rect[2] * i : NULL);
+		put_pixel_rows(sb_rect[0], sb_rect[1], sb_rect[2], sb_rect[3],
+			mask);
 
 		*grad = svgrad;
 	}
@@ -4513,58 +5080,48 @@ void render_sb(unsigned char *mask)
  * Pixel bitmap is packed by Y, not by X: byte[x, y / 8] |= 1 << (y % 8)
  */
 
-static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
+/* Without bitmap, fill on image directly; with one, fill the connected part of
+ * candidate bitmap into it, taking only the steps allowed by edge bitmaps if
+ * those are present */
+
+#define FLOOD_SHIFT 6 /* Fill maps get prepared in bands of 64 rows */
+
+static void flood_need(fillmaps *fm, int y);
+
+static int wjfloodfill(int x, int y, int col, unsigned char *bmap, fillmaps *fm)
 {
 	short nearq[QMINSIZE * QMINSIZE * 2];
 	/* QMINSIZE bits per cell */
 	guint32 tmap, lmap[(MAX_DIM >> QMINLEVEL) * 12 + QLEVELS * 4], maps[4];
 	int borders[4] = {0, mem_width, 0, mem_height};
 	int corners[4], coords[4], slots[4];
-	int i, j, k, tx, ty, fmode = 0, imgc = 0, lastr[3], thisr[3];
+	int i, j, k, tx, ty, w = mem_width;
 	int lmax, ntail, bidx = 0, bbit = 0;
-	double lastc[3], thisc[3], dist2, mdist2 = flood_step * flood_step;
-	csel_info *flood_data = NULL;
-	char *tmp = NULL;
 
 	/* Init */
-	if ((x < 0) || (x >= mem_width) || (y < 0) || (y >= mem_height) ||
-		(get_pixel(x, y) != col) || (pixel_protected(x, y) == 255))
+	if (bmap) borders[1] = w = fm->w , borders[3] = fm->h;
+	if ((x < 0) || (x >= borders[1]) || (y < 0) || (y >= borders[3]))
+		return (FALSE);
+	/* Bitmap fill expects seed pixel checked by caller */
+	if (!bmap && ((get_pixel(x, y) != col) || (pixel_protected(x, y) == 255)))
 		return (FALSE);
 	/* Exact limits are less, but it's too complicated */
-	lmax = mem_width > mem_height ? mem_width : mem_height;
+	lmax = borders[1] > borders[3] ? borders[1] : borders[3];
 	lmax = (lmax >> QMINLEVEL) * 12 + QLEVELS * 4;
 	memset(lmap, 0, lmax * sizeof(*lmap));
 
 	/* Start drawing */
-	if (bmap) bmap[(y >> 3) * mem_width + x] |= 1 << (y & 7);
+	if (bmap)
+	{
+		if (fm->ready && !fm->ready[y >> FLOOD_SHIFT]) flood_need(fm, y);
+		bmap[(y >> 3) * w + x] |= 1 << (y & 7);
+	}
 	else
 	{
 		put_pixel(x, y);
 		if (get_pixel(x, y) == col) return (FALSE); /* Can't draw */
 	}
 
-	/* Configure fuzzy flood fill */
-	if (flood_step && ((mem_channel == CHN_IMAGE) || flood_img))
-	{
-		if (flood_slide) fmode = flood_cube ? 2 : 3;
-		else flood_data = ALIGN(tmp = calloc(1, sizeof(csel_info) + sizeof(double)));
-		if (flood_data)
-		{
-			flood_data->center = get_pixel_RGB(x, y);
-			flood_data->range = flood_step;
-			flood_data->mode = flood_cube ? 2 : 0;
-/* !!! Alpha isn't tested yet !!! */
-			csel_reset(flood_data);
-			fmode = 1;
-		}
-	}
-	/* Configure by-image flood fill */
-	else if (!flood_step && flood_img && (mem_channel != CHN_IMAGE))
-	{
-		imgc = get_pixel_img(x, y);
-		fmode = -1;
-	}
-
 	/* Set up initial area */
 	corners[0] = x & ~(QMINSIZE - 1);
 	corners[2] = y & ~(QMINSIZE - 1);
@@ -4606,17 +5163,6 @@ static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
 			/* Unqueue last x & y */
 			coords[2] = y = nearq[--ntail];
 			coords[0] = x = nearq[--ntail];
-			if (fmode > 1)
-			{
-				k = get_pixel_RGB(x, y);
-				if (fmode == 3) get_lxn(lastc, k);
-				else
-				{
-					lastr[0] = INT_2_R(k);
-					lastr[1] = INT_2_G(k);
-					lastr[2] = INT_2_B(k);
-				}
-			}
 			for (i = 0; i < 4; i++)
 			{
 				coords[1] = x;
@@ -4628,51 +5174,25 @@ static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
 				ty = coords[3];
 				if (bmap)
 				{
-					bidx = (ty >> 3) * mem_width + tx;
+					bidx = (ty >> 3) * w + tx;
 					bbit = 1 << (ty & 7);
 					if (bmap[bidx] & bbit) continue;
-				}
-				/* Sliding mode */
-				switch (fmode)
-				{
-				case 3: /* Sliding L*X*N* */
-					get_lxn(thisc, get_pixel_RGB(tx, ty));
-					dist2 = (thisc[0] - lastc[0]) * (thisc[0] - lastc[0]) +
-						(thisc[1] - lastc[1]) * (thisc[1] - lastc[1]) +
-						(thisc[2] - lastc[2]) * (thisc[2] - lastc[2]);
-					if (dist2 > mdist2) continue;
-					break;
-				case 2: /* Sliding RGB */
-					k = get_pixel_RGB(tx, ty);
-					thisr[0] = INT_2_R(k);
-					thisr[1] = INT_2_G(k);
-					thisr[2] = INT_2_B(k);
-					if ((abs(thisr[0] - lastr[0]) > flood_step) ||
-						(abs(thisr[1] - lastr[1]) > flood_step) ||
-						(abs(thisr[2] - lastr[2]) > flood_step))
-						continue;
-					break;
-				case 1: /* Centered mode */
-					if (!csel_scan(ty * mem_width + tx, 1, 1,
-						NULL, mem_img[CHN_IMAGE], flood_data))
-						continue;
-					break;
-				case 0: /* Normal mode */
-					if (get_pixel(tx, ty) != col) continue;
-					break;
-				default: /* (-1) - By-image mode */
-					if (get_pixel_img(tx, ty) != imgc) continue;
-					break;
-				}
-				/* Is pixel writable? */
-				if (bmap)
-				{
-					if (pixel_protected(tx, ty) == 255)
-						continue;
+					if (fm->ready && !fm->ready[ty >> FLOOD_SHIFT])
+						flood_need(fm, ty);
+					if (!(fm->cmap[bidx] & bbit)) continue;
+					/* Is the step allowed? */
+					if (fm->emap[0])
+					{
+						int ex = i & 1 ? x : tx, ey = i & 1 ? y : ty;
+
+						if (!(fm->emap[i >> 1][(ey >> 3) * w + ex] &
+							(1 << (ey & 7)))) continue;
+					}
 					bmap[bidx] |= bbit;
 				}
 				else
 				{
+					if (get_pixel(tx, ty) != col) continue;
 					put_pixel(tx, ty);
 					if (get_pixel(tx, ty) == col) continue;
 				}
@@ -4711,7 +5231,217 @@ static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
 		i ^= 2;
 		corners[i] = (corners[i] & ~(k - 1)) + y;
 	}
-	free(tmp);
+	return (TRUE);
+}
+
+/* Fill connected area of candidate bitmap */
+int mem_fill_bitmap(int x, int y, unsigned char *bmap, fillmaps *fm)
+{
+	return (wjfloodfill(x, y, 0, bmap, fm));
+}
+
+/* Which pixels a fuzzy or patterned flood fill can reach, and which steps it
+ * can take, get determined band by band as the fill first gets to each: the
+ * fill itself then is only bit tests, and gets the same result as testing as
+ * it goes. Once the fill spreads past a few bands, helper threads prepare all
+ * the rest at once */
+
+#define FLOOD_LAZY 4 /* Bands to prepare one by one */
+
+typedef struct {
+	fillmaps fm;
+	csel_info *csel;
+	unsigned char *buf; // Row buffers for bands done in place
+	void *mem;
+	int fmode, col, w, bsz;
+	double mdist2;
+} floodd;
+
+static int flood_step_ok(floodd *fd, void *c0, void *c1)
+{
+	if (fd->fmode == 3) /* Sliding L*X*N* */
+	{
+		double *l0 = c0, *l1 = c1;
+
+		return ((l1[0] - l0[0]) * (l1[0] - l0[0]) +
+			(l1[1] - l0[1]) * (l1[1] - l0[1]) +
+			(l1[2] - l0[2]) * (l1[2] - l0[2]) <= fd->mdist2);
+	}
+	else /* Sliding RGB */
+	{
+		int k0 = *(int *)c0, k1 = *(int *)c1;
+
+		return ((abs(INT_2_R(k0) - INT_2_R(k1)) <= flood_step) &&
+			(abs(INT_2_G(k0) - INT_2_G(k1)) <= flood_step) &&
+			(abs(INT_2_B(k0) - INT_2_B(k1)) <= flood_step));
+	}
+}
+
+static void flood_row_colors(floodd *fd, void *dest, int y)
+{
+	int x, w = fd->w;
+
+	if (fd->fmode == 3)
+	{
+		double *lxn = dest;
+		for (x = 0; x < w; x++ , lxn += 3)
+			get_lxn(lxn, get_pixel_RGB(x, y));
+	}
+	else
+	{
+		int *rgb = dest;
+		for (x = 0; x < w; x++) rgb[x] = get_pixel_RGB(x, y);
+	}
+}
+
+static void flood_band(void *data, unsigned char *buf, int start, int cnt)
+{
+	floodd *fd = data;
+	unsigned char *img, *cmap, *hmap, *vmap, *mask, *sel;
+	char *c0, *c1, *tmp;
+	int x, y, y1, bit, bpp, w = fd->w, h = fd->fm.h;
+	int csz = fd->fmode == 3 ? sizeof(double) * 3 : fd->fmode == 2 ?
+		sizeof(int) : 0;
+
+	c0 = (char *)buf; c1 = c0 + w * csz;
+	mask = (unsigned char *)c1 + w * csz; sel = mask + w;
+	y = start * 8;
+	y1 = (start + cnt) * 8;
+	if (y1 > h) y1 = h;
+	if ((fd->fmode > 1) && (y < y1)) flood_row_colors(fd, c1, y);
+	for (; y < y1; y++)
+	{
+		cmap = fd->fm.cmap + (y >> 3) * w;
+		bit = 1 << (y & 7);
+
+		/* Protection */
+		row_protected(0, y, w, mask);
+		for (x = 0; x < w; x++)
+			if (mask[x] != 255) cmap[x] |= bit;
+
+		switch (fd->fmode)
+		{
+		case 3: /* Sliding L*X*N* */
+		case 2: /* Sliding RGB */
+			hmap = fd->fm.emap[0] + (y >> 3) * w;
+			vmap = fd->fm.emap[1] + (y >> 3) * w;
+			tmp = c0; c0 = c1; c1 = tmp;
+			for (x = 0; x < w - 1; x++)
+				if (flood_step_ok(fd, c0 + x * csz, c0 + (x + 1) * csz))
+					hmap[x] |= bit;
+			if (y + 1 >= h) break;
+			flood_row_colors(fd, c1, y + 1);
+			for (x = 0; x < w; x++)
+				if (flood_step_ok(fd, c0 + x * csz, c1 + x * csz))
+					vmap[x] |= bit;
+			break;
+		case 1: /* Centered mode */
+			memset(sel, 0, w);
+			csel_scan(0, 1, w, sel, mem_img[CHN_IMAGE] +
+				y * w * mem_img_bpp, fd->csel);
+			for (x = 0; x < w; x++)
+				if (!sel[x]) cmap[x] &= ~bit;
+			break;
+		case 0: /* Normal mode */
+		default: /* (-1) - By-image mode */
+			bpp = fd->fmode ? mem_img_bpp : MEM_BPP;
+			img = mem_img[fd->fmode ? CHN_IMAGE : mem_channel] +
+				y * w * bpp;
+			if (bpp == 3)
+			{
+				for (x = 0; x < w; x++ , img += 3)
+					if (MEM_2_INT(img, 0) != fd->col)
+						cmap[x] &= ~bit;
+			}
+			else for (x = 0; x < w; x++)
+				if (img[x] != fd->col) cmap[x] &= ~bit;
+			break;
+		}
+	}
+}
+
+/* Prepare bands of fill maps which aren't yet */
+static void flood_rest(void *data, unsigned char *buf, int start, int cnt)
+{
+	floodd *fd = data;
+	int n = 1 << (FLOOD_SHIFT - 3);
+
+	for (; cnt-- > 0; start++)
+		if (!fd->fm.ready[start]) flood_band(fd, buf, start * n, n);
+}
+
+static void flood_need(fillmaps *fm, int y)
+{
+	floodd *fd = fm->fdata;
+	int i, n = (fm->h + (1 << FLOOD_SHIFT) - 1) >> FLOOD_SHIFT;
+
+	if (fm->nready < FLOOD_LAZY) /* Just this band */
+	{
+		i = y >> FLOOD_SHIFT;
+		flood_rest(fd, fd->buf, i, 1);
+		fm->ready[i] = TRUE;
+		fm->nready++;
+		return;
+	}
+	/* All the rest */
+	if (!mem_bands(flood_rest, fd, fm->w << FLOOD_SHIFT, n, fd->bsz))
+		flood_rest(fd, fd->buf, 0, n);
+	memset(fm->ready, TRUE, n);
+	fm->nready = n;
+}
+
+/* Set up fill maps for flood fill from (x, y) */
+static int flood_maps(fillmaps *fm, floodd *fd, int x, int y, int col)
+{
+	int l, nb, nmaps = 1;
+
+	memset(fd, 0, sizeof(floodd));
+	memset(fm, 0, sizeof(fillmaps));
+	fd->w = fm->w = mem_width;
+	fm->h = mem_height;
+	fd->col = col;
+	fd->mdist2 = flood_step * flood_step;
+
+	/* Configure fuzzy flood fill */
+	if (flood_step && ((mem_channel == CHN_IMAGE) || flood_img))
+	{
+		if (flood_slide) fd->fmode = flood_cube ? 2 : 3 , nmaps = 3;
+		else fd->fmode = 1;
+	}
+	/* Configure by-image flood fill */
+	else if (!flood_step && flood_img && (mem_channel != CHN_IMAGE))
+	{
+		fd->col = get_pixel_img(x, y);
+		fd->fmode = -1;
+	}
+
+	/* Two rows of colors, and mask & selection rows */
+	fd->bsz = mem_width * 2;
+	if (fd->fmode > 1) fd->bsz += mem_width * 2 *
+		(fd->fmode == 3 ? sizeof(double) * 3 : sizeof(int));
+
+	l = ((mem_height + 7) >> 3) * mem_width;
+	nb = (mem_height + (1 << FLOOD_SHIFT) - 1) >> FLOOD_SHIFT;
+	fd->mem = multialloc(MA_ALIGN_DOUBLE | MA_SKIP_ZEROSIZE,
+		&fd->buf, fd->bsz,
+		&fd->csel, fd->fmode == 1 ? sizeof(csel_info) : 0,
+		&fm->cmap, l,
+		&fm->emap[0], nmaps > 1 ? l : 0,
+		&fm->emap[1], nmaps > 1 ? l : 0,
+		&fm->ready, nb,
+		NULL);
+	if (!fd->mem) return (FALSE);
+
+	if (fd->csel)
+	{
+		fd->csel->center = get_pixel_RGB(x, y);
+		fd->csel->range = flood_step;
+		fd->csel->mode = flood_cube ? 2 : 0;
+/* !!! Alpha isn't tested yet !!! */
+		csel_reset(fd->csel);
+	}
+	fd->fm = *fm;
+	fm->fdata = fd;
 	return (TRUE);
 }
 
@@ -4772,10 +5502,43 @@ int try_pixel(int x, int y)
 }
 
 /* Flood fill - may use temporary area (1 bit per pixel) */
+/* Gradient rows depend on nothing but their own place, so can be drawn in
+ * parallel, if blend tables get built before threads get to them */
+static int rows_parallel()
+{
+	unsigned char tmp;
+
+	/* Gradient mode of default function, and no clone mode over it */
+	if ((put_pixel_row != put_pixel_row_def) || !mem_gradient ||
+		(tool_type == TOOL_CLONE)) return (FALSE);
+	process_img(0, 1, 0, &tmp, &tmp, &tmp, &tmp, &tmp, MEM_BPP, 0);
+	return (TRUE);
+}
+
+/* Draw rows of flood-filled bitmap */
+static void flood_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	unsigned char *temp, *pat = data;
+	unsigned u, f;
+	int j;
+
+	for (cnt += start; start < cnt; start++)
+	{
+		f = 1 << (start & 7);
+		temp = pat + (start >> 3) * mem_width;
+		for (u = j = 0; j < mem_width; j++)
+			u |= buf[j] = (0x10000 - (temp[j] & f)) >> 8;
+		if (!u) continue; // Avoid wasting time on empty rows
+		put_pixel_row(0, start, mem_width, buf);
+	}
+}
+
 int flood_fill(int x, int y, unsigned int target)
 {
-	unsigned char *pat, *buf, *temp;
-	int i, j, l, sb, res = FALSE;
+	fillmaps fm;
+	floodd fd;
+	unsigned char *pat, *buf;
+	int l, sb, res = FALSE;
 
 	/* Regular fill? */
 	if (!mem_gradient && !(mem_blend && blend_src) && !mem_tool_pat &&
@@ -4784,18 +5547,22 @@ int flood_fill(int x, int y, unsigned int target)
 		/* Try modifying the first pixel */
 		if (!try_pixel(x, y)) return (FALSE);
 		spot_undo(UNDO_TOOL);
-		return (wjfloodfill(x, y, target, NULL));
+		return (wjfloodfill(x, y, target, NULL, NULL));
 	}
 
 	/* Patterned or fuzzy fill - use bitmap */
+	if ((x < 0) || (x >= mem_width) || (y < 0) || (y >= mem_height) ||
+		(get_pixel(x, y) != target) || (pixel_protected(x, y) == 255))
+		return (FALSE);
 	buf = calloc((mem_height + 7 + 8) >> 3, mem_width);
-	if (!buf)
+	if (!buf || !flood_maps(&fm, &fd, x, y, target))
 	{
+		free(buf);
 		memory_errors(1);
 		return (FALSE);
 	}
 	pat = buf + mem_width;
-	while (wjfloodfill(x, y, target, pat))
+	while (wjfloodfill(x, y, target, pat, &fm))
 	{
 		/* Shapeburst - setup rendering backbuffer */
 		sb = STROKE_GRADIENT;
@@ -4811,26 +5578,48 @@ int flood_fill(int x, int y, unsigned int target)
 
 		res = TRUE;
 		spot_undo(UNDO_TOOL);
-		for (i = 0; i < mem_height; i++)
-		{
-			unsigned u, f = 1 << (i & 7);
-
-			temp = pat + (i >> 3) * mem_width;
-			for (u = j = 0; j < mem_width; j++)
-				u |= buf[j] = (0x10000 - (temp[j] & f)) >> 8;
-			if (!u) continue; // Avoid wasting time on empty rows
-			put_pixel_row(0, i, mem_width, buf);
-		}
+		if (sb || !rows_parallel() || !mem_bands(flood_rows, pat,
+			mem_width, mem_height, mem_width))
+			flood_rows(pat, buf, 0, mem_height);
 
 		if (sb) render_sb(NULL); /* Finalize */
 
 		break;
 	}
+	free(fd.mem);
 	free(buf);
 	return (res);
 }
 
 
+typedef struct {
+	unsigned char *xsel;
+	int x, y, w;
+} rowsd;
+
+static void put_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	rowsd *rd = data;
+	unsigned char *xsel = rd->xsel;
+
+	if (xsel) xsel += start * rd->w;
+	for (cnt += start; start < cnt; start++)
+	{
+		put_pixel_row(rd->x, rd->y + start, rd->w, xsel);
+		if (xsel) xsel += rd->w;
+	}
+}
+
+/* Draw a block of rows, gradient ones in parallel */
+void put_pixel_rows(int x, int y, int w, int h, unsigned char *xsel)
+{
+	rowsd rd = { xsel, x, y, w };
+
+	if ((w <= 0) || (h <= 0)) return;
+	if (rows_parallel()) mem_bands(put_rows, &rd, w, h, 0);
+	else put_rows(&rd, NULL, 0, h);
+}
+
 void f_rectangle(int x, int y, int w, int h)	// Draw a filled rectangle
 {
 	w += x; h += y;
@@ -4847,7 +5636,7 @@ void f_rectangle(int x, int y, int w, int h)	// Draw a filled rectangle
 		return;
 	}
 
-	for (; y < h; y++) put_pixel_row(x, y, w, NULL);
+	put_pixel_rows(x, y, w, h - y, NULL);
 }
 
 /*
@@ -6129,6 +6918,120 @@ int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	//
 	return (res);
 }
 
+/* Scale image row by row, for streamed processing; source rows are taken from
+ * a ring buffer, in which row Y is at position Y modulo ring size */
+
+int mem_rowscale_init(rowscale *rs, int ow, int oh, int nw, int nh, int bpp,
+	int alpha, int type, int gcor, int sharp)
+{
+	fstep *tmpy;
+	int i, l;
+
+	memset(rs, 0, sizeof(rowscale));
+	rs->ow = ow;
+	rs->oh = oh;
+	rs->nw = nw;
+	rs->nh = nh;
+	rs->bpp = bpp;
+	rs->gcor = gcor;
+
+	/* Nearest neighbour, same as for entire image */
+	if (!type || (bpp == 1))
+	{
+		double scalex = (double)ow / (double)nw;
+		double deltax = 0.5 * scalex - 0.5;
+
+		rs->scaley = (double)oh / (double)nh;
+		rs->deltay = 0.5 * rs->scaley - 0.5;
+		if (!(rs->mem = rs->xmap = malloc(nw * sizeof(int)))) return (0);
+		for (i = 0; i < nw; i++) WJ_ROUND(rs->xmap[i], scalex * i + deltax);
+		return (rs->rows = 1);
+	}
+
+	if ((rs->hfilter = make_filter(ow, nw, type, sharp, BOUND_MIRROR)) &&
+		(rs->vfilter = make_filter(oh, nh, type, sharp, BOUND_MIRROR)))
+	{
+		l = (ow - ((fstep *)rs->hfilter)[0].idx * 2) * sizeof(double);
+		rs->mem = multialloc(MA_ALIGN_DOUBLE, &rs->work,
+			l * (alpha ? 7 : 3), NULL);
+	}
+	if (!rs->mem)
+	{
+		mem_rowscale_free(rs);
+		return (0);
+	}
+
+	/* Widest span of source rows */
+	for (tmpy = rs->vfilter , i = 0; i < nh; i++ , tmpy++)
+	{
+		l = tmpy[1].k - tmpy->k;
+		if (rs->rows < l) rs->rows = l;
+	}
+	return (rs->rows);
+}
+
+/* Range of source rows needed for destination row */
+void mem_rowscale_rows(rowscale *rs, int y, int *y0, int *y1)
+{
+	fstep *tmpy = rs->vfilter;
+	int i;
+
+	if (tmpy)
+	{
+		tmpy += y;
+		*y0 = tmpy->idx;
+		*y1 = tmpy->idx + (tmpy[1].k - tmpy->k);
+	}
+	else
+	{
+		WJ_ROUND(i, rs->scaley * y + rs->deltay);
+		*y0 = i;
+		*y1 = i + 1;
+	}
+}
+
+void mem_rowscale(rowscale *rs, int y, unsigned char *src, unsigned char *srca,
+	int ring, unsigned char *dest, unsigned char *desta)
+{
+	unsigned char *img;
+	int i, j, oi, bpp = rs->bpp;
+
+	if (rs->vfilter)
+	{
+		fstep *tmpy = (fstep *)rs->vfilter + y;
+
+		if (srca) scale_rgba(tmpy, rs->hfilter, rs->work,
+			3, rs->gcor, rs->ow, ring, rs->nw, 0,
+			src, dest, srca, desta);
+		else scale_row(tmpy, rs->hfilter, rs->work,
+			bpp, rs->gcor, rs->ow, ring, rs->nw, 0, src, dest);
+		return;
+	}
+
+	WJ_ROUND(j, rs->scaley * y + rs->deltay);
+	j %= ring;
+	img = src + rs->ow * j * bpp;
+	for (i = 0; i < rs->nw; i++)
+	{
+		oi = rs->xmap[i] * bpp;
+		*dest++ = img[oi];
+		if (bpp == 1) continue;
+		*dest++ = img[oi + 1];
+		*dest++ = img[oi + 2];
+	}
+	if (!srca) return;
+	img = srca + rs->ow * j;
+	for (i = 0; i < rs->nw; i++) *desta++ = img[rs->xmap[i]];
+}
+
+void mem_rowscale_free(rowscale *rs)
+{
+	free(rs->hfilter);
+	free(rs->vfilter);
+	free(rs->mem);
+	rs->hfilter = rs->vfilter = rs->mem = NULL;
+}
+
 
 
 int mem_isometrics(int type)
@@ -6423,13 +7326,30 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 	return (0);
 }
 
+typedef struct {
+	unsigned char *img, *alpha;
+	int n;
+} pixd;
+
+static void threshold_band(void *data, unsigned char *buf, int start, int cnt)
+{
+	pixd *pd = data;
+	unsigned char *img = pd->img + start;
+	int level = pd->n;
+
+	for (; cnt; cnt-- , img++)
+		*img = (level - *img) >> 8;
+}
+
 /* Threshold channel values */
 void mem_threshold(unsigned char *img, int len, int level)
 {
+	pixd pd;
+
 	if (!img) return; /* Paranoia */
-	level += 0xFFFF;
-	for (; len; len-- , img++)
-		*img = (level - *img) >> 8;
+	pd.img = img;
+	pd.n = level + 0xFFFF;
+	mem_bands(threshold_band, &pd, 1, len, 0);
 }
 
 /* Industrial-grade thresholding */
@@ -6477,13 +7397,60 @@ void do_xhold(int start, int step, int cnt, unsigned char *mask,
 	}
 }
 
-/* Only supports BPP = 1 and 3 */
-void mem_demultiply(unsigned char *img, unsigned char *alpha, int len, int bpp)
+/* Demultiplied value depends only on old value & alpha, so the results get
+ * tabulated once for all pairs; the math is the same as below */
+static unsigned char *volatile demul_lut;
+
+static unsigned char *demultiply_lut()
 {
-	int i, k;
+	unsigned char *lut;
+	double d;
+	int i, j, k;
+	DEF_MUTEX(demul_lock); // To prevent concurrent building
+
+
+	if ((lut = demul_lut)) return (lut);
+	LOCK_MUTEX(demul_lock);
+	if (!(lut = demul_lut) && (lut = malloc(0x10000)))
+	{
+		memset(lut, 0, 256); // Zero alpha is skipped anyway
+		for (i = 1; i < 256; i++)
+		{
+			d = 255.0 / (double)i;
+			for (j = 0; j < 256; j++)
+			{
+				k = rint(d * j);
+				lut[i * 256 + j] = k > 255 ? 255 : k;
+			}
+		}
+		demul_lut = lut; // Publish only when complete
+	}
+	UNLOCK_MUTEX(demul_lock);
+	return (lut);
+}
+
+static void demultiply_band(void *data, unsigned char *buf, int start, int cnt)
+{
+	pixd *pd = data;
+	unsigned char *img, *tab, *lut, *alpha = pd->alpha + start;
+	int i, k, bpp = pd->n;
 	double d;
 
-	for (i = 0; i < len; i++ , img += bpp)
+	img = pd->img + start * bpp;
+	if ((lut = demultiply_lut()))
+	{
+		for (i = 0; i < cnt; i++ , img += bpp)
+		{
+			if (!alpha[i]) continue;
+			tab = lut + alpha[i] * 256;
+			img[0] = tab[img[0]];
+			if (bpp == 1) continue;
+			img[1] = tab[img[1]];
+			img[2] = tab[img[2]];
+		}
+		return;
+	}
+	for (i = 0; i < cnt; i++ , img += bpp)
 	{
 		if (!alpha[i]) continue;
 		d = 255.0 / (double)alpha[i];
@@ -6497,6 +7464,17 @@ void mem_demultiply(unsigned char *img, unsigned char *alpha, int len, int bpp)
 	}
 }
 
+/* Only supports BPP = 1 and 3 */
+void mem_demultiply(unsigned char *img, unsigned char *alpha, int len, int bpp)
+{
+	pixd pd;
+
+	pd.img = img;
+	pd.alpha = alpha;
+	pd.n = bpp;
+	mem_bands(demultiply_band, &pd, 1, len, 0);
+}
+
 /* Build value rescaling table */
 void set_xlate_n(unsigned char *xlat, int n)
 {
@@ -6626,7 +7604,7 @@ void row_protected(int x, int y, int len, unsigned char *mask)
 /* Make code not compile if it cannot work */
 typedef char Too_Many_Blend_Modes[2 * (BLEND_NMODES <= BLEND_MMASK + 1) - 1];
 
-static void blend_pixels(int start, int step, int cnt, const unsigned char *mask,
+static void do_blend(int start, int step, int cnt, const unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0, unsigned char *img,
 	int bpp, int mode)
 {
@@ -6926,6 +7904,77 @@ static void blend_pixels(int start, int step, int cnt, const unsigned char *mask
 #undef HHSV
 }
 
+/* Per-channel modes depend only on old & new value of the channel, so their
+ * results get tabulated once for all value pairs, by the generic code above */
+static unsigned char *volatile blend_luts[BLEND_NMODES];
+
+static unsigned char *blend_lut(int mode)
+{
+	unsigned char *lut, *tmp;
+	int i;
+	DEF_MUTEX(blend_lock); // To prevent concurrent building
+
+
+	/* Tables never change once built, so only building needs the lock */
+	if ((lut = blend_luts[mode])) return (lut);
+	LOCK_MUTEX(blend_lock);
+	if (!(lut = blend_luts[mode]) && (tmp = malloc(0x10000 * 3)))
+	{
+		lut = tmp + 0x10000;
+		for (i = 0; i < 0x10000; i++)
+		{
+			tmp[i] = 255; // Mask
+			lut[i] = i >> 8; // Old
+			lut[i + 0x10000] = i; // New
+		}
+		do_blend(0, 1, 0x10000, tmp, tmp, lut, lut + 0x10000, 1, mode);
+		lut = realloc(tmp, 0x10000);
+		if (!lut) lut = tmp; // Shrinking should not fail
+		blend_luts[mode] = lut; // Publish only when complete
+	}
+	UNLOCK_MUTEX(blend_lock);
+	return (lut);
+}
+
+static void blend_pixels(int start, int step, int cnt, const unsigned char *mask,
+	unsigned char *imgr, unsigned char *img0, unsigned char *img,
+	int bpp, int mode)
+{
+	const unsigned char *new, *old, *lut;
+	int j, step3, mx = 255, m = mode & BLEND_MMASK;
+
+	if ((m < BLEND_1BPP) || !(lut = blend_lut(m)))
+	{
+		do_blend(start, step, cnt, mask, imgr, img0, img, bpp, mode);
+		return;
+	}
+
+	/* Backward transfer? */
+	if (mode & BLEND_REVERSE) new = img0 , old = img;
+	else new = img , old = img0;
+	/* For indexed, upper limit is last palette index */
+	if ((m == BLEND_XHOLD) && (mode & BLENDF_IDX)) mx = mem_cols - 1;
+
+	j = start - step;
+	mask += j;
+	j *= bpp;
+	step3 = step * bpp;
+	new += j; old += j; imgr += j;
+	if (bpp == 1) while (cnt-- > 0)
+	{
+		old += step3; new += step3; imgr += step3; mask += step;
+		if (*mask) imgr[0] = lut[(old[0] << 8) + new[0]] & mx;
+	}
+	else while (cnt-- > 0)
+	{
+		old += step3; new += step3; imgr += step3; mask += step;
+		if (!*mask) continue;
+		imgr[0] = lut[(old[0] << 8) + new[0]] & mx;
+		imgr[1] = lut[(old[1] << 8) + new[1]];
+		imgr[2] = lut[(old[2] << 8) + new[2]];
+	}
+}
+
 void put_pixel_def(int x, int y)	/* Combined */
 {
 	unsigned char *src, *ti, *old_image, *old_alpha = NULL;
@@ -7099,6 +8148,16 @@ enum {
 	PP_LBUF		// Buffered layer
 };
 
+/* Default source rows, filled from pattern, for each of its 8 rows; reused by
+ * successive brush dabs while pattern and colors stay the same */
+typedef struct {
+	unsigned char src[8 * 3], asrc[8]; // Pattern row they were filled from
+	int bpp, alpha;
+	unsigned char img[(ROW_BUFLEN + 8) * 3], alpha_[ROW_BUFLEN + 8];
+} pat_row;
+
+static pat_row pat_rows[8];
+
 /* Faster function for large brushes and fills */
 void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 {
@@ -7195,17 +8254,14 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 	/* Transform mode - use offset */
 	else if (mem_blend && (blend_mode & BLEND_XFORM) && (bpp == 3)) mode = PP_OFS;
 // !!! This depends on buffer length being a multiple of pattern length
-	else /* Default mode - init buffer(s) from pattern */
+	else /* Default mode - take buffer(s) from pattern cache */
 	{
-		int i, dy = 8 * (y & 7), l = len <= ROW_BUFLEN ? len : ROW_BUFLEN;
+		unsigned char asrc[8];
+		int i, dy = 8 * (y & 7);
 
 		srcp = mem_pattern + dy;
-		if (source_alpha)
-		{
-			for (i = 0; i < 8; i++)
-				src1[i] = channel_col_[srcp[i]][CHN_ALPHA];
-			pattern_rep(tmp_alpha, src1, x & 7, 8, l, 1);
-		}
+		if (source_alpha) for (i = 0; i < 8; i++)
+			asrc[i] = channel_col_[srcp[i]][CHN_ALPHA];
 		if (mem_channel != CHN_IMAGE)
 		{
 			for (i = 0; i < 8; i++)
@@ -7213,7 +8269,40 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 			srcp = src1;
 		}
 		else srcp = idx ? mem_col_pat + dy : mem_col_pat24 + dy * 3;
-		pattern_rep(tmp_image, srcp, x & 7, 8, l, bpp);
+
+		/* The cache is shared, so helper threads fill their own rows */
+		if (thread_nested())
+		{
+			int l = len <= ROW_BUFLEN ? len : ROW_BUFLEN;
+
+			pattern_rep(tmp_image, srcp, x & 7, 8, l, bpp);
+			if (source_alpha)
+				pattern_rep(tmp_alpha, asrc, x & 7, 8, l, 1);
+		}
+		else
+		{
+			pat_row *pr = pat_rows + (y & 7);
+
+			/* Refill the cached rows if pattern or colors changed */
+			if ((pr->bpp != bpp) || memcmp(pr->src, srcp, 8 * bpp))
+			{
+				pr->bpp = bpp;
+				memcpy(pr->src, srcp, 8 * bpp);
+				pattern_rep(pr->img, srcp, 0, 8, ROW_BUFLEN + 8, bpp);
+			}
+			source_image = pr->img + (x & 7) * bpp;
+			if (source_alpha)
+			{
+				if (!pr->alpha || memcmp(pr->asrc, asrc, 8))
+				{
+					pr->alpha = TRUE;
+					memcpy(pr->asrc, asrc, 8);
+					pattern_rep(pr->alpha_, asrc, 0, 8,
+						ROW_BUFLEN + 8, 1);
+				}
+				source_alpha = pr->alpha_ + (x & 7);
+			}
+		}
 	}
 
 	offset = x + mem_width * y;
@@ -9366,6 +10455,8 @@ void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask
 
 	if (!RGBA_mode) alpha0 = NULL;
 	mmask = IS_INDEXED ? 1 : 255; /* On/off opacity */
+	/* Disabled because of unusable settings? */
+	if (grad->wmode == GRAD_MODE_NONE) mmask = 0; /* Skip all */
 	slot = mem_channel + ((0x81 + mem_channel + mem_channel - mem_img_bpp) >> 7);
 
 	cnt = start + step * cnt; x += start;
@@ -9374,9 +10465,6 @@ void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask
 		op = 0;
 		if (mask[i] >= mmask) continue;
 
-		/* Disabled because of unusable settings? */
-		if (grad->wmode == GRAD_MODE_NONE) continue;
-
 		/* Distance for gradient mode */
 		if (grad->status == GRAD_NONE)
 		{
@@ -10626,19 +11714,161 @@ static inline int seg_join(seg_pixel *pix, int a, int b)
 	return (ca->group = b);
 }
 
+/* Connections are stored in order of their "which" values, each row holding
+ * right & down ones interleaved, so every row's place is known in advance */
+
+typedef struct {
+	seg_edge *edges, *dest;
+	unsigned char *img;
+	int *hist;
+	double *rows;
+	int w, h, cnt, cspace, dist, shift, progress;
+	double mult;
+} segd;
+
+static void seg_edges(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e;
+	distance_func dist = distance_3d[sd->dist];
+	double mult = sd->mult, *tmp, *row0 = sd->rows, *row1;
+	int i, j, k, w = sd->w, h = sd->h, l = sd->w * 3;
+	int start = thread->step0, cnt = thread->nsteps;
+
+	row1 = row0 + l;
+	e = sd->edges + start * (w * 2 - 1);
+	mem_convert_row(row1, sd->img + start * l, w, sd->cspace);
+	for (i = start; i < start + cnt; i++)
+	{
+		tmp = row0; row0 = row1; row1 = tmp;
+		if (i + 1 < h) mem_convert_row(row1, sd->img + (i + 1) * l,
+			w, sd->cspace);
+		for (j = 0 , k = i * w * 2; j < l; j += 3 , k += 2)
+		{
+			/* Right vertex */
+			if (j + 3 < l)
+			{
+				e->which = k;
+				e->diff = mult * dist(row0 + j, row0 + j + 3);
+				e++;
+			}
+			/* Bottom vertex */
+			if (i + 1 >= h) continue;
+			e->which = k + 1;
+			e->diff = mult * dist(row0 + j, row1 + j);
+			e++;
+		}
+		if (sd->progress && thread_step(thread, i - start + 1, cnt, 20))
+		{
+			thread->stop = TRUE; // Let the caller know
+			break;
+		}
+	}
+	thread_done(thread);
+}
+
+/* Connections get sorted by LSD radix sort on bits of their difference value;
+ * the array is cut into fixed chunks, so that threads can each count and then
+ * place their own ones. Being stable, the sort keeps "which" order for equal
+ * differences, same as comparison sort would */
+
+#define SEG_CHUNKS 256
+
+static inline unsigned int seg_key(float f)
+{
+	uint32_t u;
+
+	f += 0.0f; // No negative zero
+	memcpy(&u, &f, sizeof(u));
+	return (u ^ (u & 0x80000000U ? 0xFFFFFFFFU : 0x80000000U));
+}
+
+static inline int seg_chunk(int cnt, int n)
+{
+	int r = cnt % SEG_CHUNKS;
+	return ((cnt / SEG_CHUNKS) * n + (n < r ? n : r));
+}
+
+static void seg_count(void *data, unsigned char *buf, int start, int cnt)
+{
+	segd *sd = data;
+	seg_edge *e;
+	int i, l, *hist, shift = sd->shift;
+
+	for (; cnt-- > 0; start++)
+	{
+		hist = sd->hist + start * 256;
+		memset(hist, 0, 256 * sizeof(int));
+		e = sd->edges + (i = seg_chunk(sd->cnt, start));
+		l = seg_chunk(sd->cnt, start + 1) - i;
+		for (i = 0; i < l; i++ , e++)
+			hist[(seg_key(e->diff) >> shift) & 255]++;
+	}
+}
+
+static void seg_place(void *data, unsigned char *buf, int start, int cnt)
+{
+	segd *sd = data;
+	seg_edge *e, *dest = sd->dest;
+	int i, l, *hist, shift = sd->shift;
+
+	for (; cnt-- > 0; start++)
+	{
+		hist = sd->hist + start * 256;
+		e = sd->edges + (i = seg_chunk(sd->cnt, start));
+		l = seg_chunk(sd->cnt, start + 1) - i;
+		for (i = 0; i < l; i++ , e++)
+			dest[hist[(seg_key(e->diff) >> shift) & 255]++] = *e;
+	}
+}
+
+static int seg_sort(segd *sd, seg_edge *tmp)
+{
+	seg_edge *src = sd->edges;
+	int i, j, k, n, v, *hist;
+
+	if (!(sd->hist = hist = malloc(SEG_CHUNKS * 256 * sizeof(int))))
+		return (FALSE);
+	for (sd->shift = 0; sd->shift < 32; sd->shift += 8)
+	{
+		sd->edges = src;
+		sd->dest = tmp;
+		mem_bands(seg_count, sd, sd->cnt / SEG_CHUNKS + 1, SEG_CHUNKS, 0);
+		/* Turn counts into places, digit by digit and chunk by chunk */
+		for (i = n = 0; i < 256; i++)
+		{
+			for (j = k = 0; j < SEG_CHUNKS; j++)
+			{
+				v = hist[j * 256 + i];
+				hist[j * 256 + i] = n + k;
+				k += v;
+			}
+			if (k == sd->cnt) break; // All in one place
+			n += k;
+		}
+		if (i < 256) continue; // Nothing to reorder
+		mem_bands(seg_place, sd, sd->cnt / SEG_CHUNKS + 1, SEG_CHUNKS, 0);
+		tmp = src;
+		src = sd->dest;
+	}
+	sd->edges = src; // Where the result ended up
+	free(hist);
+	return (TRUE);
+}
+
 seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 	int flags, int cspace, int dist)
 {
 	static const unsigned char dist_scales[NUM_CSPACES] = { 1, 255, 1 };
-	seg_edge *e;
-	double mult, *row0, *row1, *rows[2];
-	int i, j, k, l, bsz, sz = w * h;
+	segd sd;
+	threaddata *tdata;
+	int i, l, bsz, sz = w * h;
 
 
 	// !!! Will need a longer int type (and twice the memory) otherwise
 	if (sz > (INT_MAX >> 1) + 1) return (NULL);
 
-	/* 3 buffers will be sharing space */
+	/* Row buffers, sort buffer and pixel nodes will be sharing space */
 	bsz = w * 3 * 2 * sizeof(double);
 	l = sz * sizeof(seg_pixel);
 	if (l > bsz) bsz = l;
@@ -10658,41 +11888,42 @@ seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 		s->w = w;
 		s->h = h;
 	}
-	rows[0] = (void *)s->pix; // 1st row buffer
-	rows[1] = rows[0] + w * 3; // 2nd row buffer
 	s->phase = 0; // Struct is to be refilled
 
 	if (flags & SEG_PROGRESS) progress_init(_("Segmentation Pass 1"), 1);
 
 	/* Compute color distances, fill connections buffer */
-	l = w * 3;
-	mult = dist_scales[cspace]; // Make all colorspaces use similar scale
-	for (i = 0 , e = s->edges; i < h; i++)
+	memset(&sd, 0, sizeof(sd));
+	sd.edges = s->edges;
+	sd.img = img;
+	sd.w = w;
+	sd.h = h;
+	sd.cspace = cspace;
+	sd.dist = dist;
+	sd.mult = dist_scales[cspace]; // Make all colorspaces use similar scale
+	s->cnt = sd.cnt = h * (w - 1) + (h - 1) * w;
+	sd.progress = flags & SEG_PROGRESS;
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(w, h), &sd, sizeof(sd),
+		NULL,
+		&sd.rows, w * 3 * 2 * sizeof(double),
+		NULL);
+	if (!tdata) /* Use the shared space for rows if no memory for per-thread ones */
 	{
-		k = i * w;
-		mem_convert_row(row1 = rows[i & 1], img + k * 3, w, cspace);
-		/* Right vertices for this row */
-		for (j = 3 , k *= 2; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row1 + j - 3, row1 + j);
-		}
-		if (!i) continue;
-		/* Bottom vertices for previous row */
-		k = (i - 1) * w * 2 + 1;
-		row0 = rows[~i & 1];
-		for (j = 0; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row0 + j, row1 + j);
-		}
-		if ((flags & SEG_PROGRESS) && ((i * 20) % h >= h - 20))
-			if (progress_update((0.9 * i) / h)) goto quit;
+		sd.rows = (void *)s->pix;
+		tdata = talloc(MA_ALIGN_DOUBLE, 1, &sd, sizeof(sd), NULL, NULL);
+		if (!tdata) goto quit;
 	}
+	tdata->silent = !sd.progress;
+	launch_threads(seg_edges, tdata, NULL, h);
+	i = tdata->threads[0]->stop; // Cancelled
+	free(tdata);
+	if (i) goto quit;
 
 	/* Sort connections, smallest distances first */
-	s->cnt = e - s->edges;
-	qsort(s->edges, s->cnt, sizeof(seg_edge), cmp_edge);
+	if (!seg_sort(&sd, (void *)s->pix))
+		qsort(s->edges, s->cnt, sizeof(seg_edge), cmp_edge);
+	else if (sd.edges != s->edges) // Odd number of passes done
+		memcpy(s->edges, sd.edges, s->cnt * sizeof(seg_edge));
 
 	s->phase = 1;
 
@@ -10816,9 +12047,33 @@ void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
 }
 
 /* Draw segments in unique colors */
+typedef struct {
+	const seg_state *s;
+	unsigned char *img;
+} segrd;
+
+static void seg_fill(void *data, unsigned char *buf, int start, int cnt)
+{
+	segrd *sd = data;
+	seg_pixel *pix = sd->s->pix;
+	unsigned char *img;
+	int i, k, l = sd->s->w;
+
+	start *= l;
+	img = sd->img + start * 3;
+	for (i = start , l = start + cnt * l; i < l; i++ , img += 3)
+	{
+		k = pix[pix[i].group].cnt;
+		img[0] = INT_2_R(k);
+		img[1] = INT_2_G(k);
+		img[2] = INT_2_B(k);
+	}
+}
+
 void mem_seg_render(unsigned char *img, const seg_state *s)
 {
-	int i, k, l, sz = s->w * s->h;
+	segrd sd;
+	int i, l, sz = s->w * s->h;
 	seg_pixel *pix = s->pix;
 
 	for (i = l = 0; i < sz; i++)
@@ -10837,13 +12092,9 @@ void mem_seg_render(unsigned char *img, const seg_state *s)
 		pix[i].cnt = RGB_2_INT(r, g, b);
 	}
 
-	for (i = 0; i < sz; i++ , img += 3)
-	{
-		k = pix[pix[i].group].cnt;
-		img[0] = INT_2_R(k);
-		img[1] = INT_2_G(k);
-		img[2] = INT_2_B(k);
-	}
+	sd.s = s;
+	sd.img = img;
+	mem_bands(seg_fill, &sd, s->w, s->h, 0);
 }
 
 #define FRACTAL_DIM 1.25
@@ -126,6 +126,9 @@ typedef struct {
 	unsigned short flags;
 } image_frame;
 
+// !!! All frames stay unpacked: a loaded frameset becomes layers as a whole,
+// and layers cannot be kept packed, so lazy frame storage would only add
+// deflate/inflate time. It has to wait for a frame player that keeps frames.
 typedef struct {
 	image_frame *frames;	// Pointer to frames array
 	png_color *pal;		// Default palette
@@ -823,6 +826,8 @@ int sb_dist;				// Distance measure
 int sb_rect[4];				// Backbuffer placement
 int init_sb();				// Create shapeburst backbuffer
 void render_sb(unsigned char *mask);	// Render from shapeburst backbuffer
+void init_spans();			// Start collecting drawn rows
+void render_spans();			// Draw collected rows, merged
 
 int mem_clip_mask_init(unsigned char val);		// Initialise the clipboard mask
 //	Extract alpha info from RGB clipboard
@@ -835,9 +840,23 @@ void mem_clip_mask_clear();				// Clear the clipboard mask
 
 void mem_smudge(int ox, int oy, int nx, int ny);
 
+//	Run operation over rows or pixels, split between threads
+typedef void (*band_func)(void *data, unsigned char *buf, int start, int cnt);
+int mem_bands(band_func what, void *data, int w, int cnt, int bsize);
+
+//	Decimated image copies for zoomed-out rendering
+int mem_mip_step(int zoom);		// Decimation step for zoom, 0 if none
+void mem_mip_dirty(image_info *image, int x, int y, int w, int h); // Mark area changed
+void mem_mip_prepare(image_info *image, int step);	// Refresh copy (main thread only)
+unsigned char **mem_mip_get(image_info *image, int step);	// Copy if ready
+void mem_mip_free(chanlist img);	// Drop copies of image channels
+size_t mem_mip_size();			// Memory used by copies
+
 //	Apply colour transform
 void do_transform(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0, int m0);
+//	Apply colour transform to the image, threaded
+void mem_transform_image();
 
 //	Apply thresholding
 void do_xhold(int start, int step, int cnt, unsigned char *mask,
@@ -866,6 +885,24 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 	chanlist new_img, int nw, int nh, int type, int gcor, int sharp);
 int mem_image_resize(int nw, int nh, int ox, int oy, int mode);	// Resize image
 
+//	Scale image row by row, from a ring buffer of source rows
+typedef struct {
+	int ow, oh, nw, nh, bpp, gcor;
+	int rows;		// Ring buffer must hold this many at once
+	double scaley, deltay;
+	void *hfilter, *vfilter;
+	double *work;
+	int *xmap;
+	void *mem;
+} rowscale;
+
+int mem_rowscale_init(rowscale *rs, int ow, int oh, int nw, int nh, int bpp,
+	int alpha, int type, int gcor, int sharp);
+void mem_rowscale_rows(rowscale *rs, int y, int *y0, int *y1);
+void mem_rowscale(rowscale *rs, int y, unsigned char *src, unsigned char *srca,
+	int ring, unsigned char *dest, unsigned char *desta);
+void mem_rowscale_free(rowscale *rs);
+
 int mem_isometrics(int type);
 
 void mem_threshold(unsigned char *img, int len, int level);	// Threshold channel values
@@ -877,9 +914,20 @@ int is_filled(unsigned char *data, unsigned char val, int len);	// Check if byte
 
 int flood_fill(int x, int y, unsigned int target);
 
+/* Y-packed bitmaps of fill candidates, and of allowed steps right & down;
+ * with "ready" flags, bands of them get filled in when the fill gets there */
+typedef struct {
+	unsigned char *cmap, *emap[2], *ready;
+	void *fdata;
+	int w, h, nready;
+} fillmaps;
+
+int mem_fill_bitmap(int x, int y, unsigned char *bmap, fillmaps *fm);
+
 void sline( int x1, int y1, int x2, int y2 );			// Draw single thickness straight line
 void tline( int x1, int y1, int x2, int y2, int size );		// Draw size thickness straight line
 void g_para( int x1, int y1, int x2, int y2, int xv, int yv );	// Draw general parallelogram
+void put_pixel_rows(int x, int y, int w, int h, unsigned char *xsel);	// Draw a block of rows
 void f_rectangle( int x, int y, int w, int h );			// Draw a filled rectangle
 void f_circle( int x, int y, int r );				// Draw a filled circle
 void mem_ellipse( int x1, int y1, int x2, int y2, int thick );	// Thickness 0 means filled
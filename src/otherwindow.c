@@ -155,6 +155,7 @@ static void create_new(newwin_dd *dt, void **wdata)
 	{
 		// Ensure that both this window and the main one are offscreen
 		cmd_setv(wdata, (void *)(TRUE), WINDOW_DISAPPEAR);
+		canvas_tiles_free(); // No use while hidden
 
 		if (dt->delay) sleep(dt->delay);
 
@@ -673,9 +674,6 @@ static void brcosa_moved(brcosa_dd *dt, void **wdata, int what, void **where)
 
 static void brcosa_btn(brcosa_dd *dt, void **wdata, int what)
 {
-	unsigned char *mask, *mask0, *tmp, *xbuf;
-	int i;
-
 	mem_pal_copy(mem_pal, dt->pal);
 
 	if (what == op_EVT_CANCEL); 
@@ -687,26 +685,8 @@ static void brcosa_btn(brcosa_dd *dt, void **wdata, int what)
 		run_query(wdata); // This may modify palette if preview active
 
 		brcosa_preview(dt, NULL); // This definitely modifies it
-		while (mem_preview && (mem_img_bpp == 3)) // This modifies image
-		{
-			mask = malloc(mem_width * 4);
-			if (!mask) break;
-			xbuf = mask + mem_width;
-			mask0 = NULL;
-			if (!channel_dis[CHN_MASK]) mask0 = mem_img[CHN_MASK];
-			tmp = mem_img[CHN_IMAGE];
-			for (i = 0; i < mem_height; i++)
-			{
-				prep_mask(0, 1, mem_width, mask, mask0, tmp);
-				do_transform(0, 1, mem_width, mask, xbuf, tmp, 255);
-				process_img(0, 1, mem_width, mask, tmp, tmp, xbuf,
-					NULL, 3, BLENDF_SET | BLENDF_INVM);
-				if (mask0) mask0 += mem_width;
-				tmp += mem_width * 3;
-			}
-			free(mask);
-			break;
-		}
+		if (mem_preview && (mem_img_bpp == 3)) // This modifies image
+			mem_transform_image();
 		if (mem_preview_clip && (mem_img_bpp == 3) && (mem_clip_bpp == 3))
 		{
 			// This modifies clipboard
@@ -1066,6 +1046,58 @@ void pressed_scale_size(int mode)
 	run_create_(sisca_code, &tdata, sizeof(tdata), script_cmds);
 }
 
+///	STREAMED CONVERSION (script mode only)
+
+typedef struct {
+	char *name, *dest;
+	int w, h, type, gamma, rgb, thr;
+} conv_dd;
+
+#define WBbase conv_dd
+static void *conv_code[] = {
+	TOPVBOX,
+	uPATHSTR(name),
+	uPATHSTR(dest), OPNAME("To"),
+	uSPIN(w, 0, MAX_WIDTH), OPNAME("Width"),
+	uSPIN(h, 0, MAX_HEIGHT), OPNAME("Height"),
+	OPT(scale_modes, 7, type), OPNAME("Type"),
+	uCHECK("Gamma corrected", gamma),
+	uCHECK("RGB", rgb),
+	uSPIN(thr, 0, 255), OPNAME("Threshold"),
+	WSHOW
+};
+#undef WBbase
+
+/* Convert a file without loading it as image, for batch jobs */
+void pressed_convert()
+{
+	conv_dd *dt, tdata = { NULL, NULL, 0, 0, scale_mode, use_gamma };
+	conv_settings cs;
+	void **wdata;
+	int res = WRONG_FORMAT;
+
+	if (!script_cmds) return;
+	wdata = run_create_(conv_code, &tdata, sizeof(tdata), script_cmds);
+	run_query(wdata);
+	dt = GET_DDATA(wdata);
+	memset(&cs, 0, sizeof(cs));
+	cs.width = dt->w;
+	cs.height = dt->h;
+	cs.scale_type = dt->type;
+	cs.gcor = dt->gamma;
+	cs.sharp = sharper_reduce;
+	cs.rgb = dt->rgb;
+	cs.threshold = dt->thr;
+	if (dt->name && dt->name[0] && dt->dest && dt->dest[0])
+		res = convert_image(dt->name, dt->dest, &cs);
+	run_destroy(wdata);
+
+	if (res == FILE_MEM_ERROR) memory_errors(1);
+	else if (res) alert_box(_("Error"), res == WRONG_FORMAT ?
+		_("These file formats cannot be converted without loading.") :
+		_("Unable to convert file"), NULL);
+}
+
 
 ///	PALETTE EDITOR WINDOW
 
@@ -63,6 +63,7 @@ void pressed_add_cols();
 void pressed_brcosa(void **xb);
 void pressed_bacteria();
 void pressed_scale_size(int mode);
+void pressed_convert();
 
 void pressed_sort_pal();
 void pressed_quantize(int palette);
@@ -21,6 +21,11 @@
 
 #include <stdio.h>
 #include <errno.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #define PNG_READ_PACK_SUPPORTED
 
@@ -291,6 +296,81 @@ static int process_page_frame(char *file_name, ani_settings *ani, ls_settings *w
 	return (0);
 }
 
+/* Frames of multiframe files get decoded in batches: the main thread reads in
+ * the frames' data, helper threads decode them, then the main thread stores
+ * or composites the frames in file order */
+
+#define FRAME_BATCH 16 /* Max frames decoded at once */
+
+typedef struct {
+	ls_settings set;
+	png_color pal[256];
+	unsigned char *buf;	// Raw frame data
+	size_t len;
+	int idx;		// Frame index
+	f_long ofs;		// Frame's offset in file
+	int disp;		// Disposal method
+	unsigned char hdr[32];	// Frame header
+	int res;		// Result of decoding
+} framejob;
+
+typedef int (*frame_func)(framejob *job, void *data);
+
+typedef struct {
+	frame_func decode;
+	void *data;
+	framejob *jobs;
+} framebatch;
+
+static void init_frame_job(framejob *job, ls_settings *settings)
+{
+	job->set = *settings;
+	job->set.pal = job->pal;
+	mem_pal_copy(job->pal, settings->pal);
+}
+
+/* Free what is left of a batch */
+static void clear_frames(framejob *jobs, int cnt)
+{
+	for (; cnt > 0; cnt--, jobs++)
+	{
+		mem_free_chanlist(jobs->set.img);
+		free(jobs->buf);
+		memset(jobs, 0, sizeof(framejob));
+	}
+}
+
+static void do_frame_jobs(tcb *thread)
+{
+	framebatch *fb = thread->data;
+	framejob *job = fb->jobs + thread->step0;
+	int i;
+
+	for (i = thread->nsteps; i > 0; i--, job++)
+		job->res = fb->decode(job, fb->data);
+}
+
+/* Decode cnt queued frames, one per helper thread at a time; progressbars
+ * cannot be driven from there, so threaded frames load silently */
+static void decode_frames(framebatch *fb, int cnt)
+{
+	threaddata *tdata;
+	int i;
+
+	tdata = talloc(MA_SKIP_ZEROSIZE | MA_FLAG_NONE, cnt,
+		fb, sizeof(framebatch), NULL, NULL);
+	if (tdata && (tdata != MEM_NONE)) // 2+ threads
+	{
+		for (i = 0; i < cnt; i++) fb->jobs[i].set.silent = TRUE;
+		tdata->chunks = cnt;
+		tdata->silent = TRUE;
+		launch_threads(do_frame_jobs, tdata, NULL, cnt);
+		free(tdata);
+	}
+	else for (i = 0; i < cnt; i++)
+		fb->jobs[i].res = fb->decode(fb->jobs + i, fb->data);
+}
+
 /* Receives struct with image parameters, and channel flags;
  * returns 0 for success, or an error code;
  * success doesn't mean that anything was allocated, loader must check that;
@@ -443,11 +523,34 @@ static void delete_alpha(ls_settings *settings, int v)
 		deallocate_image(settings, CMASK_ALPHA);
 }
 
+/* For raster formats, a size request means the least size needed, so that
+ * decoders which can skip the finer detail may produce a reduced image */
+static int want_reduced(ls_settings *settings, int w, int h)
+{
+	/* Only when loading an image to work on */
+	if ((settings->mode != FS_PNG_LOAD) && (settings->mode != FS_LAYER_LOAD))
+		return (FALSE);
+	return (settings->req_w && settings->req_h &&
+		(settings->req_w < w) && (settings->req_h < h));
+}
+
+/* How many times the image can be halved, staying no less than requested */
+static int reduce_shift(ls_settings *settings, int w, int h, int max)
+{
+	int n = 0;
+
+	if (!want_reduced(settings, w, h)) return (0);
+	while ((n < max) && (((w - 1) >> (n + 1)) + 1 >= settings->req_w) &&
+		(((h - 1) >> (n + 1)) + 1 >= settings->req_h)) n++;
+	return (n);
+}
+
 typedef struct {
 	FILE *file; // for traditional use
 	const char **strs; // for XPM use
 	memx2 m; // data
 	int top;  // end of data
+	int mapped; // data is a mapped file
 } memFILE;
 #define MEMFILE_MAX INT_MAX /* How much it can hold */
 
@@ -455,6 +558,58 @@ typedef struct {
 #error "Mismatched max sizes"
 #endif
 
+#define MMAP_MIN (1024 * 1024) /* Smaller files are read as usual */
+
+/* Map a large file into memory, to be parsed in place, without stdio buffers
+ * and extra copies; failing that, caller should use the file as usual */
+static int mfmap(memFILE *mf, char *file_name)
+{
+#ifndef WIN32
+	struct stat st;
+	void *p = MAP_FAILED;
+	int fd;
+
+	memset(mf, 0, sizeof(memFILE));
+	if ((fd = open(file_name, O_RDONLY)) < 0) return (FALSE);
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+		(st.st_size >= MMAP_MIN) && (st.st_size <= MEMFILE_MAX))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return (FALSE);
+#ifdef MADV_SEQUENTIAL
+	/* Loaders go from start to end, mostly */
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+	mf->m.buf = p;
+	mf->m.size = mf->top = st.st_size;
+	mf->mapped = TRUE;
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
+}
+
+static void mfunmap(memFILE *mf)
+{
+#ifndef WIN32
+	if (mf->mapped) munmap(mf->m.buf, mf->m.size);
+#endif
+	mf->mapped = FALSE;
+}
+
+/* Access next len bytes in place, if they and spare bytes after them are in
+ * memory; NULL means, use mfread() */
+static unsigned char *mfpeek(memFILE *mf, int len, int spare)
+{
+	unsigned char *res;
+
+	if (mf->file || (mf->m.here < 0) ||
+		(mf->top - mf->m.here < len + spare)) return (NULL);
+	res = (unsigned char *)mf->m.buf + mf->m.here;
+	mf->m.here += len;
+	return (res);
+}
+
 static size_t mfread(void *ptr, size_t size, size_t nmemb, memFILE *mf)
 {
 	size_t l, m;
@@ -728,8 +883,9 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf, int fra
 		{1, 2, 0, 2},
 		{0, 1, 1, 2}
 	};
-	static png_bytep *row_pointers;
-	static char *msg;
+	/* Volatile to survive longjmp(), and not static to allow threading */
+	png_bytep *volatile row_pointers;
+	char *volatile msg;
 	png_structp png_ptr;
 	png_infop info_ptr;
 	png_unknown_chunkp uk_p;
@@ -1012,6 +1168,428 @@ fail:	if (fp) fclose(fp);
 	return (res);
 }
 
+/* Deflate image rows on helper threads: the image is cut into bands, each
+ * compressed on its own - either into an independent zlib stream (TIFF strips),
+ * or, the way pigz does it, into a raw deflate piece primed with the preceding
+ * 32K of data and ended with a sync flush, so that the pieces concatenate into
+ * one valid stream (PNG IDAT) */
+
+#define ZBAND_SIZE (256 * 1024) /* Min uncompressed bytes per band */
+#define ZWINDOW    32768
+
+enum {
+	ZF_NONE = 0,	// Rows as they are
+	ZF_SUB,		// TIFF horizontal predictor
+	ZF_PNG		// PNG, filter types from mask
+};
+
+typedef struct {
+	ls_settings *settings;
+	int bpp;		// Bytes per pixel, 0 for packed bits
+	int prep;		// Rows need prepare_row()
+	int filter;		// Row filtering: ZF_*
+	int mask;		// PNG filter types allowed: PNG_FILTER_*
+	int join;		// Make parts of one raw stream
+	int level, strategy;	// Compression level & zlib strategy
+	int rows, nbands;	// Band height & count
+	int rowlen, flen;	// Bytes per row, before & after filtering
+	unsigned char **data;	// Compressed bands
+	uLong *len, *adler;	// Their lengths & checksums
+	int fail;
+} zbands;
+
+static void pack_MSB(unsigned char *dest, unsigned char *src, int len, int bw);
+
+static unsigned char *zband_row(zbands *zb, unsigned char *buf, int y)
+{
+	ls_settings *settings = zb->settings;
+	unsigned char *src = settings->img[CHN_IMAGE] +
+		settings->width * y * settings->bpp;
+
+	if (!zb->bpp) /* Pack the bits */
+	{
+		pack_MSB(buf, src, settings->width, 1);
+		src = buf;
+	}
+	else if (zb->prep) src = prepare_row(buf, settings, zb->bpp, y);
+	return (src);
+}
+
+/* Filter a row into dest, for PNG picking of allowed types the one with least
+ * sum of absolute differences like libpng does; prev is the previous row, or
+ * zeros */
+static unsigned char *filter_row(zbands *zb, unsigned char *dest,
+	unsigned char *src, unsigned char *prev)
+{
+	unsigned char *tmp, *res;
+	int i, k, a, b, c, pa, pb, pc, sum, best;
+	int l = zb->rowlen, bpp = zb->bpp;
+
+	if (zb->filter == ZF_NONE) return (src);
+	if (zb->filter == ZF_SUB)
+	{
+		memcpy(dest, src, bpp);
+		for (i = bpp; i < l; i++) dest[i] = src[i] - src[i - bpp];
+		return (dest);
+	}
+
+	/* Try the allowed filter types in turn */
+	res = tmp = dest;
+	best = INT_MAX;
+	for (k = 0; k < 5; k++)
+	{
+		if (!(zb->mask & (PNG_FILTER_NONE << k))) continue;
+		tmp[0] = k;
+		switch (k)
+		{
+		case 0: /* None */
+			memcpy(tmp + 1, src, l);
+			break;
+		case 1: /* Sub */
+			memcpy(tmp + 1, src, bpp);
+			for (i = bpp; i < l; i++) tmp[i + 1] = src[i] - src[i - bpp];
+			break;
+		case 2: /* Up */
+			for (i = 0; i < l; i++) tmp[i + 1] = src[i] - prev[i];
+			break;
+		case 3: /* Average */
+			for (i = 0; i < bpp; i++) tmp[i + 1] = src[i] - (prev[i] >> 1);
+			for (; i < l; i++)
+				tmp[i + 1] = src[i] - ((src[i - bpp] + prev[i]) >> 1);
+			break;
+		case 4: /* Paeth */
+			for (i = 0; i < bpp; i++) tmp[i + 1] = src[i] - prev[i];
+			for (; i < l; i++)
+			{
+				a = src[i - bpp]; b = prev[i]; c = prev[i - bpp];
+				pa = abs(b - c); pb = abs(a - c);
+				pc = abs(a + b - c - c);
+				tmp[i + 1] = src[i] - ((pa <= pb) && (pa <= pc) ?
+					a : pb <= pc ? b : c);
+			}
+			break;
+		}
+		/* The only one allowed */
+		if (!(zb->mask & ~(PNG_FILTER_NONE << k) & PNG_ALL_FILTERS))
+			return (tmp);
+		for (sum = 0 , i = 1; i <= l; i++)
+			sum += tmp[i] < 128 ? tmp[i] : 256 - tmp[i];
+		if (sum < best) best = sum , res = tmp;
+		tmp += l + 1;
+	}
+	return (res);
+}
+
+/* Feed data to deflate, growing the output buffer as needed */
+static int zband_deflate(z_stream *zs, unsigned char **out, uLong *size,
+	unsigned char *src, int len, int flush)
+{
+	unsigned char *tmp;
+	int r;
+
+	zs->next_in = src;
+	zs->avail_in = len;
+	while (TRUE)
+	{
+		if (!zs->avail_out)
+		{
+			*size += (*size >> 1) + 1024;
+			if (!(tmp = realloc(*out, *size))) return (FALSE);
+			*out = tmp;
+			zs->next_out = tmp + zs->total_out;
+			zs->avail_out = *size - zs->total_out;
+		}
+		r = deflate(zs, flush);
+		if (r == Z_STREAM_END) return (TRUE);
+		if ((r != Z_OK) && (r != Z_BUF_ERROR)) return (FALSE);
+		if (zs->avail_out && (flush != Z_FINISH)) return (TRUE);
+	}
+}
+
+static void deflate_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	zbands *zb = data;
+	z_stream zs;
+	unsigned char *rb, *zero, *fb, *dict, *src, *prev, *tmp, *out;
+	uLong size, adler;
+	int b, y, y0, y1, yd, dl, ok, flush, h = zb->settings->height;
+
+	rb = buf;
+	zero = buf + zb->rowlen * 2;
+	fb = zero + zb->rowlen;
+	dict = fb + zb->flen * 5;
+	memset(zero, 0, zb->rowlen);
+
+	for (b = start; b < start + cnt; b++)
+	{
+		if (zb->fail) break;
+		y0 = b * zb->rows;
+		y1 = y0 + zb->rows;
+		if (y1 > h) y1 = h;
+
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, zb->level, Z_DEFLATED, zb->join ? -15 : 15,
+			8, zb->strategy) != Z_OK) break;
+		size = (y1 - y0) * zb->flen;
+		size += (size >> 8) + 64;
+		out = malloc(size);
+		zs.next_out = out;
+		zs.avail_out = out ? size : 0;
+
+		/* Previous band's tail will be the dictionary */
+		yd = y0;
+		if (zb->join && y0) yd = y0 - (ZWINDOW + zb->flen - 1) / zb->flen;
+		if (yd < 0) yd = 0;
+		prev = yd ? zband_row(zb, rb + ((yd - 1) & 1) * zb->rowlen,
+			yd - 1) : zero;
+
+		adler = adler32(0L, Z_NULL, 0);
+		ok = !!out;
+		for (dl = 0 , y = yd; ok && (y < y1); y++)
+		{
+			src = zband_row(zb, rb + (y & 1) * zb->rowlen, y);
+			tmp = filter_row(zb, fb, src, prev);
+			prev = src;
+			if (y < y0)
+			{
+				memcpy(dict + dl, tmp, zb->flen);
+				dl += zb->flen;
+				if (y < y0 - 1) continue;
+				tmp = dl > ZWINDOW ? dict + dl - ZWINDOW : dict;
+				ok = deflateSetDictionary(&zs, tmp,
+					dl - (tmp - dict)) == Z_OK;
+				continue;
+			}
+			if (zb->join) adler = adler32(adler, tmp, zb->flen);
+			flush = y < y1 - 1 ? Z_NO_FLUSH :
+				zb->join && (y1 < h) ? Z_SYNC_FLUSH : Z_FINISH;
+			ok = zband_deflate(&zs, &out, &size, tmp, zb->flen, flush);
+		}
+		zb->data[b] = out;
+		zb->len[b] = zs.total_out;
+		zb->adler[b] = adler;
+		deflateEnd(&zs);
+		if (!ok) break;
+	}
+	if (b < start + cnt) zb->fail = TRUE;
+}
+
+static void deflate_bands_free(zbands *zb)
+{
+	int i;
+
+	for (i = 0; i < zb->nbands; i++) free(zb->data[i]);
+	free(zb->data);
+	zb->nbands = 0;
+}
+
+/* Returns TRUE if compressed the image in bands, FALSE if not worth it or
+ * failed to */
+static int deflate_bands(zbands *zb)
+{
+	int w = zb->settings->width, h = zb->settings->height;
+
+	zb->rowlen = zb->bpp ? w * zb->bpp : (w + 7) >> 3;
+	zb->flen = zb->rowlen + (zb->filter == ZF_PNG);
+	zb->rows = (ZBAND_SIZE + zb->rowlen - 1) / zb->rowlen;
+	zb->nbands = (h + zb->rows - 1) / zb->rows;
+	zb->data = NULL;
+	zb->fail = FALSE;
+	if ((zb->nbands < 2) || (image_threads(w, h) < 2) ||
+		!multialloc(MA_ALIGN_DEFAULT,
+		&zb->data, zb->nbands * sizeof(unsigned char *),
+		&zb->len, zb->nbands * sizeof(uLong),
+		&zb->adler, zb->nbands * sizeof(uLong), NULL))
+	{
+		zb->nbands = 0;
+		return (FALSE);
+	}
+
+	if (!mem_bands(deflate_rows, zb, w * zb->rows, zb->nbands,
+		zb->rowlen * 3 + zb->flen * 6 + ZWINDOW) || zb->fail)
+	{
+		deflate_bands_free(zb);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+#if ZLIB_VERNUM >= 0x1221 /* Need adler32_combine() */
+
+/* Write bands compressed by deflate_bands() as IDAT chunks, adding zlib
+ * header and checksum around them */
+static void png_write_bands(png_structp png_ptr, zbands *zb)
+{
+	unsigned char buf[4];
+	uLong adler = zb->adler[0];
+	int i, l, h = zb->settings->height;
+
+	i = zb->level < 0 ? 2 : zb->level < 2 ? 0 : zb->level < 6 ? 1 :
+		zb->level == 6 ? 2 : 3;
+	l = 0x7800 + (i << 6);
+	l += 31 - l % 31;
+	buf[0] = l >> 8;
+	buf[1] = l & 0xFF;
+	png_write_chunk_start(png_ptr, (png_bytep)"IDAT", zb->len[0] + 2);
+	png_write_chunk_data(png_ptr, buf, 2);
+	png_write_chunk_data(png_ptr, zb->data[0], zb->len[0]);
+	png_write_chunk_end(png_ptr);
+
+	for (i = 1; i < zb->nbands - 1; i++)
+	{
+		png_write_chunk(png_ptr, (png_bytep)"IDAT", zb->data[i],
+			zb->len[i]);
+		adler = adler32_combine(adler, zb->adler[i], zb->rows * zb->flen);
+	}
+
+	adler = adler32_combine(adler, zb->adler[i],
+		(h - i * zb->rows) * zb->flen);
+	buf[0] = adler >> 24;
+	buf[1] = (adler >> 16) & 0xFF;
+	buf[2] = (adler >> 8) & 0xFF;
+	buf[3] = adler & 0xFF;
+	png_write_chunk_start(png_ptr, (png_bytep)"IDAT", zb->len[i] + 4);
+	png_write_chunk_data(png_ptr, zb->data[i], zb->len[i]);
+	png_write_chunk_data(png_ptr, buf, 4);
+	png_write_chunk_end(png_ptr);
+}
+
+#endif
+
+/* PNG save profiles: filter types and zlib strategy get picked by compressing
+ * sample rows each way worth trying, and then, if the whole image is estimated
+ * to take more than the time budget, the level is lowered to fit */
+
+char *png_profiles[] = { _("Fixed"), _("Fast"), _("Balanced"), _("Small"),
+	NULL };
+int png_profile, png_budget;
+double png_stats[3];
+
+#ifndef Z_RLE /* zlib before 1.2.0.1 */
+#define Z_RLE Z_DEFAULT_STRATEGY
+#endif
+
+#define PSAMPLE_RUN  4		   /* Consecutive rows per sample */
+#define PSAMPLE_SIZE (128 * 1024) /* Max bytes in all samples */
+#define PSAMPLE_OUT  16384	   /* Output buffer size */
+
+static const unsigned char png_ways[][2] = {
+	{ PNG_ALL_FILTERS,  Z_FILTERED },	// libpng default for RGB
+	{ PNG_FILTER_NONE,  Z_RLE },		// Flat areas & pixel art
+	{ PNG_FILTER_NONE,  Z_DEFAULT_STRATEGY }, // libpng default for indexed
+	{ PNG_FILTER_UP,    Z_RLE },
+	{ PNG_FILTER_SUB,   Z_FILTERED },
+	{ PNG_FILTER_PAETH, Z_FILTERED },	// Photos
+	{ PNG_ALL_FILTERS,  Z_DEFAULT_STRATEGY },
+	{ PNG_ALL_FILTERS,  Z_RLE },
+};
+static const int png_plevels[] = { 0, 1, 6, 9 };
+
+/* Compress sample rows, return compressed size or -1 */
+static int png_sample(zbands *zb, unsigned char *buf, int step, int *insize)
+{
+	z_stream zs;
+	unsigned char *rb = buf, *zero, *fb, *out, *src, *prev;
+	int y, n, r, h = zb->settings->height;
+
+	zero = buf + zb->rowlen * 2;
+	fb = zero + zb->rowlen;
+	out = fb + zb->flen * 5;
+	memset(zero, 0, zb->rowlen);
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, zb->level, Z_DEFLATED, -15, 8, zb->strategy)
+		!= Z_OK) return (-1);
+	for (r = Z_OK , y = 0; (r != Z_STREAM_ERROR) && (y < h); y += step)
+	{
+		prev = y ? zband_row(zb, rb + ((y - 1) & 1) * zb->rowlen, y - 1) :
+			zero;
+		for (n = y; (n < y + PSAMPLE_RUN) && (n < h); n++)
+		{
+			src = zband_row(zb, rb + (n & 1) * zb->rowlen, n);
+			zs.next_in = filter_row(zb, fb, src, prev);
+			zs.avail_in = zb->flen;
+			prev = src;
+			do
+			{
+				zs.next_out = out;
+				zs.avail_out = PSAMPLE_OUT;
+				r = deflate(&zs, Z_NO_FLUSH);
+			} while (!zs.avail_out && (r != Z_STREAM_ERROR));
+		}
+	}
+	while (r == Z_OK)
+	{
+		zs.next_out = out;
+		zs.avail_out = PSAMPLE_OUT;
+		r = deflate(&zs, Z_FINISH);
+	}
+	*insize = zs.total_in;
+	n = r == Z_STREAM_END ? zs.total_out : -1;
+	deflateEnd(&zs);
+	return (n);
+}
+
+/* Pick compression parameters for the profile */
+static void png_choose(zbands *zb, int profile, int threads)
+{
+	GTimer *timer;
+	unsigned char *buf;
+	double t, bt = 0.0, spent = 0.0, all;
+	int i, l, insize, step, rows, h = zb->settings->height;
+	int bi = 0, best = INT_MAX, budget = png_budget;
+
+	zb->level = png_plevels[profile];
+	zb->rowlen = zb->settings->width * zb->bpp;
+	zb->flen = zb->rowlen + 1;
+	all = (double)zb->flen * h;
+	buf = malloc(zb->rowlen * 3 + zb->flen * 5 + PSAMPLE_OUT);
+	if (!buf) return; // Stay with defaults
+	timer = g_timer_new();
+
+	/* Spread sample runs evenly over the image */
+	rows = PSAMPLE_SIZE / zb->flen;
+	if (rows < PSAMPLE_RUN) rows = PSAMPLE_RUN;
+	step = h / ((rows + PSAMPLE_RUN - 1) / PSAMPLE_RUN);
+	if (step < PSAMPLE_RUN) step = PSAMPLE_RUN;
+
+	for (i = 0; i < sizeof(png_ways) / sizeof(png_ways[0]); i++)
+	{
+		zb->mask = png_ways[i][0];
+		zb->strategy = png_ways[i][1];
+		g_timer_start(timer);
+		l = png_sample(zb, buf, step, &insize);
+		t = g_timer_elapsed(timer, NULL);
+		spent += t;
+		if ((l >= 0) && (l < best)) best = l , bt = t , bi = i;
+		/* Do not let trying eat up the budget */
+		if (budget && (spent * 4000.0 > budget)) break;
+	}
+	zb->mask = png_ways[bi][0];
+	zb->strategy = png_ways[bi][1];
+
+	/* Lower the level while whole image is estimated to take too long */
+	while (budget && (best < INT_MAX) &&
+		(bt * all * 1000.0 / (insize * threads) > budget))
+	{
+		if (zb->level > 1) zb->level = zb->level > 6 ? 6 :
+			zb->level > 3 ? 3 : 1;
+		/* Last resort: the fastest way there is */
+		else if ((zb->mask != PNG_FILTER_NONE) || (zb->strategy != Z_RLE))
+		{
+			zb->mask = PNG_FILTER_NONE;
+			zb->strategy = Z_RLE;
+		}
+		else break;
+		g_timer_start(timer);
+		if (png_sample(zb, buf, step, &insize) < 0) break;
+		bt = g_timer_elapsed(timer, NULL);
+	}
+
+	g_timer_destroy(timer);
+	free(buf);
+}
+
 #ifndef PNG_AFTER_IDAT
 #define PNG_AFTER_IDAT 8
 #endif
@@ -1023,11 +1601,13 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 	png_infop info_ptr;
 	FILE *fp = NULL;
 	int h = settings->height, w = settings->width, bpp = settings->bpp;
-	int i, j, res = -1;
+	int i, j, raw = FALSE, res = -1;
 	long uninit_(dest_len), res_len;
 	char *mess = NULL;
 	unsigned char trans[256], *tmp, *rgba_row = NULL;
 	png_color_16 trans_rgb;
+	GTimer *timer;
+	zbands zb;
 
 	/* Baseline PNG format does not support alpha for indexed images, so
 	 * we have to convert them to RGBA for clipboard export - WJ */
@@ -1070,10 +1650,28 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 	if (!info_ptr) goto exit2;
 
 	res = 0;
+	timer = g_timer_new();
 
 	if (!mf) png_init_io(png_ptr, fp);
 	else png_set_write_fn(png_ptr, mf, png_memwrite, png_memflush);
-	png_set_compression_level(png_ptr, settings->png_compression);
+
+	/* Settle how to compress */
+	zb.settings = settings;
+	zb.bpp = bpp;
+	zb.prep = !!rgba_row;
+	zb.filter = ZF_PNG;
+	zb.mask = bpp == 1 ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+	zb.join = TRUE;
+	zb.level = settings->png_compression;
+	zb.strategy = bpp == 1 ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	if (settings->png_profile > 0)
+	{
+		png_choose(&zb, settings->png_profile, (w * bpp + 1) * h >=
+			ZBAND_SIZE * 2 ? image_threads(w, h) : 1);
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, zb.mask);
+		png_set_compression_strategy(png_ptr, zb.strategy);
+	}
+	png_set_compression_level(png_ptr, zb.level);
 
 	if (bpp == 1)
 	{
@@ -1111,6 +1709,16 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 
 	if (mess) ls_init(mess, 1);
 
+#if ZLIB_VERNUM >= 0x1221
+	/* Compress in parallel if worth it */
+	if (deflate_bands(&zb))
+	{
+		png_write_bands(png_ptr, &zb);
+		deflate_bands_free(&zb);
+		raw = TRUE;
+	}
+	else
+#endif
 	for (j = 0; j < h; j++)
 	{
 		tmp = prepare_row(rgba_row, settings, bpp, j);
@@ -1144,6 +1752,13 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 		res_len = dest_len;
 		if (compress2(tmp, &res_len, settings->img[i], w,
 			settings->png_compression) != Z_OK) continue;
+		/* IDAT went around libpng, so it won't write anything after */
+		if (raw)
+		{
+			png_write_chunk(png_ptr, (png_bytep)chunk_names[i], tmp,
+				res_len);
+			continue;
+		}
 		strncpy(unknown0.name, chunk_names[i], 5);
 		unknown0.data = tmp;
 		unknown0.size = res_len;
@@ -1155,7 +1770,15 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 #endif
 	}
 	free(tmp);
-	png_write_end(png_ptr, info_ptr);
+	if (raw) png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+	else png_write_end(png_ptr, info_ptr);
+
+	/* Report size, percentage of raw data size, and milliseconds taken */
+	png_stats[0] = mf ? mf->top : (double)ftell(fp);
+	png_stats[1] = rint((png_stats[0] * 100.0) / ((double)(settings->width *
+		bpp + 1) * h));
+	png_stats[2] = rint(g_timer_elapsed(timer, NULL) * 1000.0);
+	g_timer_destroy(timer);
 
 	if (mess) progress_end();
 
@@ -1849,17 +2472,40 @@ static int png_scan(FILE *fp, pnghead *pg)
 	return (-1); // Failed
 }
 
-static int load_apng_frame(FILE *fp, pnghead *pg, ls_settings *settings)
+/* Read in the next frame's data as a fake PNG, for decoding it later */
+static int queue_apng_frame(FILE *fp, pnghead *pg, framejob *job)
 {
-	unsigned char *w;
-	int l, res;
+	int res;
 
 	/* Try scanning the frame */
 	res = png_scan(fp, pg);
 	/* Prepare fake PNG */
 	if (!res) res = assemble_png(fp, pg);
+	if (res) return (res);
+	/* Hand the buffer over to the frame; header will be reread */
+	job->buf = pg->png;
+	job->len = pg->mf.top;
+	pg->png = NULL;
+	pg->sz = 0;
+	memcpy(job->hdr, pg->fctl, fcTL_SIZE);
+	job->disp = pg->disp;
+	return (0);
+}
+
+static int decode_apng_frame(framejob *job, void *data)
+{
+	ls_settings *settings = &job->set;
+	memFILE mf;
+	unsigned char *w;
+	int l, res;
+
 	/* Load the frame */
-	if (!res) res = load_png(NULL, settings, &pg->mf, TRUE);
+	memset(&mf, 0, sizeof(mf));
+	mf.m.buf = job->buf;
+	mf.top = mf.m.size = job->len;
+	res = load_png(NULL, settings, &mf, TRUE);
+	free(job->buf);
+	job->buf = NULL;
 	if (res != 1) return (res); // Fail on any error
 	/* Convert indexed+alpha to RGBA, to let it be regular PNG */
 	w = settings->img[CHN_ALPHA];
@@ -1878,26 +2524,52 @@ static int load_apng_frame(FILE *fp, pnghead *pg, ls_settings *settings)
 	return (res);
 }
 
+/* Read in and decode a batch of frames, after the first done ones; return
+ * how many frames are in it */
+static int apng_batch(FILE *fp, pnghead *pg, framebatch *fb, ani_settings *ani,
+	unsigned done, int *qres)
+{
+	int n;
+
+	clear_frames(fb->jobs, FRAME_BATCH);
+	for (n = 0; n < FRAME_BATCH; n++)
+	{
+		/* Frames count is known after the first frame */
+		if (n && ((pg->phase > 2) || (done + n >= pg->frames))) break;
+		init_frame_job(fb->jobs + n, &ani->settings);
+		if ((*qres = queue_apng_frame(fp, pg, fb->jobs + n))) break;
+	}
+	decode_frames(fb, n);
+	return (n);
+}
+
 static int load_apng_frames(char *file_name, ani_settings *ani)
 {
 	char buf[PNG_BYTES_TO_CHECK + 1];
 	pnghead pg;
 	ani_status stat;
-	ls_settings w_set;
+	framebatch fb;
+	framejob *jobs;
+	ls_settings *w_set;
 	unsigned wx, wy;
-	int n, d, bpp, frames = 0, res = -1;
+	int i, n, d, cnt, bpp, frames = 0, qres = 0, res = -1;
 	FILE *fp;
 
 
 	if (!(fp = fopen(file_name, "rb"))) return (-1);
-	memset(w_set.img, 0, sizeof(chanlist));
 	memset(&pg, 0, sizeof(pg));
+	fb.decode = decode_apng_frame;
+	fb.data = NULL;
+	fb.jobs = jobs = calloc(FRAME_BATCH, sizeof(framejob));
+	res = FILE_MEM_ERROR;
+	if (!jobs) goto fail;
+	res = -1;
 
 	if (fread(buf, 1, PNG_BYTES_TO_CHECK, fp) != PNG_BYTES_TO_CHECK) goto fail;
 	if (png_sig_cmp(buf, 0, PNG_BYTES_TO_CHECK)) goto fail;
 
-	w_set = ani->settings;
-	res = load_apng_frame(fp, &pg, &w_set);
+	cnt = apng_batch(fp, &pg, &fb, ani, 0, &qres);
+	res = cnt ? jobs[0].res : qres;
 	if (res != 1) goto fail;
 
 	/* Init state structure */
@@ -1906,9 +2578,9 @@ static int load_apng_frames(char *file_name, ani_settings *ani)
 	stat.defw = pg.w;
 	stat.defh = pg.h;
 	/* Use whatever palette we read */
-	mem_pal_copy(stat.newpal, w_set.pal);
-	stat.newcols = w_set.colors;
-	stat.newtrans = w_set.xpm_trans;
+	mem_pal_copy(stat.newpal, jobs[0].set.pal);
+	stat.newcols = jobs[0].set.colors;
+	stat.newtrans = jobs[0].set.xpm_trans;
 	ani_init_xlat(&stat); // Init palette remapping to 1:1 and leave at that
 
 	/* Init frameset - palette in APNG is global */
@@ -1917,61 +2589,66 @@ static int load_apng_frames(char *file_name, ani_settings *ani)
 	mem_pal_copy(ani->fset.pal, stat.newpal);
 
 	/* Go through images */
-	while (frames++ < pg.frames)
+	for (i = 0; frames++ < pg.frames; i++)
 	{
 		res = FILE_TOO_LONG;
 		if (!check_next_frame(&ani->fset, ani->settings.mode, TRUE))
 			goto fail;
 
-		/* Get the next frame, after the first */
-		if (frames > 1)
+		/* Get the next batch when this one is used up */
+		if (i >= cnt)
 		{
-			w_set = ani->settings;
-			res = load_apng_frame(fp, &pg, &w_set);
-			if (res != 1) goto fail;
+			i = cnt = 0;
+			if (!qres) cnt = apng_batch(fp, &pg, &fb, ani, frames - 1, &qres);
+			res = qres;
+			if (!cnt) goto fail;
 		}
-		delete_alpha(&w_set, 255);
+		w_set = &jobs[i].set;
+		res = jobs[i].res;
+		if (res != 1) goto fail;
+		delete_alpha(w_set, 255);
 
-		stat.blend = pg.fctl[fcTL_BLEND] && (w_set.img[CHN_ALPHA] ||
+		stat.blend = jobs[i].hdr[fcTL_BLEND] && (w_set->img[CHN_ALPHA] ||
 			(stat.newtrans >= 0));
 		/* Within mtPaint delays are 1/100s granular */
-		n = GET16B(pg.fctl + fcTL_DN);
-		d = GET16B(pg.fctl + fcTL_DD);
+		n = GET16B(jobs[i].hdr + fcTL_DN);
+		d = GET16B(jobs[i].hdr + fcTL_DD);
 		if (!d) d = 100;
-		w_set.gif_delay = (n * 100 + d - 1) / d; // Round up
+		w_set->gif_delay = (n * 100 + d - 1) / d; // Round up
 
-		wx = GET32B(pg.fctl + fcTL_X);
-		wy = GET32B(pg.fctl + fcTL_Y);
+		wx = GET32B(jobs[i].hdr + fcTL_X);
+		wy = GET32B(jobs[i].hdr + fcTL_Y);
 		if (wx > MAX_WIDTH) wx = MAX_WIDTH; // Out is out
 		if (wy > MAX_HEIGHT) wy = MAX_HEIGHT; // Same
-		w_set.x = wx;
-		w_set.y = wy;
+		w_set->x = wx;
+		w_set->y = wy;
 
 		/* Analyze how we can merge the frames */
 		res = TOO_BIG;
-		bpp = analyze_rgba_frame(&stat, &w_set);
+		bpp = analyze_rgba_frame(&stat, w_set);
 		if (bpp < 0) goto fail;
 
 		/* Allocate a new frame */
-		res = add_frame(ani, &stat, &w_set, bpp, pg.disp);
+		res = add_frame(ani, &stat, w_set, bpp, jobs[i].disp);
 		if (res) goto fail;
 
 		/* Do actual compositing, remember disposal method */
-		composite_frame(&ani->fset, &stat, &w_set);
-		mem_free_chanlist(w_set.img);
-		memset(w_set.img, 0, sizeof(chanlist));
+		composite_frame(&ani->fset, &stat, w_set);
+		mem_free_chanlist(w_set->img);
+		memset(w_set->img, 0, sizeof(chanlist));
 
 		/* Write out those frames worthy to be stored */
 		res = done_frame(file_name, ani, FALSE);
 		if (res != 1) goto fail;
 
-		if (pg.phase > 2) break; // End of file
+		if ((pg.phase > 2) && (i + 1 >= cnt)) break; // End of file
 	}
 	/* Write out the final frame if not written before */
 	res = done_frame(file_name, ani, TRUE);
 
-fail:	free(pg.png);
-	mem_free_chanlist(w_set.img);
+fail:	if (jobs) clear_frames(jobs, FRAME_BATCH);
+	free(jobs);
+	free(pg.png);
 	fclose(fp);
 	return (res);
 }
@@ -2292,6 +2969,8 @@ typedef struct {
 	int w, bits, prev;
 	short nxcode[4096 + 1];
 	unsigned char buf[GIF_BUFSIZE], cchar[4096 + 1];
+	short slen[4096];
+	int spos[4096];
 } gifbuf;
 
 static void resetlzw(gifbuf *gif)
@@ -2377,14 +3056,88 @@ static int getlzw(unsigned char *dest, int cnt, gifbuf *gif)
 	return (TRUE);
 }
 
+/* Decode cnt pixels into contiguous memory. A code's string always is a copy of
+ * what some earlier code output, plus one char, so the table holds only where
+ * and how long, and each string gets copied as a whole. Returns pixel count
+ * actually decoded */
+static int decodelzw(unsigned char *dest, int cnt, gifbuf *gif)
+{
+	unsigned char *out = dest, *end = dest + cnt, *pprev = dest;
+	int c, l, plen = 0, w = gif->w, bits = gif->bits, lc = gif->lc;
+	int cmask = gif->cmask, prev = gif->prev, nxc = gif->nxc;
+	int clear = gif->clear;
+
+	while (out < end)
+	{
+		while (bits < lc)
+		{
+			if (gif->ptr >= gif->end)
+			{
+				gif->end = getblock(gif->buf, gif->f);
+				if (gif->end <= 0) goto done; // No data
+				gif->ptr = 0;
+			}
+			w |= gif->buf[gif->ptr++] << bits;
+			bits += 8;
+		}
+		c = w & cmask;
+		w >>= lc;
+		bits -= lc;
+		if (c == clear)
+		{
+			nxc = clear + 2;
+			lc = gif->lc0 + 1;
+			cmask = (1 << lc) - 1;
+			prev = -1;
+			continue;
+		}
+		if (c == clear + 1) break; // Premature EOI
+		if (c > nxc) break; // Broken code
+		if (c < clear) *out = (unsigned char)c , l = 1;
+		else if (c < nxc)
+		{
+			l = gif->slen[c];
+			memcpy(out, dest + gif->spos[c], l > end - out ?
+				end - out : l);
+		}
+		else /* Previous string and its first char */
+		{
+			if (prev < 0) break; // Too early
+			l = plen + 1;
+			memcpy(out, pprev, plen > end - out ? end - out : plen);
+			if (plen < end - out) out[plen] = *pprev;
+		}
+		/* New code: previous string and this one's first char */
+		if ((prev >= 0) && (nxc < 4096))
+		{
+			gif->spos[nxc] = pprev - dest;
+			gif->slen[nxc] = plen + 1;
+			if ((++nxc > cmask) && (cmask < 4096 - 1))
+				cmask = (1 << ++lc) - 1;
+		}
+		prev = c;
+		pprev = out;
+		plen = l;
+		out += l;
+	}
+	if (out > end) out = end;
+done:	gif->w = w;
+	gif->bits = bits;
+	gif->lc = lc;
+	gif->cmask = cmask;
+	gif->prev = prev;
+	gif->nxc = nxc;
+	return (out - dest);
+}
+
 static int load_gif_frame(FILE *fp, ls_settings *settings)
 {
 	/* GIF interlace pattern: Y0, DY, ... */
 	static const unsigned char interlace[10] =
 		{ 0, 1, 0, 8, 4, 8, 2, 4, 1, 2 };
-	unsigned char hdr[GIF_IHDRLEN];
+	unsigned char hdr[GIF_IHDRLEN], *buf = NULL;
 	gifbuf gif;
-	int i, k, kx, n, w, h, dy, res;
+	int i, j, k, kx, n, w, h, dy, res;
 
 
 	/* Read the header */
@@ -2419,7 +3172,21 @@ static int load_gif_frame(FILE *fp, ls_settings *settings)
 	if (hdr[GIF_IBITS] & GIF_ILFLAG) k = 2 , kx = 10; /* Interlace */
 	else k = 0 , kx = 2;
 
-	for (n = 0; k < kx; k += 2)
+	/* Decode all at once, into a buffer if interlaced */
+	if (!k || (buf = malloc(w * h)))
+	{
+		n = decodelzw(buf ? buf : settings->img[CHN_IMAGE], w * h, &gif);
+		for (j = 0; buf && (k < kx); k += 2)
+		{
+			dy = interlace[k + 1];
+			for (i = interlace[k]; (i < h) && (j < n); i += dy , j += w)
+				memcpy(settings->img[CHN_IMAGE] + i * w, buf + j,
+					n - j < w ? n - j : w);
+		}
+		free(buf);
+		if (n < w * h) goto fail;
+	}
+	else for (n = 0; k < kx; k += 2)
 	{
 		dy = interlace[k + 1];
 		for (i = interlace[k]; i < h; n++ , i += dy)
@@ -2631,13 +3398,18 @@ fail:	fclose(fp);
 /* Space enough to hold palette and all headers, or longest block */
 #define GIF_WBUFSIZE (768 + GIF_HDRLEN + (GIF_GC_LEN + 4) + (GIF_IHDRLEN + 2))
 
-/* A cuckoo hash would take 4x less space, but need much more code */
-#define GIF_CODESSIZE ((4096 * 2 * 16) * sizeof(short))
+/* Open-addressed hash of (prefix code, char) pairs, at most half full; keys
+ * carry the generation, so that a clear needs only to start a new one */
+#define GIF_HBITS 13
+#define GIF_HSIZE (1 << GIF_HBITS)
+#define GIF_GEN   (1 << 20) /* Generation step in key */
+#define GIF_CODESSIZE (GIF_HSIZE * (sizeof(int) + sizeof(short)))
 typedef struct {
 	FILE *f;
-	int cnt, nxmap;
+	int cnt, gen;
 	int lc0, lc, nxc, clear, nxc2;
 	int w, bits, prev;
+	int *keys;
 	short *codes;
 	unsigned char buf[GIF_WBUFSIZE];
 } gifcbuf;
@@ -2651,8 +3423,12 @@ static void resetclzw(gifcbuf *gif)
 	gif->nxc = gif->clear + 2; // First usable code
 	gif->lc = gif->lc0 + 1; // Actual code size
 	gif->nxc2 = 1 << gif->lc; // For next code size
-	memset(gif->codes, 0, GIF_CODESSIZE); // Maps
-	gif->nxmap = 1; // First usable intermediate map
+	/* Forget the codes */
+	if ((gif->gen += GIF_GEN) > INT_MAX - GIF_GEN)
+	{
+		memset(gif->keys, 0, GIF_HSIZE * sizeof(int));
+		gif->gen = GIF_GEN;
+	}
 }
 
 static void initclzw(gifcbuf *gif, int lc0, FILE *fp)
@@ -2665,6 +3441,8 @@ static void initclzw(gifcbuf *gif, int lc0, FILE *fp)
 	gif->prev = -1; // No previous code
 	gif->cnt = gif->w = gif->bits = 0; // No data yet
 	gif->lc = gif->lc0 + 1; // Actual code size
+	memset(gif->keys, 0, GIF_HSIZE * sizeof(int));
+	gif->gen = 0; // Empty slots are of no generation
 	resetclzw(gif); // Initial clear
 }
 
@@ -2694,7 +3472,8 @@ static void emitlzw(gifcbuf *gif, int c)
 static void putlzw(gifcbuf *gif, unsigned char *src, int cnt)
 {
 	short *codes = gif->codes;
-	int i, j, c, prev = gif->prev;
+	int *keys = gif->keys;
+	int i, k, c, key, gen = gif->gen, prev = gif->prev;
 
 	while (cnt-- > 0)
 	{
@@ -2705,12 +3484,13 @@ static void putlzw(gifcbuf *gif, unsigned char *src, int cnt)
 			continue;
 		}
 		/* Try compression */
-		i = prev * 16 + (c >> 4) + 4096 * 16;
-		j = codes[i] * 16 + (c & 0xF);
-		j = codes[j];
-		if (j) // Have match
+		key = gen + (prev << 8) + c;
+		i = ((unsigned)key * 2654435761U) >> (32 - GIF_HBITS);
+		while (((k = keys[i]) != key) && ((k & -GIF_GEN) == gen))
+			i = (i + 1) & (GIF_HSIZE - 1);
+		if (k == key) // Have match
 		{
-			prev = j - 4096;
+			prev = codes[i];
 			continue;
 		}
 		/* Emit the code */
@@ -2720,12 +3500,12 @@ static void putlzw(gifcbuf *gif, unsigned char *src, int cnt)
 		if (gif->nxc >= 4096 - 1)
 		{
 			resetclzw(gif);
+			gen = gif->gen;
 			continue;
 		}
 		/* Add new code */
-		if (!codes[i]) codes[i] = gif->nxmap++;
-		j = codes[i] * 16 + (c & 0xF);
-		codes[j] = gif->nxc++ + 4096;
+		keys[i] = key;
+		codes[i] = gif->nxc++;
 	}
 	gif->prev = prev;
 }
@@ -2753,12 +3533,13 @@ static int save_gif(char *file_name, ls_settings *settings)
 	/* GIF save must be on indexed image */
 	if (settings->bpp != 1) return WRONG_FORMAT;
 
-	gif.codes = malloc(GIF_CODESSIZE);
-	if (!gif.codes) return (-1);
+	gif.keys = malloc(GIF_CODESSIZE);
+	if (!gif.keys) return (-1);
+	gif.codes = (short *)(gif.keys + GIF_HSIZE);
 
 	if (!(fp = fopen(file_name, "wb")))
 	{
-		free(gif.codes);
+		free(gif.keys);
 		return (-1);
 	}
 
@@ -2819,7 +3600,7 @@ static int save_gif(char *file_name, ls_settings *settings)
 
 	if (!settings->silent) progress_end();
 
-	free(gif.codes);
+	free(gif.keys);
 	return 0;
 }
 
@@ -2937,6 +3718,12 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 #endif
 
 	jpeg_read_header(&cinfo, TRUE);
+	/* Let the library downscale in DCT domain, if less is needed */
+	if ((i = reduce_shift(settings, cinfo.image_width, cinfo.image_height, 3)))
+	{
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1 << i;
+	}
 	jpeg_start_decompress(&cinfo);
 
 	bpp = 3;
@@ -3149,16 +3936,23 @@ static int parse_opj(opj_image_t *image, ls_settings *settings)
 	}
 	else settings->bpp = 3;
 	if ((nc = settings->bpp) < image->numcomps) nc++ , cmask = CMASK_RGBA;
+#if U_JP2 < 2 /* 1.x: component size is before reduction */
+#define COMP_W(C) (((C)->w + (1 << (C)->factor) - 1) >> (C)->factor)
+#define COMP_H(C) (((C)->h + (1 << (C)->factor) - 1) >> (C)->factor)
+#else /* 2.x: after */
+#define COMP_W(C) ((C)->w)
+#define COMP_H(C) ((C)->h)
+#endif
 	comp = image->comps;
-	settings->width = w = (comp->w + (1 << comp->factor) - 1) >> comp->factor;
-	settings->height = h = (comp->h + (1 << comp->factor) - 1) >> comp->factor;
+	settings->width = w = COMP_W(comp);
+	settings->height = h = COMP_H(comp);
 	for (i = 1; i < nc; i++) /* Check if all components are the same size */
 	{
 		comp++;
-		if ((w != (comp->w + (1 << comp->factor) - 1) >> comp->factor) ||
-			(h != (comp->h + (1 << comp->factor) - 1) >> comp->factor))
-			return (-1);
+		if ((w != COMP_W(comp)) || (h != COMP_H(comp))) return (-1);
 	}
+#undef COMP_W
+#undef COMP_H
 	if ((res = allocate_image(settings, cmask))) return (res);
 
 	/* Unpack data */
@@ -3361,7 +4155,7 @@ static int load_jpeg2000(char *file_name, ls_settings *settings)
 	opj_codec_t *dinfo;
 	opj_stream_t *inp = NULL;
 	opj_image_t *image = NULL;
-	int i, pr, res = -1;
+	int i, n, pr, res = -1;
 #if !OPJ_VERSION_MINOR /* 2.0.x */
 	FILE *fp;
 #endif
@@ -3387,8 +4181,15 @@ static int load_jpeg2000(char *file_name, ls_settings *settings)
 	opj_codec_set_threads(dinfo, helper_threads());
 #endif
 	if ((pr = !settings->silent)) ls_init("JPEG2000", 0);
-	i = opj_read_header(inp, dinfo, &image) &&
-		opj_decode(dinfo, inp, image) &&
+	i = opj_read_header(inp, dinfo, &image);
+#if OPJ_VERSION_MINOR >= 1 /* 2.1+ */
+	/* Skip the finest resolution levels if less is needed, and as many of
+	 * them as the codestream has */
+	if (i) for (n = reduce_shift(settings, image->x1 - image->x0,
+		image->y1 - image->y0, 31); n > 0; n--)
+		if (opj_set_decoded_resolution_factor(dinfo, n)) break;
+#endif
+	i = i && opj_decode(dinfo, inp, image) &&
 		opj_end_decompress(dinfo, inp);
 	opj_destroy_codec(dinfo);
 	opj_stream_destroy(inp);
@@ -3812,51 +4613,217 @@ void init_tiff_formats()	// Check what libtiff can handle
 #endif
 }
 
-static int load_tiff_frame(TIFF *tif, ls_settings *settings)
-{
-	char cbuf[1024];
-	uint16 bpsamp, sampp, xsamp, pmetric, planar, orient, sform;
-	uint16 *sampinfo, *red16, *green16, *blue16;
-	uint32 width, height, tw = 0, th = 0, rps = 0;
-	uint32 *tr, *raster = NULL;
-	unsigned char *tmp, *buf = NULL;
-	int bpp = 3, cmask = CMASK_IMAGE, argb = FALSE, pr = FALSE;
-	int i, j, mirror, res;
-
-
-	/* Let's learn what we've got */
-	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &sampp);
-	TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES, &xsamp, &sampinfo);
-	if (!TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &pmetric))
-	{
-		/* Defaults like in libtiff */
-		if (sampp - xsamp == 1) pmetric = PHOTOMETRIC_MINISBLACK;
-		else if (sampp - xsamp == 3) pmetric = PHOTOMETRIC_RGB;
-		else return (-1);
+/* Image is read tile by tile - considering strip a wide tile; as pieces do not
+ * depend on each other, helper threads can decode them in parallel, each
+ * through its own handle */
+typedef struct {
+	ls_settings *settings;
+	TIFF *tif;		// Main handle
+	char *name;		// File to open per-thread handles from
+	toff_t dir;		// Offset of the image's directory
+	unsigned char *xtable;
+	uint32 width, height, tw, xstep, ystep;
+	int nx, nplanes;	// Pieces per row, planes per piece
+	int bpp, wbpp, bpsamp, planar, mirror;
+	int bpr, bits1, bit0, db, bsz, tsz;
+	int pr, n, nprog;	// Progress, in rows
+	int fail;
+} tiffpieces;
+
+/* Read one piece, with all its planes, and decode it into the image */
+static int tiff_piece(tiffpieces *tp, TIFF *tif, unsigned char *buf, int idx)
+{
+	ls_settings *settings = tp->settings;
+	unsigned char *src, *tmp, *tmpa, *tbuf = NULL;
+	uint32 x0, y0, x, y, w, h, l;
+	uint32 width = tp->width, height = tp->height;
+	int i, k, dx, dxa, dy, dys, plane;
+
+
+	if (tp->tsz) tbuf = buf + tp->bsz; // Temp buffer for CMYK->RGB
+	x0 = (idx % tp->nx) * tp->xstep;
+	y0 = (idx / tp->nx) * tp->ystep;
+
+	/* Prepare decoding loops */
+	if (tp->mirror & 1) /* X mirror */
+	{
+		x = width - x0;
+		w = x < tp->xstep ? x : tp->xstep;
+		x -= w;
 	}
-	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sform);
-	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bpsamp);
-	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
-	planar = planar != PLANARCONFIG_CONTIG;
-	TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orient);
-	switch (orient)
+	else
 	{
-	case ORIENTATION_TOPLEFT:
-	case ORIENTATION_LEFTTOP: mirror = 0; break;
-	case ORIENTATION_TOPRIGHT:
-	case ORIENTATION_RIGHTTOP: mirror = 1; break;
-	default:
-	case ORIENTATION_BOTLEFT:
-	case ORIENTATION_LEFTBOT: mirror = 2; break;
-	case ORIENTATION_BOTRIGHT:
-	case ORIENTATION_RIGHTBOT: mirror = 3; break;
+		x = x0;
+		w = x + tp->xstep > width ? width - x : tp->xstep;
 	}
-	if (TIFFIsTiled(tif))
+	if (tp->mirror & 2) /* Y mirror */
 	{
-		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
-		TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+		y = height - y0;
+		h = y < tp->ystep ? y : tp->ystep;
+		y -= h;
+	}
+	else
+	{
+		y = y0;
+		h = y + tp->ystep > height ? height - y : tp->ystep;
+	}
+
+	for (plane = 0; plane < tp->nplanes; plane++)
+	{
+		/* Read one plane of the piece */
+		if (tp->tw)
+		{
+			if (TIFFReadEncodedTile(tif,
+				TIFFComputeTile(tif, x0, y0, 0, plane),
+				buf, tp->bsz) < 0) return (FALSE);
+		}
+		else
+		{
+			if (TIFFReadEncodedStrip(tif,
+				TIFFComputeStrip(tif, y0, plane),
+				buf, tp->bsz) < 0) return (FALSE);
+		}
+
+		/* Prepare pointers */
+		dx = dxa = 1; dy = width;
+		i = y * width + x;
+		tmp = tmpa = settings->img[CHN_ALPHA] + i;
+		if (plane >= tp->wbpp); // Alpha
+		else if (tbuf) // CMYK
+		{
+			dx = 4; dy = w;
+			tmp = tbuf + plane;
+		}
+		else // RGB/indexed
+		{
+			dx = tp->bpp;
+			tmp = settings->img[CHN_IMAGE] + plane + i * tp->bpp;
+		}
+		dy *= dx; dys = tp->bpr;
+		src = buf;
+		/* Account for horizontal mirroring */
+		if (tp->mirror & 1)
+		{
+			// Write bytes backward
+			tmp += (w - 1) * dx; tmpa += w - 1;
+			dx = -dx; dxa = -1;
+		}
+		/* Account for vertical mirroring */
+		if (tp->mirror & 2)
+		{
+			// Read rows backward
+			src += (h - 1) * dys;
+			dys = -dys;
+		}
+
+		/* Decode it */
+		for (l = 0; l < h; l++ , src += dys , tmp += dy)
+		{
+			if (tp->pr && ((tp->n++ * 10) % tp->nprog >= tp->nprog - 10))
+				progress_update((float)tp->n / tp->nprog);
+
+			stream_MSB(src, tmp, w, tp->bits1, tp->bit0, tp->db, dx);
+			if (tp->planar) continue;
+			for (k = 1; k < tp->wbpp; k++)
+			{
+				stream_MSB(src, tmp + k, w, tp->bits1,
+					tp->bit0 + tp->bpsamp * k, tp->db, dx);
+			}
+			if (settings->img[CHN_ALPHA])
+			{
+				stream_MSB(src, tmpa, w, tp->bits1,
+					tp->bit0 + tp->bpsamp * tp->wbpp, tp->db, dxa);
+				tmpa += width;
+			}
+		}
+
+		/* Convert CMYK to RGB if needed */
+		if (!tbuf || (tp->planar && (plane != 3))) continue;
+		if (tp->bits1 < 8)	// Rescale to 8-bit
+			do_xlate(tp->xtable, tbuf, w * h * 4);
+		cmyk2rgb(tbuf, tbuf, w * h, FALSE, settings);
+		src = tbuf;
+		tmp = settings->img[CHN_IMAGE] + (y * width + x) * 3;
+		for (l = 0; l < h; l++ , tmp += width * 3 , src += w * 3)
+			memcpy(tmp, src, w * 3);
+	}
+	return (TRUE);
+}
+
+static void tiff_pieces(void *data, unsigned char *buf, int start, int cnt)
+{
+	tiffpieces *tp = data;
+	TIFF *tif = tp->name ? TIFFOpen(tp->name, "r") : tp->tif;
+	int res = tif && (!tp->name || TIFFSetSubDirectory(tif, tp->dir));
+
+	for (cnt += start; res && !tp->fail && (start < cnt); start++)
+		res = tiff_piece(tp, tif, buf, start);
+	if (!res) tp->fail = TRUE;
+	if (tif && tp->name) TIFFClose(tif);
+}
+
+/* Returns TRUE if decoded the pieces on helper threads, FALSE if could not;
+ * this needs a file to reopen, and an LCMS transform cannot be shared */
+static int tiff_threaded(tiffpieces *tp, int cnt)
+{
+	char *name = (char *)TIFFFileName(tp->tif);
+
+	if (thread_nested()) return (FALSE); // Frame already on a helper thread
+	if ((cnt < 2) || !name || !name[0] || (tp->settings->icc_size == -2) ||
+		(image_threads(tp->xstep * tp->ystep, cnt) < 2)) return (FALSE);
+	tp->name = name;
+	tp->dir = TIFFCurrentDirOffset(tp->tif);
+	if (mem_bands(tiff_pieces, tp, tp->xstep * tp->ystep, cnt,
+		tp->bsz + tp->tsz)) return (TRUE);
+	tp->name = NULL;
+	return (FALSE);
+}
+
+static int load_tiff_frame(TIFF *tif, ls_settings *settings)
+{
+	char cbuf[1024];
+	uint16 bpsamp, sampp, xsamp, pmetric, planar, orient, sform;
+	uint16 *sampinfo, *red16, *green16, *blue16;
+	uint32 width, height, tw = 0, th = 0, rps = 0;
+	uint32 *tr, *raster = NULL;
+	unsigned char *tmp, *buf = NULL;
+	int bpp = 3, cmask = CMASK_IMAGE, argb = FALSE, pr = FALSE;
+	int i, j, mirror, res;
+
+
+	/* Let's learn what we've got */
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &sampp);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES, &xsamp, &sampinfo);
+	if (!TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &pmetric))
+	{
+		/* Defaults like in libtiff */
+		if (sampp - xsamp == 1) pmetric = PHOTOMETRIC_MINISBLACK;
+		else if (sampp - xsamp == 3) pmetric = PHOTOMETRIC_RGB;
+		else return (-1);
+	}
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sform);
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bpsamp);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+	planar = planar != PLANARCONFIG_CONTIG;
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orient);
+	switch (orient)
+	{
+	case ORIENTATION_TOPLEFT:
+	case ORIENTATION_LEFTTOP: mirror = 0; break;
+	case ORIENTATION_TOPRIGHT:
+	case ORIENTATION_RIGHTTOP: mirror = 1; break;
+	default:
+	case ORIENTATION_BOTLEFT:
+	case ORIENTATION_LEFTBOT: mirror = 2; break;
+	case ORIENTATION_BOTRIGHT:
+	case ORIENTATION_RIGHTBOT: mirror = 3; break;
+	}
+	if (TIFFIsTiled(tif))
+	{
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
 	}
 	else
 	{
@@ -4014,32 +4981,38 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	/* Read & interpret it ourselves */
 	else
 	{
-		unsigned char xtable[256], *src, *tbuf = NULL;
-		uint32 x0, y0, xstep = tw ? tw : width, ystep = th ? th : rps;
-		int aalpha, tsz = 0, wbpp = bpp;
-		int bpr, bits1, bit0, db, n, nx;
-		int j, k, bsz, plane, nplanes;
-
+		tiffpieces tp;
+		unsigned char xtable[256], *src;
+		int aalpha, j, k, bits1, cnt;
+
+
+		memset(&tp, 0, sizeof(tp));
+		tp.settings = settings;
+		tp.tif = tif;
+		tp.xtable = xtable;
+		tp.width = width;
+		tp.height = height;
+		tp.tw = tw;
+		tp.xstep = tw ? tw : width;
+		tp.ystep = th ? th : !rps || (rps > height) ? height : rps;
+		tp.bpp = tp.wbpp = bpp;
+		tp.bpsamp = bpsamp;
+		tp.planar = planar;
+		tp.mirror = mirror;
 
 		if (pmetric == PHOTOMETRIC_SEPARATED) // Needs temp buffer
-			tsz = xstep * ystep * (wbpp = 4);
-		nplanes = planar ? wbpp + !!settings->img[CHN_ALPHA] : 1;
-
-		bsz = (tw ? TIFFTileSize(tif) : TIFFStripSize(tif)) + 1;
-		bpr = tw ? TIFFTileRowSize(tif) : TIFFScanlineSize(tif);
+			tp.tsz = tp.xstep * tp.ystep * (tp.wbpp = 4);
+		tp.nplanes = planar ? tp.wbpp + !!settings->img[CHN_ALPHA] : 1;
 
-		buf = _TIFFmalloc(bsz + tsz);
-		res = FILE_MEM_ERROR;
-		if (!buf) goto fail2;
-		res = FILE_LIB_ERROR;
-		if (tsz) tbuf = buf + bsz; // Temp buffer for CMYK->RGB
+		tp.bsz = (tw ? TIFFTileSize(tif) : TIFFStripSize(tif)) + 1;
+		tp.bpr = tw ? TIFFTileRowSize(tif) : TIFFScanlineSize(tif);
 
 		/* Flag associated alpha */
 		aalpha = settings->img[CHN_ALPHA] &&
 			(pmetric != PHOTOMETRIC_PALETTE) &&
 			(sampinfo[0] == EXTRASAMPLE_ASSOCALPHA);
 
-		bits1 = bpsamp > 8 ? 8 : bpsamp;
+		tp.bits1 = bits1 = bpsamp > 8 ? 8 : bpsamp;
 
 		/* Setup greyscale palette */
 		if ((bpp == 1) && (pmetric != PHOTOMETRIC_PALETTE))
@@ -4059,128 +5032,31 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		 * versions handle them differently, so I leave them alone
 		 * for now - WJ */
 
-		bit0 = (G_BYTE_ORDER == G_LITTLE_ENDIAN) &&
+		tp.bit0 = (G_BYTE_ORDER == G_LITTLE_ENDIAN) &&
 			((bpsamp == 16) || (bpsamp == 32) ||
 			(bpsamp == 64)) ? bpsamp - 8 : 0;
-		db = (planar ? 1 : sampp) * bpsamp;
+		tp.db = (planar ? 1 : sampp) * bpsamp;
 
 		/* Prepare to rescale what we've got */
 		memset(xtable, 0, 256);
 		set_xlate(xtable, bits1);
 
-		/* Progress steps */
-		nx = ((width + xstep - 1) / xstep) * nplanes * height;
+		/* Pieces, and progress steps */
+		tp.nx = (width - 1) / tp.xstep + 1;
+		cnt = ((height - 1) / tp.ystep + 1) * tp.nx;
+		tp.nprog = tp.nx * tp.nplanes * height;
 
-		/* Read image tile by tile - considering strip a wide tile */
-		for (n = y0 = 0; y0 < height; y0 += ystep)
-		for (x0 = 0; x0 < width; x0 += xstep)
-		for (plane = 0; plane < nplanes; plane++)
+		/* Decode on helper threads if possible, or else here */
+		if (!tiff_threaded(&tp, cnt))
 		{
-			unsigned char *tmp, *tmpa;
-			uint32 x, y, w, h, l;
-			int i, k, dx, dxa, dy, dys;
-
-			/* Read one piece */
-			if (tw)
-			{
-				if (TIFFReadTile(tif, buf, x0, y0, 0, plane) < 0)
-					goto fail2;
-			}
-			else
-			{
-				if (TIFFReadEncodedStrip(tif,
-					TIFFComputeStrip(tif, y0, plane),
-					buf, bsz) < 0) goto fail2;
-			}
-
-			/* Prepare decoding loops */
-			if (mirror & 1) /* X mirror */
-			{
-				x = width - x0;
-				w = x < xstep ? x : xstep;
-				x -= w;
-			}
-			else
-			{
-				x = x0;
-				w = x + xstep > width ? width - x : xstep;
-			}
-			if (mirror & 2) /* Y mirror */
-			{
-				y = height - y0;
-				h = y < ystep ? y : ystep;
-				y -= h;
-			}
-			else
-			{
-				y = y0;
-				h = y + ystep > height ? height - y : ystep;
-			}
-
-			/* Prepare pointers */
-			dx = dxa = 1; dy = width;
-			i = y * width + x;
-			tmp = tmpa = settings->img[CHN_ALPHA] + i;
-			if (plane >= wbpp); // Alpha
-			else if (tbuf) // CMYK
-			{
-				dx = 4; dy = w;
-				tmp = tbuf + plane;
-			}
-			else // RGB/indexed
-			{
-				dx = bpp;
-				tmp = settings->img[CHN_IMAGE] + plane + i * bpp;
-			}
-			dy *= dx; dys = bpr;
-			src = buf;
-			/* Account for horizontal mirroring */
-			if (mirror & 1)
-			{
-				// Write bytes backward
-				tmp += (w - 1) * dx; tmpa += w - 1;
-				dx = -dx; dxa = -1;
-			}
-			/* Account for vertical mirroring */
-			if (mirror & 2)
-			{
-				// Read rows backward
-				src += (h - 1) * dys;
-				dys = -dys;
-			}
-
-			/* Decode it */
-			for (l = 0; l < h; l++ , n++ , src += dys , tmp += dy)
-			{
-				if (pr && ((n * 10) % nx >= nx - 10))
-					progress_update((float)n / nx);
-
-				stream_MSB(src, tmp, w, bits1, bit0, db, dx);
-				if (planar) continue;
-				for (k = 1; k < wbpp; k++)
-				{
-					stream_MSB(src, tmp + k, w, bits1,
-						bit0 + bpsamp * k, db, dx);
-				}
-				if (settings->img[CHN_ALPHA])
-				{
-					stream_MSB(src, tmpa, w, bits1,
-						bit0 + bpsamp * wbpp, db, dxa);
-					tmpa += width;
-				}
-			}
-
-			/* Convert CMYK to RGB if needed */
-			if (!tbuf || (planar && (plane != 3))) continue;
-			if (bits1 < 8)	// Rescale to 8-bit
-				do_xlate(xtable, tbuf, w * h * 4);
-			cmyk2rgb(tbuf, tbuf, w * h, FALSE, settings);
-			src = tbuf;
-			tmp = settings->img[CHN_IMAGE] + (y * width + x) * 3;
-			w *= 3;
-			for (l = 0; l < h; l++ , tmp += width * 3 , src += w)
-				memcpy(tmp, src, w);
+			buf = _TIFFmalloc(tp.bsz + tp.tsz);
+			res = FILE_MEM_ERROR;
+			if (!buf) goto fail2;
+			tp.pr = pr;
+			tiff_pieces(&tp, buf, 0, cnt);
 		}
+		res = FILE_LIB_ERROR;
+		if (tp.fail) goto fail2;
 		done_cmyk2rgb(settings);
 
 		j = width * height;
@@ -4190,7 +5066,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		/* Unassociate alpha */
 		if (aalpha)
 		{
-			if (wbpp > 3) // Converted from CMYK
+			if (tp.wbpp > 3) // Converted from CMYK
 			{
 				unsigned char *img = tmp;
 				int i, k, a;
@@ -4219,7 +5095,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 			/* Rescale alpha */
 			if (src) do_xlate(xtable, src, j);
 			/* Rescale RGB */
-			if (tmp && (wbpp == 3)) do_xlate(xtable, tmp, j * 3);
+			if (tmp && (tp.wbpp == 3)) do_xlate(xtable, tmp, j * 3);
 		}
 		res = 1;
 	}
@@ -4230,11 +5106,26 @@ fail2:	if (pr) progress_end();
 	return (res);
 }
 
+/* Each frame gets its own TIFF handle, to decode it on whichever thread;
+ * the directory is found by offset, as going by index walks the chain */
+static int decode_tiff_frame(framejob *job, void *data)
+{
+	TIFF *tif;
+	int res = -1;
+
+	if (!(tif = TIFFOpen(data, "r"))) return (-1);
+	if (TIFFSetSubDirectory(tif, job->ofs))
+		res = load_tiff_frame(tif, &job->set);
+	TIFFClose(tif);
+	return (res);
+}
+
 static int load_tiff_frames(char *file_name, ani_settings *ani)
 {
 	TIFF *tif;
-	ls_settings w_set;
-	int res;
+	framebatch fb;
+	framejob *jobs;
+	int i, n, idx = 0, more = TRUE, res = FILE_MEM_ERROR;
 
 
 	/* We don't want any echoing to the output */
@@ -4242,23 +5133,42 @@ static int load_tiff_frames(char *file_name, ani_settings *ani)
 	TIFFSetWarningHandler(NULL);
 
 	if (!(tif = TIFFOpen(file_name, "r"))) return (-1);
+	fb.decode = decode_tiff_frame;
+	fb.data = file_name;
+	fb.jobs = jobs = calloc(FRAME_BATCH, sizeof(framejob));
+	if (!jobs) goto fail;
 
-	while (TRUE)
+	while (more)
 	{
-		res = FILE_TOO_LONG;
-		if (!check_next_frame(&ani->fset, ani->settings.mode, FALSE))
-			goto fail;
-		w_set = ani->settings;
-		w_set.gif_delay = -1; // Multipage
-		res = load_tiff_frame(tif, &w_set);
-		if (res != 1) goto fail;
-		res = process_page_frame(file_name, ani, &w_set);
-		if (res) goto fail;
-		/* Try to get next frame */
-		if (!TIFFReadDirectory(tif)) break;
+		/* Find where the next batch of pages is */
+		for (n = 0; more && (n < FRAME_BATCH); n++)
+		{
+			init_frame_job(jobs + n, &ani->settings);
+			jobs[n].set.gif_delay = -1; // Multipage
+			jobs[n].idx = idx++;
+			jobs[n].ofs = TIFFCurrentDirOffset(tif);
+			more = TIFFReadDirectory(tif);
+		}
+		decode_frames(&fb, n);
+
+		/* Store the pages in order */
+		for (i = 0; i < n; i++)
+		{
+			res = FILE_TOO_LONG;
+			if (!check_next_frame(&ani->fset, ani->settings.mode, FALSE))
+				goto fail;
+			res = jobs[i].res;
+			if (res != 1) goto fail;
+			res = process_page_frame(file_name, ani, &jobs[i].set);
+			if (res) goto fail;
+			memset(jobs[i].set.img, 0, sizeof(chanlist));
+		}
+		clear_frames(jobs, n);
 	}
 	res = 1;
-fail:	TIFFClose(tif);
+fail:	if (jobs) clear_frames(jobs, FRAME_BATCH);
+	free(jobs);
+	TIFFClose(tif);
 	return (res);
 }
 
@@ -4327,8 +5237,9 @@ static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 	unsigned char buf[MAX_WIDTH / 8], *src, *row = NULL;
 	uint16 rgb[256 * 3];
 	unsigned int tflags, sflags, xflags;
-	int i, l, type, bw, af, pf, res = 0, pmetric = -1;
+	int i, l, type, bw, af, pf, done = FALSE, res = 0, pmetric = -1;
 	int w = settings->width, h = settings->height, bpp = settings->bpp;
+	zbands zb;
 	TIFF *tif;
 
 
@@ -4441,7 +5352,30 @@ static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 
 	/* Actually write the image */
 	if (!settings->silent) ls_init("TIFF", 1);
-	for (i = 0; i < h; i++)
+	if (xflags & XF_COMPZT) /* Deflate strips in parallel if worth it */
+	{
+		zb.settings = settings;
+		zb.bpp = bw ? 0 : bpp + af;
+		zb.prep = !!row;
+		zb.filter = pf ? ZF_SUB : ZF_NONE;
+		zb.join = FALSE;
+		zb.level = settings->png_compression;
+		zb.strategy = Z_DEFAULT_STRATEGY;
+		if (deflate_bands(&zb))
+		{
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, zb.rows);
+			for (i = 0; i < zb.nbands; i++)
+			{
+				if (TIFFWriteRawStrip(tif, i, zb.data[i],
+					zb.len[i]) != -1) continue;
+				res = -1;
+				break;
+			}
+			deflate_bands_free(&zb);
+			done = TRUE;
+		}
+	}
+	if (!done) for (i = 0; i < h; i++)
 	{
 		src = settings->img[CHN_IMAGE] + w * i * settings->bpp;
 		if (bw) /* Pack the bits */
@@ -4553,18 +5487,17 @@ typedef struct {
 	unsigned char anmf[ANMF_HSIZE + RIFF_TAGSIZE];
 } webphead;
 
-static int load_webp_frame(webphead *wp, ls_settings *settings)
+/* Decode frame data, with frame header if any */
+static int decode_webp(unsigned char *buf, unsigned size, unsigned char *anmf,
+	ls_settings *settings)
 {
 	WebPDecoderConfig dconf;
-	unsigned char *buf;
-	int wh, bpp, wbpp = 3, cmask = CMASK_IMAGE, res = -1;
+	int wh, bpp, wbpp = 3, cmask = CMASK_IMAGE, res;
 	
 
 	if (!WebPInitDecoderConfig(&dconf)) return (-1); // Wrong lib version
-	if (!(buf = malloc(wp->size))) return (FILE_MEM_ERROR);
-	if (fread(buf, 1, wp->size, wp->f) != wp->size) goto fail;
-	if (WebPGetFeatures((void *)buf, wp->size, &dconf.input) != VP8_STATUS_OK)
-		goto fail;
+	if (WebPGetFeatures((void *)buf, size, &dconf.input) != VP8_STATUS_OK)
+		return (-1);
 
 	if (dconf.input.has_alpha) wbpp = 4 , cmask = CMASK_RGBA;
 	wh = dconf.input.width * dconf.input.height;
@@ -4573,15 +5506,29 @@ static int load_webp_frame(webphead *wp, ls_settings *settings)
 	settings->bpp = wbpp;
 
 	/* Get the extras from frame header */
-	if (wp->blocks & HAVE_ANMF)
+	if (anmf)
 	{
-		settings->x = GET24(wp->anmf + ANMF_X2) * 2;
-		settings->y = GET24(wp->anmf + ANMF_Y2) * 2;
+		settings->x = GET24(anmf + ANMF_X2) * 2;
+		settings->y = GET24(anmf + ANMF_Y2) * 2;
 		/* Within mtPaint delays are 1/100s granular */
-		settings->gif_delay = (GET24(wp->anmf + ANMF_DELAY) + 9) / 10; // Round up
+		settings->gif_delay = (GET24(anmf + ANMF_DELAY) + 9) / 10; // Round up
 	}
+	/* Still image can be scaled down to the requested size while decoding,
+	 * keeping the aspect ratio */
+	else if (want_reduced(settings, settings->width, settings->height))
+	{
+		size_t w = settings->width, h = settings->height;
+		size_t rw = settings->req_w, rh = settings->req_h;
 
-	if ((res = allocate_image(settings, cmask))) goto fail;
+		if (rw * h >= rh * w) h = (h * rw + w - 1) / w , w = rw;
+		else w = (w * rh + h - 1) / h , h = rh;
+		dconf.options.use_scaling = TRUE;
+		dconf.options.scaled_width = settings->width = w;
+		dconf.options.scaled_height = settings->height = h;
+		wh = w * h;
+	}
+
+	if ((res = allocate_image(settings, cmask))) return (res);
 
 	bpp = settings->img[CHN_ALPHA] ? 4 : 3;
 	dconf.output.colorspace = bpp > 3 ? MODE_RGBA : MODE_RGB;
@@ -4592,7 +5539,7 @@ static int load_webp_frame(webphead *wp, ls_settings *settings)
 
 	if (!settings->silent) ls_init("WebP", 0);
 	res = FILE_LIB_ERROR;
-	if (WebPDecode(buf, wp->size, &dconf) == VP8_STATUS_OK)
+	if (WebPDecode(buf, size, &dconf) == VP8_STATUS_OK)
 	{
 		if (bpp == 4) /* Separate out alpha from RGBA */
 		{
@@ -4610,8 +5557,19 @@ static int load_webp_frame(webphead *wp, ls_settings *settings)
 	}
 	if (!settings->silent) progress_end();
 	WebPFreeDecBuffer(&dconf.output);
+	return (res);
+}
 
-fail:	free(buf);
+static int load_webp_frame(webphead *wp, ls_settings *settings)
+{
+	unsigned char *buf;
+	int res = -1;
+
+	if (!(buf = malloc(wp->size))) return (FILE_MEM_ERROR);
+	if (fread(buf, 1, wp->size, wp->f) == wp->size)
+		res = decode_webp(buf, wp->size, wp->blocks & HAVE_ANMF ?
+			wp->anmf : NULL, settings);
+	free(buf);
 	return (res);
 }
 
@@ -4755,17 +5713,63 @@ static int webp_behead(FILE *fp, webphead *wp, ls_settings *settings)
 	return (wp->blocks & HAVE_IMG);
 }
 
+/* Read in the next frame's data, for decoding it later */
+static int queue_webp_frame(webphead *wp, framejob *job)
+{
+	if (!(job->buf = malloc(wp->size))) return (FILE_MEM_ERROR);
+	if (fread(job->buf, 1, job->len = wp->size, wp->f) != wp->size)
+		return (-1);
+	memcpy(job->hdr, wp->anmf, sizeof(wp->anmf));
+	job->disp = wp->anmf[ANMF_FLAGS] & ANMF_F_BKG ? FM_DISP_REMOVE :
+		FM_DISP_LEAVE;
+	return (0);
+}
+
+static int decode_webp_frame(framejob *job, void *data)
+{
+	int res = decode_webp(job->buf, job->len, job->hdr, &job->set);
+	free(job->buf);
+	job->buf = NULL;
+	return (res);
+}
+
+/* Read in and decode a batch of frames; return how many are in it */
+static int webp_batch(webphead *wp, framebatch *fb, ls_settings *settings,
+	int *qres, int *last)
+{
+	int n;
+
+	clear_frames(fb->jobs, FRAME_BATCH);
+	for (n = 0; n < FRAME_BATCH; )
+	{
+		init_frame_job(fb->jobs + n, settings);
+		if ((*qres = queue_webp_frame(wp, fb->jobs + n))) break;
+		n++;
+		/* Step to the next frame, if any */
+		if ((*last = !webp_scan(wp, NULL))) break;
+	}
+	decode_frames(fb, n);
+	return (n);
+}
+
 static int load_webp_frames(char *file_name, ani_settings *ani)
 {
 	webphead wp;
 	ani_status stat;
-	ls_settings w_set, init_set;
+	framebatch fb;
+	framejob *jobs;
+	ls_settings *w_set, init_set;
 	FILE *fp;
-	int bpp, disposal, res = -1;
+	int i = 0, cnt = 0, last = FALSE, qres = 0, bpp, res = -1;
 
 
 	if (!(fp = fopen(file_name, "rb"))) return (-1);
-	memset(w_set.img, 0, sizeof(chanlist));
+	fb.decode = decode_webp_frame;
+	fb.data = NULL;
+	fb.jobs = jobs = calloc(FRAME_BATCH, sizeof(framejob));
+	res = FILE_MEM_ERROR;
+	if (!jobs) goto fail;
+	res = -1;
 
 	/* Init temp container */
 	init_set = ani->settings;
@@ -4794,38 +5798,46 @@ static int load_webp_frames(char *file_name, ani_settings *ani)
 		res = FILE_TOO_LONG;
 		if (!check_next_frame(&ani->fset, ani->settings.mode, TRUE))
 			goto fail;
-		w_set = init_set;
-		res = load_webp_frame(&wp, &w_set);
+
+		/* Get the next batch when this one is used up */
+		if (i >= cnt)
+		{
+			i = cnt = 0;
+			if (!qres) cnt = webp_batch(&wp, &fb, &init_set, &qres, &last);
+			res = qres;
+			if (!cnt) goto fail;
+		}
+		w_set = &jobs[i].set;
+		res = jobs[i].res;
 		if (res != 1) goto fail;
-		disposal = wp.anmf[ANMF_FLAGS] & ANMF_F_BKG ? FM_DISP_REMOVE :
-			FM_DISP_LEAVE;
-		delete_alpha(&w_set, 255);
-		stat.blend = !(wp.anmf[ANMF_FLAGS] & ANMF_F_NOBLEND) && w_set.img[CHN_ALPHA];
+		delete_alpha(w_set, 255);
+		stat.blend = !(jobs[i].hdr[ANMF_FLAGS] & ANMF_F_NOBLEND) &&
+			w_set->img[CHN_ALPHA];
 		/* Analyze how we can merge the frames */
 		res = TOO_BIG;
-		bpp = analyze_rgba_frame(&stat, &w_set);
+		bpp = analyze_rgba_frame(&stat, w_set);
 		if (bpp < 0) goto fail;
 
 		/* Allocate a new frame */
-		res = add_frame(ani, &stat, &w_set, bpp, disposal);
+		res = add_frame(ani, &stat, w_set, bpp, jobs[i].disp);
 		if (res) goto fail;
 
 		/* Do actual compositing, remember disposal method */
-		composite_frame(&ani->fset, &stat, &w_set);
-		mem_free_chanlist(w_set.img);
-		memset(w_set.img, 0, sizeof(chanlist));
+		composite_frame(&ani->fset, &stat, w_set);
+		mem_free_chanlist(w_set->img);
+		memset(w_set->img, 0, sizeof(chanlist));
 
 		/* Write out those frames worthy to be stored */
 		res = done_frame(file_name, ani, FALSE);
 		if (res != 1) goto fail;
 
-		/* Step to the next frame, if any */
-		if (!webp_scan(&wp, NULL)) break;
+		if ((++i >= cnt) && last) break; // No more frames
 	}
 	/* Write out the final frame if not written before */
 	res = done_frame(file_name, ani, TRUE);
 
-fail:	mem_free_chanlist(w_set.img);
+fail:	if (jobs) clear_frames(jobs, FRAME_BATCH);
+	free(jobs);
 	fclose(fp);
 	return (res);
 }
@@ -4994,10 +6006,10 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	int bl, rl, step, skip, dx, dy;
 
 
-	if (!mf)
+	if (!mf && !mfmap(mf = &fake_mf, file_name))
 	{
 		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
+		memset(mf, 0, sizeof(fake_mf));
 		fake_mf.file = fp;
 	}
 
@@ -5214,21 +6226,26 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	{
 		for (n = 0; (i < h) && (i >= 0); n++ , i += step)
 		{
-			j = mfread(buf, 1, rl, mf);
-			if (j < rl) goto fail3;
+			/* Parse mapped file in place, leaving a byte to spare for
+			 * bitparser's extra step */
+			if (!(tmp = mfpeek(mf, rl, 1)))
+			{
+				j = mfread(tmp = buf, 1, rl, mf);
+				if (j < rl) goto fail3;
+			}
 			dest = settings->img[CHN_IMAGE] + w * i * wbpp;
 			if (bpp < 16) /* Indexed */
-				stream_MSB(buf, dest, w, bpp, 0, bpp, 1);
+				stream_MSB(tmp, dest, w, bpp, 0, bpp, 1);
 			else /* RGB */
 			{
-				stream_LSB(buf, dest + 0, w, bpps[0],
+				stream_LSB(tmp, dest + 0, w, bpps[0],
 					shifts[0], bpp, 3);
-				stream_LSB(buf, dest + 1, w, bpps[1],
+				stream_LSB(tmp, dest + 1, w, bpps[1],
 					shifts[1], bpp, 3);
-				stream_LSB(buf, dest + 2, w, bpps[2],
+				stream_LSB(tmp, dest + 2, w, bpps[2],
 					shifts[2], bpp, 3);
 				if (settings->img[CHN_ALPHA])
-					stream_LSB(buf, settings->img[CHN_ALPHA] +
+					stream_LSB(tmp, settings->img[CHN_ALPHA] +
 						w * i, w, bpps[3], shifts[3], bpp, 1);
 			}
 			ls_progress(settings, n, 10);
@@ -5373,6 +6390,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 fail3:	if (!settings->silent) progress_end();
 fail2:	free(buf);
 fail:	if (fp) fclose(fp);
+	if (mf == &fake_mf) mfunmap(mf);
 	return (res);
 }
 
@@ -8537,138 +9555,154 @@ static int pnm_endhdr(pnmbuf *pnm, int plain)
 	return (TRUE);
 }
 
-static int load_pnm_frame(FILE *fp, ls_settings *settings)
+/* Read PNM header, return row reading mode or -1 if failed */
+static int pnm_header(pnmbuf *pnm, ls_settings *settings, int *maxv)
 {
-	pnmbuf pnm;
 	char *s, *tail;
-	unsigned char *dest;
-	int i, l, m, w, h, bpp, maxval, plain, mode, fid, res;
+	int w, h, bpp, maxval, plain, fid;
 
 
 	/* Identify*/
-	memset(&pnm, 0, sizeof(pnm));
-	pnm.f = fp;
 	fid = settings->ftype == FT_PBM ? 0 : settings->ftype == FT_PGM ? 1 : 2;
-	if (!(s = pnm_gets(&pnm, FALSE))) return (-1);
+	if (!(s = pnm_gets(pnm, FALSE))) return (-1);
 	if ((s[0] != 'P') || ((s[1] != fid + '1') && (s[1] != fid + '4')))
 		 return (-1);
 	plain = s[1] < '4';
 
 	/* Read header */
-	if (!(s = pnm_gets(&pnm, FALSE))) return (-1);
+	if (!(s = pnm_gets(pnm, FALSE))) return (-1);
 	w = strtol(s, &tail, 10);
 	if (*tail) return (-1);
-	if (!(s = pnm_gets(&pnm, FALSE))) return (-1);
+	if (!(s = pnm_gets(pnm, FALSE))) return (-1);
 	h = strtol(s, &tail, 10);
 	if (*tail) return (-1);
 	bpp = maxval = 1;
 	if (settings->ftype == FT_PBM) set_bw(settings);
 	else
 	{
-		if (!(s = pnm_gets(&pnm, FALSE))) return (-1);
+		if (!(s = pnm_gets(pnm, FALSE))) return (-1);
 		maxval = strtol(s, &tail, 10);
 		if (*tail) return (-1);
 		if ((maxval <= 0) || (maxval > 65535)) return (-1);
 		if (settings->ftype == FT_PGM) set_gray(settings);
 		else bpp = 3;
 	}
-	if (!pnm_endhdr(&pnm, plain)) return (-1);
+	if (!pnm_endhdr(pnm, plain)) return (-1);
 
 	/* Store values */
 	settings->width = w;
 	settings->height = h;
 	settings->bpp = bpp;
+	*maxv = maxval;
 
-	/* Allocate image */
-	if ((res = allocate_image(settings, CMASK_IMAGE))) return (res);
+	return (settings->ftype == FT_PBM ? plain /* 0 and 1 */ :
+		plain ? 2 : maxval < 255 ? 3 : maxval > 255 ? 4 : 5);
+}
 
-	/* Now, read the image */
-	mode = settings->ftype == FT_PBM ? plain /* 0 and 1 */ :
-		plain ? 2 : maxval < 255 ? 3 : maxval > 255 ? 4 : 5;
-	s = "";
-	if (!settings->silent) ls_init("PNM", 0);
-	res = FILE_LIB_ERROR;
-	l = w * bpp;
-	m = maxval * 2;
-	for (i = 0; i < h; i++)
+/* Read one row of PNM pixels, return FALSE if failed */
+static int pnm_row(pnmbuf *pnm, unsigned char *dest, int w, int l, int mode,
+	int maxval, char **str)
+{
+	FILE *fp = pnm->f;
+	char *s = *str, *tail;
+	int i, j, k, n, ll, res = FALSE;
+
+	switch (mode)
+	{
+	case 0: /* Raw packed bits */
 	{
-		dest = settings->img[CHN_IMAGE] + l * i;
-		switch (mode)
-		{
-		case 0: /* Raw packed bits */
-		{
 #if PNM_BUFSIZE * 8 < MAX_WIDTH
 #error "Buffer too small to read PBM row all at once"
 #endif
-			int i, j, k;
-			unsigned char *tp = pnm.buf;
+		unsigned char *tp = pnm->buf;
 
-			k = (w + 7) >> 3;
-			j = fread(tp, 1, k, fp);
-			for (i = 0; i < w; i++)
-				*dest++ = (tp[i >> 3] >> (~i & 7)) & 1;
-			if (j < k) goto fail2;
-			break;
+		k = (w + 7) >> 3;
+		j = fread(tp, 1, k, fp);
+		for (i = 0; i < w; i++)
+			*dest++ = (tp[i >> 3] >> (~i & 7)) & 1;
+		if (j < k) goto fail;
+		break;
+	}
+	case 3: /* Raw byte values - extend later */
+	case 5: /* Raw 0..255 values - trivial */
+		if (fread(dest, 1, l, fp) < l) goto fail;
+		break;
+	case 1: /* Chars "0" and "1" */
+	{
+		unsigned char ch;
+
+		for (i = 0; i < l; i++)
+		{
+			if (!s[0] && !(s = pnm_gets(pnm, TRUE))) goto fail;
+			ch = *s++ - '0';
+			if (ch > 1) goto fail;
+			*dest++ = ch;
 		}
-		case 3: /* Raw byte values - extend later */
-		case 5: /* Raw 0..255 values - trivial */
-			if (fread(dest, 1, l, fp) < l) goto fail2;
-			break;
-		case 1: /* Chars "0" and "1" */
+		break;
+	}
+	case 2: /* Integers in ASCII */
+		for (i = 0; i < l; i++)
 		{
-			int i;
-			unsigned char ch;
-
-			for (i = 0; i < l; i++)
-			{
-				if (!s[0] && !(s = pnm_gets(&pnm, TRUE)))
-					goto fail2;
-				ch = *s++ - '0';
-				if (ch > 1) goto fail2;
-				*dest++ = ch;
-			}
-			break;
+			if (!(s = pnm_gets(pnm, TRUE))) goto fail;
+			n = strtol(s, &tail, 10);
+			if (*tail) goto fail;
+			if ((n < 0) || (n > maxval)) goto fail;
+			n = (n * (255 * 2) + maxval) / (maxval * 2);
+			*dest++ = n;
 		}
-		case 2: /* Integers in ASCII */
+		break;
+	case 4: /* Raw ushorts in MSB order */
+		for (ll = l * 2; ll > 0; ll -= k)
 		{
-			int i, n;
-
-			for (i = 0; i < l; i++)
-			{
-				if (!(s = pnm_gets(&pnm, TRUE))) goto fail2;
-				n = strtol(s, &tail, 10);
-				if (*tail) goto fail2;
-				if ((n < 0) || (n > maxval)) goto fail2;
-				n = (n * (255 * 2) + maxval) / m;
-				*dest++ = n;
-			}
-			break;
+			k = PNM_BUFSIZE < ll ? PNM_BUFSIZE : ll;
+			j = fread(pnm->buf, 1, k, fp);
+			i = j >> 1;
+			convert_16b(dest, pnm->buf, i, 1, 1, maxval);
+			dest += i;
+			if (j < k) goto fail;
 		}
-		case 4: /* Raw ushorts in MSB order */
-		{
-			int i, j, k, ll;
+		break;
+	}
+	res = TRUE;
+fail:	*str = s;
+	return (res);
+}
 
-			for (ll = l * 2; ll > 0; ll -= k)
-			{
-				k = PNM_BUFSIZE < ll ? PNM_BUFSIZE : ll;
-				j = fread(pnm.buf, 1, k, fp);
-				i = j >> 1;
-				convert_16b(dest, pnm.buf, i, 1, 1, maxval);
-				dest += i;
-				if (j < k) goto fail2;
-			}
-			break;
-		}
-		}
+static int load_pnm_frame(FILE *fp, ls_settings *settings)
+{
+	pnmbuf pnm;
+	char *s;
+	int i, l, maxval, mode, fid, res;
+
+
+	memset(&pnm, 0, sizeof(pnm));
+	pnm.f = fp;
+	if ((mode = pnm_header(&pnm, settings, &maxval)) < 0) return (-1);
+
+	/* Allocate image */
+	if ((res = allocate_image(settings, CMASK_IMAGE))) return (res);
+
+	/* Now, read the image */
+	s = "";
+	if (!settings->silent) ls_init("PNM", 0);
+	res = FILE_LIB_ERROR;
+	l = settings->width * settings->bpp;
+	for (i = 0; i < settings->height; i++)
+	{
+		if (!pnm_row(&pnm, settings->img[CHN_IMAGE] + l * i,
+			settings->width, l, mode, maxval, &s)) goto fail2;
 		ls_progress(settings, i, 10);
 	}
 	res = 1;
 
 	/* Check for next frame */
-	if (!plain) res = check_next_pnm(fp, fid + '4');
+	fid = settings->ftype == FT_PBM ? '4' :
+		settings->ftype == FT_PGM ? '5' : '6';
+	if ((mode != 1) && (mode != 2)) res = check_next_pnm(fp, fid);
 
 fail2:	if (mode == 3) // Extend what we've read
-		extend_bytes(settings->img[CHN_IMAGE], l * h, maxval);
+		extend_bytes(settings->img[CHN_IMAGE], l * settings->height,
+			maxval);
 	if (!settings->silent) progress_end();
 
 	return (res);
@@ -8939,7 +9973,7 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 	/* !!! INDEXED is at index 1, RGB at index 3 to use index as BPP */
 	static const char *blocks[] = { "TAGS", "INDEXED", "PALETTE", "RGB", NULL };
 	tagline tl;
-	unsigned char *dest, *buf = NULL;
+	unsigned char *dest, *src, *buf = NULL;
 	char *ttype = NULL;
 	int w, h, depth, rgbpp, cmask = CMASK_IMAGE;
 	int i, j, l, res, whdm[4], slots[NUM_CHANNELS];
@@ -9041,15 +10075,20 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 		for (i = 0; i < h; i++)
 		{
 			dest = settings->img[CHN_IMAGE] + w * rgbpp * i;
-			if (!mfread(buf ? buf : dest, l, 1, mf)) goto fail;
+			/* Split mapped file in place */
+			if (!buf || !(src = mfpeek(mf, l, 0)))
+			{
+				if (!mfread(src = buf ? buf : dest, l, 1, mf))
+					goto fail;
+			}
 			ls_progress(settings, i, 10);
 			if (!buf) continue; // Nothing else to do here
 
-			copy_bytes(dest, buf, w, rgbpp, depth);
+			copy_bytes(dest, src, w, rgbpp, depth);
 			for (j = CHN_ALPHA; j < NUM_CHANNELS; j++)
 				if (settings->img[j]) copy_bytes(
 					settings->img[j] + w * i,
-					buf + slots[j], w, 1, depth);
+					src + slots[j], w, 1, depth);
 		}
 
 		/* Extend what we've read */
@@ -9088,10 +10127,10 @@ static int load_pmm_frames(char *file_name, ani_settings *ani, memFILE *mf)
 	int res, next;
 
 
-	if (!mf)
+	if (!mf && !mfmap(mf = &fake_mf, file_name))
 	{
 		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
+		memset(mf, 0, sizeof(fake_mf));
 		fake_mf.file = fp;
 	}
 	init_set = ani->settings;
@@ -9116,7 +10155,8 @@ static int load_pmm_frames(char *file_name, ani_settings *ani, memFILE *mf)
 		init_set.rgb_trans = w_set.rgb_trans;
 		init_set.gif_delay = w_set.gif_delay;
 	}
-	fclose(fp);
+	if (fp) fclose(fp);
+	if (mf == &fake_mf) mfunmap(mf);
 	return (res);
 }
 
@@ -9126,14 +10166,15 @@ static int load_pmm(char *file_name, ls_settings *settings, memFILE *mf)
 	FILE *fp = NULL;
 	int res;
 
-	if (!mf)
+	if (!mf && !mfmap(mf = &fake_mf, file_name))
 	{
 		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
+		memset(mf, 0, sizeof(fake_mf));
 		fake_mf.file = fp;
 	}
 	res = load_pmm_frame(mf, settings);
 	if (fp) fclose(fp);
+	if (mf == &fake_mf) mfunmap(mf);
 	return (res);
 }
 
@@ -9686,6 +10727,726 @@ int save_mem_image(unsigned char **buf, int *len, ls_settings *settings)
 	return (res);
 }
 
+/* *** PREFACE ***
+ * Streamed conversion never holds the entire image in memory: rows are read
+ * in bands into a ring buffer, pass through row-local stages (palette
+ * expansion, scaling, thresholding), and get written out in bands while the
+ * next ones are being read and processed. Decoder, processor and encoder run
+ * in lockstep, each on its own thread if there are enough of them. Only the
+ * simple, sequentially-readable kinds of files can be handled this way. */
+
+#define STREAM_BAND 64 /* Rows per band */
+
+typedef struct rowfile rowfile;
+typedef int (*rowfile_func)(rowfile *rf, unsigned char *img,
+	unsigned char *alpha, int cnt);
+
+struct rowfile {
+	ls_settings s;		// Format & geometry
+	png_color pal[256];
+	rowfile_func rows;	// Read or write a band of rows
+	int write, alpha;
+	FILE *fp;
+	unsigned char *tmp;	// Row buffer
+	/* PNG */
+	png_structp png_ptr;
+	png_infop info_ptr;
+	unsigned char trans[256];
+	int itrans;
+	/* PNM */
+	pnmbuf pnm;
+	char *str;
+	int mode, maxval, bw;
+#ifdef U_JPEG
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr;
+	int inv;
+#endif
+#ifdef U_TIFF
+	TIFF *tif;
+	int y, bits, sampp;
+#endif
+};
+
+static int read_png_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	unsigned char *src;
+	int i, w = rf->s.width;
+
+	if (setjmp(png_jmpbuf(rf->png_ptr))) return (FALSE);
+	for (; cnt > 0; cnt--)
+	{
+		src = rf->tmp ? rf->tmp : img;
+		png_read_row(rf->png_ptr, src, NULL);
+		if (rf->itrans && alpha) // Palette transparency
+		{
+			for (i = 0; i < w; i++) alpha[i] = rf->trans[src[i]];
+		}
+		else if (rf->tmp) // RGBA
+		{
+			for (i = 0; i < w; i++ , src += 4)
+			{
+				img[i * 3 + 0] = src[0];
+				img[i * 3 + 1] = src[1];
+				img[i * 3 + 2] = src[2];
+				if (alpha) alpha[i] = src[3];
+			}
+		}
+		img += w * rf->s.bpp;
+		if (alpha) alpha += w;
+	}
+	return (TRUE);
+}
+
+static int write_png_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	unsigned char *dest;
+	int i, w = rf->s.width;
+
+	if (setjmp(png_jmpbuf(rf->png_ptr))) return (FALSE);
+	for (; cnt > 0; cnt--)
+	{
+		dest = img;
+		if (alpha) // RGBA
+		{
+			for (dest = rf->tmp , i = 0; i < w; i++ , dest += 4)
+			{
+				dest[0] = img[i * 3 + 0];
+				dest[1] = img[i * 3 + 1];
+				dest[2] = img[i * 3 + 2];
+				dest[3] = alpha[i];
+			}
+			dest = rf->tmp;
+			alpha += w;
+		}
+		png_write_row(rf->png_ptr, dest);
+		img += w * rf->s.bpp;
+	}
+	return (TRUE);
+}
+
+static int open_png_rows(rowfile *rf, char *file_name)
+{
+	unsigned char buf[PNG_BYTES_TO_CHECK];
+	png_uint_32 pwidth, pheight;
+	int bit_depth, color_type, interlace_type;
+
+	if (rf->write)
+	{
+		if (!(rf->fp = fopen(file_name, "wb"))) return (-1);
+		rf->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+			NULL, NULL, NULL);
+	}
+	else
+	{
+		if (!(rf->fp = fopen(file_name, "rb"))) return (-1);
+		if ((fread(buf, 1, PNG_BYTES_TO_CHECK, rf->fp) !=
+			PNG_BYTES_TO_CHECK) ||
+			png_sig_cmp(buf, 0, PNG_BYTES_TO_CHECK)) return (-1);
+		rf->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+			NULL, NULL, NULL);
+	}
+	if (!rf->png_ptr) return (-1);
+	if (!(rf->info_ptr = png_create_info_struct(rf->png_ptr))) return (-1);
+	if (setjmp(png_jmpbuf(rf->png_ptr))) return (FILE_LIB_ERROR);
+	png_init_io(rf->png_ptr, rf->fp);
+
+	if (rf->write)
+	{
+		png_set_compression_level(rf->png_ptr, rf->s.png_compression);
+		png_set_IHDR(rf->png_ptr, rf->info_ptr,
+			rf->s.width, rf->s.height, 8,
+			rf->s.bpp == 1 ? PNG_COLOR_TYPE_PALETTE : rf->alpha ?
+			PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+		if (rf->s.bpp == 1) png_set_PLTE(rf->png_ptr, rf->info_ptr,
+			rf->s.pal, rf->s.colors);
+		png_write_info(rf->png_ptr, rf->info_ptr);
+		if (rf->alpha && !(rf->tmp = malloc(rf->s.width * 4)))
+			return (FILE_MEM_ERROR);
+		rf->rows = write_png_rows;
+		return (0);
+	}
+
+	png_set_sig_bytes(rf->png_ptr, PNG_BYTES_TO_CHECK);
+	png_read_info(rf->png_ptr, rf->info_ptr);
+	png_get_IHDR(rf->png_ptr, rf->info_ptr, &pwidth, &pheight, &bit_depth,
+		&color_type, &interlace_type, NULL, NULL);
+	/* Interlaced rows don't come in order */
+	if (interlace_type != PNG_INTERLACE_NONE) return (WRONG_FORMAT);
+	if (pwidth > MAX_WIDTH) return (TOO_BIG);
+	rf->s.width = pwidth;
+	rf->s.height = pheight;
+
+	png_set_strip_16(rf->png_ptr);
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+	{
+		png_colorp png_palette;
+
+		png_get_PLTE(rf->png_ptr, rf->info_ptr, &png_palette,
+			&rf->s.colors);
+		memcpy(rf->s.pal, png_palette, rf->s.colors * sizeof(png_color));
+		/* Is there a transparent index? */
+		if (png_get_valid(rf->png_ptr, rf->info_ptr, PNG_INFO_tRNS))
+		{
+			png_bytep ptrans;
+			int ltrans;
+
+			png_get_tRNS(rf->png_ptr, rf->info_ptr, &ptrans, &ltrans,
+				NULL);
+			memset(rf->trans, 255, 256);
+			memcpy(rf->trans, ptrans, ltrans);
+			rf->itrans = rf->alpha = TRUE;
+		}
+		png_set_packing(rf->png_ptr);
+		rf->s.bpp = 1;
+	}
+	else
+	{
+		png_set_gray_1_2_4_to_8(rf->png_ptr);
+		png_set_gray_to_rgb(rf->png_ptr);
+		if (color_type & PNG_COLOR_MASK_ALPHA)
+		{
+			if (!(rf->tmp = malloc(rf->s.width * 4)))
+				return (FILE_MEM_ERROR);
+			rf->alpha = TRUE;
+		}
+		rf->s.bpp = 3;
+	}
+	rf->rows = read_png_rows;
+	return (0);
+}
+
+static int read_pnm_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	int l = rf->s.width * rf->s.bpp;
+
+	for (; cnt > 0; cnt-- , img += l)
+	{
+		if (!pnm_row(&rf->pnm, img, rf->s.width, l, rf->mode, rf->maxval,
+			&rf->str)) return (FALSE);
+		if (rf->mode == 3) extend_bytes(img, l, rf->maxval);
+	}
+	return (TRUE);
+}
+
+static int write_pnm_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	int l = rf->s.width * rf->s.bpp;
+
+	if (rf->s.ftype == FT_PPM)
+		return (fwrite(img, l, cnt, rf->fp) == cnt);
+	for (; cnt > 0; cnt-- , img += l)
+	{
+		pack_MSB(rf->tmp, img, l, rf->bw);
+		if (!fwrite(rf->tmp, (l + 7) >> 3, 1, rf->fp)) return (FALSE);
+	}
+	return (TRUE);
+}
+
+static int open_pnm_rows(rowfile *rf, char *file_name)
+{
+	if (rf->write)
+	{
+		if (!(rf->fp = fopen(file_name, "wb"))) return (-1);
+		if (rf->s.ftype == FT_PPM) fprintf(rf->fp, "P6\n%d %d\n255\n",
+			rf->s.width, rf->s.height);
+		else
+		{
+			if (!(rf->tmp = malloc(MAX_WIDTH / 8)))
+				return (FILE_MEM_ERROR);
+			rf->bw = get_bw(&rf->s);
+			fprintf(rf->fp, "P4\n%d %d\n", rf->s.width, rf->s.height);
+		}
+		rf->rows = write_pnm_rows;
+		return (0);
+	}
+
+	if (!(rf->fp = fopen(file_name, "rb"))) return (-1);
+	rf->pnm.f = rf->fp;
+	if ((rf->mode = pnm_header(&rf->pnm, &rf->s, &rf->maxval)) < 0)
+		return (-1);
+	if (rf->s.width > MAX_WIDTH) return (TOO_BIG);
+	rf->str = "";
+	rf->rows = read_pnm_rows;
+	return (0);
+}
+
+#ifdef U_JPEG
+static int read_jpeg_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	if (setjmp(rf->jerr.setjmp_buffer)) return (FALSE);
+	for (; cnt > 0; cnt--)
+	{
+		jpeg_read_scanlines(&rf->dinfo, rf->tmp ? &rf->tmp : &img, 1);
+		if (rf->tmp) cmyk2rgb(img, rf->tmp, rf->s.width, rf->inv, &rf->s);
+		img += rf->s.width * rf->s.bpp;
+	}
+	return (TRUE);
+}
+
+static int write_jpeg_rows(rowfile *rf, unsigned char *img,
+	unsigned char *alpha, int cnt)
+{
+	if (setjmp(rf->jerr.setjmp_buffer)) return (FALSE);
+	for (; cnt > 0; cnt-- , img += rf->s.width * 3)
+		jpeg_write_scanlines(&rf->cinfo, &img, 1);
+	return (TRUE);
+}
+
+static int open_jpeg_rows(rowfile *rf, char *file_name)
+{
+	if (!(rf->fp = fopen(file_name, rf->write ? "wb" : "rb"))) return (-1);
+
+	if (rf->write)
+	{
+		rf->cinfo.err = jpeg_std_error(&rf->jerr.pub);
+		rf->jerr.pub.error_exit = my_error_exit;
+		if (setjmp(rf->jerr.setjmp_buffer)) return (FILE_LIB_ERROR);
+		jpeg_create_compress(&rf->cinfo);
+		jpeg_stdio_dest(&rf->cinfo, rf->fp);
+		rf->cinfo.image_width = rf->s.width;
+		rf->cinfo.image_height = rf->s.height;
+		rf->cinfo.input_components = 3;
+		rf->cinfo.in_color_space = JCS_RGB;
+		jpeg_set_defaults(&rf->cinfo);
+		jpeg_set_quality(&rf->cinfo, rf->s.jpeg_quality, TRUE);
+		jpeg_start_compress(&rf->cinfo, TRUE);
+		rf->rows = write_jpeg_rows;
+		return (0);
+	}
+
+	rf->dinfo.err = jpeg_std_error(&rf->jerr.pub);
+	rf->jerr.pub.error_exit = my_error_exit;
+	if (setjmp(rf->jerr.setjmp_buffer)) return (FILE_LIB_ERROR);
+	jpeg_create_decompress(&rf->dinfo);
+	jpeg_stdio_src(&rf->dinfo, rf->fp);
+	jpeg_read_header(&rf->dinfo, TRUE);
+	jpeg_start_decompress(&rf->dinfo);
+
+	rf->s.bpp = 3;
+	switch (rf->dinfo.out_color_space)
+	{
+	case JCS_RGB: break;
+	case JCS_GRAYSCALE:
+		set_gray(&rf->s);
+		rf->s.bpp = 1;
+		break;
+	case JCS_CMYK:
+		/* Photoshop writes CMYK data inverted */
+		rf->inv = rf->dinfo.saw_Adobe_marker;
+		if ((rf->tmp = malloc(rf->dinfo.output_width * 4))) break;
+		return (FILE_MEM_ERROR);
+	default: return (WRONG_FORMAT); /* Unsupported colorspace */
+	}
+	if (rf->dinfo.output_width > MAX_WIDTH) return (TOO_BIG);
+	rf->s.width = rf->dinfo.output_width;
+	rf->s.height = rf->dinfo.output_height;
+	rf->rows = read_jpeg_rows;
+	return (0);
+}
+#endif
+
+#ifdef U_TIFF
+static int read_tiff_rows(rowfile *rf, unsigned char *img, unsigned char *alpha,
+	int cnt)
+{
+	unsigned char *src = rf->tmp;
+	int i, w = rf->s.width, bpp = rf->s.bpp, sampp = rf->sampp;
+
+	for (; cnt > 0; cnt-- , img += w * bpp)
+	{
+		if (TIFFReadScanline(rf->tif, src, rf->y++, 0) < 0)
+			return (FALSE);
+		if (rf->bits < 8) stream_MSB(src, img, w, rf->bits, 0,
+			rf->bits, 1);
+		else if (sampp == bpp) memcpy(img, src, w * bpp);
+		else copy_bytes(img, src, w, bpp, sampp);
+		if (!alpha) continue;
+		for (i = 0; i < w; i++) alpha[i] = src[i * sampp + bpp];
+		alpha += w;
+	}
+	return (TRUE);
+}
+
+static int open_tiff_rows(rowfile *rf, char *file_name)
+{
+	uint16 bpsamp, sampp, xsamp, pmetric, planar, orient, sform;
+	uint16 *sampinfo, *red16, *green16, *blue16;
+	uint32 width, height;
+	int i, k, n, na = 0, nd = 1;
+
+	TIFFSetErrorHandler(NULL);	// We don't want any echoing to the output
+	TIFFSetWarningHandler(NULL);
+	if (!(rf->tif = TIFFOpen(file_name, "r"))) return (-1);
+
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_SAMPLESPERPIXEL, &sampp);
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_EXTRASAMPLES, &xsamp, &sampinfo);
+	if (!TIFFGetField(rf->tif, TIFFTAG_PHOTOMETRIC, &pmetric))
+		pmetric = sampp - xsamp == 1 ? PHOTOMETRIC_MINISBLACK :
+			PHOTOMETRIC_RGB;
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_SAMPLEFORMAT, &sform);
+	TIFFGetField(rf->tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(rf->tif, TIFFTAG_IMAGELENGTH, &height);
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_BITSPERSAMPLE, &bpsamp);
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_PLANARCONFIG, &planar);
+	TIFFGetFieldDefaulted(rf->tif, TIFFTAG_ORIENTATION, &orient);
+
+	/* Only plain scanline-ordered 8-bit or smaller pixels are streamable;
+	 * everything else is left to the regular loader */
+	if (TIFFIsTiled(rf->tif) || (orient != ORIENTATION_TOPLEFT) ||
+		((sform != SAMPLEFORMAT_UINT) && (sform != SAMPLEFORMAT_VOID)) ||
+		((planar != PLANARCONFIG_CONTIG) && (sampp > 1)) ||
+		(xsamp > 1) || (bpsamp > 8) || ((bpsamp < 8) && (sampp > 1)))
+		return (WRONG_FORMAT);
+	switch (pmetric)
+	{
+	case PHOTOMETRIC_PALETTE:
+		if (!TIFFGetField(rf->tif, TIFFTAG_COLORMAP,
+			&red16, &green16, &blue16)) return (-1);
+		rf->s.colors = n = 1 << bpsamp;
+		/* Analyze palette */
+		for (k = i = 0; i < n; i++) k |= red16[i] | green16[i] | blue16[i];
+		if (k > 255) na = 128 , nd = 257; /* New palette format */
+		for (i = 0; i < n; i++)
+		{
+			rf->s.pal[i].red = (red16[i] + na) / nd;
+			rf->s.pal[i].green = (green16[i] + na) / nd;
+			rf->s.pal[i].blue = (blue16[i] + na) / nd;
+		}
+		rf->s.bpp = 1;
+		break;
+	case PHOTOMETRIC_MINISWHITE:
+	case PHOTOMETRIC_MINISBLACK:
+		if (sampp - xsamp != 1) return (WRONG_FORMAT);
+		rf->s.colors = n = 1 << bpsamp;
+		if (pmetric == PHOTOMETRIC_MINISWHITE)
+			mem_bw_pal(rf->s.pal, n - 1, 0);
+		else mem_bw_pal(rf->s.pal, 0, n - 1);
+		rf->s.bpp = 1;
+		break;
+	case PHOTOMETRIC_RGB:
+		if (sampp - xsamp != 3) return (WRONG_FORMAT);
+		rf->s.bpp = 3;
+		break;
+	default: return (WRONG_FORMAT);
+	}
+	if (width > MAX_WIDTH) return (TOO_BIG);
+	rf->s.width = width;
+	rf->s.height = height;
+	rf->bits = bpsamp;
+	rf->sampp = sampp;
+	rf->alpha = xsamp;
+	/* Extra byte for bitstream parser */
+	if (!(rf->tmp = malloc(TIFFScanlineSize(rf->tif) + 1)))
+		return (FILE_MEM_ERROR);
+	rf->rows = read_tiff_rows;
+	return (0);
+}
+#endif
+
+/* Open file for reading or writing rows, return 0 if successful */
+static int open_rows(rowfile *rf, char *file_name, int ftype)
+{
+	rf->s.ftype = ftype;
+	switch (ftype)
+	{
+	case FT_PNG: return (open_png_rows(rf, file_name));
+	case FT_PBM:
+	case FT_PGM:
+	case FT_PPM: return (open_pnm_rows(rf, file_name));
+#ifdef U_JPEG
+	case FT_JPEG: return (open_jpeg_rows(rf, file_name));
+#endif
+#ifdef U_TIFF
+	case FT_TIFF: if (!rf->write) return (open_tiff_rows(rf, file_name));
+#endif
+	}
+	return (WRONG_FORMAT);
+}
+
+/* Finish writing if asked to, and release everything */
+static int close_rows(rowfile *rf, int finish)
+{
+	int i, res = 0;
+
+	switch (rf->s.ftype)
+	{
+	case FT_PNG:
+		if (!rf->png_ptr) break;
+		if (!finish);
+		else if (setjmp(png_jmpbuf(rf->png_ptr))) res = FILE_LIB_ERROR;
+		else if (rf->write) png_write_end(rf->png_ptr, rf->info_ptr);
+		if (rf->write) png_destroy_write_struct(&rf->png_ptr,
+			&rf->info_ptr);
+		else png_destroy_read_struct(&rf->png_ptr, &rf->info_ptr, NULL);
+		break;
+#ifdef U_JPEG
+	case FT_JPEG:
+		if (setjmp(rf->jerr.setjmp_buffer))
+		{
+			res = FILE_LIB_ERROR;
+			finish = FALSE;
+		}
+		if (!rf->jerr.pub.error_exit); // Never initialized
+		else if (rf->write)
+		{
+			if (finish) jpeg_finish_compress(&rf->cinfo);
+			jpeg_destroy_compress(&rf->cinfo);
+		}
+		else jpeg_destroy_decompress(&rf->dinfo);
+		break;
+#endif
+#ifdef U_TIFF
+	case FT_TIFF:
+		if (rf->tif) TIFFClose(rf->tif);
+		break;
+#endif
+	}
+	if (rf->fp)
+	{
+		i = ferror(rf->fp);
+		if ((fclose(rf->fp) || i) && rf->write && !res) res = -1;
+	}
+	free(rf->tmp);
+	return (res);
+}
+
+typedef struct {
+	rowfile *in, *out;
+	rowscale rs;
+	int w, bpp, alpha;	// Ring buffer rows
+	int ring;		// Rows in ring buffer
+	int level;		// Threshold
+	unsigned char *img, *imga, *tmp, *trow;
+	unsigned char *buf[2], *bufa[2];
+	int cnt[2];		// Rows in output bands
+	int step;
+	int dec, lo, next;	// Source rows read & in use, destination row
+	int ndec, nnext, wrote;
+	int res[3];
+} convpipe;
+
+/* Read a band of source rows into ring buffer, if there is room */
+static int conv_decode(convpipe *cp)
+{
+	rowfile *in = cp->in;
+	unsigned char *dest, *src, *desta = NULL;
+	int n = in->s.height - cp->dec;
+
+	if (n > STREAM_BAND) n = STREAM_BAND;
+	if ((n <= 0) || (cp->dec + n - cp->lo > cp->ring)) return (0);
+	/* Ring is band-aligned, so the band is contiguous */
+	src = dest = cp->img + (size_t)(cp->dec % cp->ring) * cp->w * cp->bpp;
+	if (cp->alpha) desta = cp->imga + (size_t)(cp->dec % cp->ring) * cp->w;
+	if (cp->bpp != in->s.bpp) src = cp->tmp; // Expand palette
+	if (!in->rows(in, src, desta, n)) return (FILE_LIB_ERROR);
+	if (src != dest) do_convert_rgb(0, 1, n * cp->w, dest, src, in->s.pal);
+	cp->ndec = cp->dec + n;
+	return (0);
+}
+
+/* Make as many destination rows as the source rows read so far allow */
+static int conv_process(convpipe *cp)
+{
+	unsigned char *dest, *desta = NULL;
+	int i, j, y0, y1, k = cp->step & 1, n = 0, l = cp->out->s.width;
+
+	for (i = cp->next; (i < cp->out->s.height) && (n < STREAM_BAND); i++ , n++)
+	{
+		mem_rowscale_rows(&cp->rs, i, &y0, &y1);
+		if (y1 > cp->dec) break;
+		dest = cp->buf[k] + n * l * cp->out->s.bpp;
+		if (cp->alpha) desta = cp->bufa[k] + n * l;
+		if (!cp->level) mem_rowscale(&cp->rs, i, cp->img, cp->imga,
+			cp->ring, dest, desta);
+		else /* Threshold by the max of RGB, black is 1 */
+		{
+			unsigned char *src = cp->trow;
+
+			mem_rowscale(&cp->rs, i, cp->img, NULL, cp->ring, src, NULL);
+			for (j = 0; j < l; j++ , src += 3)
+			{
+				y0 = src[0] > src[1] ? src[0] : src[1];
+				y0 = (src[2] > y0 ? src[2] : y0) < cp->level;
+				if (cp->out->s.bpp == 1) *dest++ = y0;
+				/* Black and white as RGB, for RGB-only formats */
+				else dest[0] = dest[1] = dest[2] = y0 ? 0 : 255 ,
+					dest += 3;
+			}
+		}
+	}
+	cp->cnt[k] = n;
+	cp->nnext = i;
+	return (0);
+}
+
+/* Write out the band made at previous step */
+static int conv_encode(convpipe *cp)
+{
+	int k = (cp->step & 1) ^ 1, n = cp->cnt[k];
+
+	if (!n) return (0);
+	if (!cp->out->rows(cp->out, cp->buf[k], cp->alpha ? cp->bufa[k] : NULL,
+		n)) return (-1);
+	cp->wrote += n;
+	return (0);
+}
+
+static void conv_stages(tcb *thread)
+{
+	convpipe *cp = *(convpipe **)thread->data;
+	int i;
+
+	for (i = thread->step0; i < thread->step0 + thread->nsteps; i++)
+	{
+		if (i == 0) cp->res[0] = conv_decode(cp);
+		else if (i == 1) cp->res[1] = conv_process(cp);
+		else if (i == 2) cp->res[2] = conv_encode(cp);
+	}
+}
+
+/* Convert and maybe scale image file, streaming it row by row */
+int convert_image(char *src_name, char *dest_name, conv_settings *cs)
+{
+	static const png_color wb[2] = { { 255, 255, 255 }, { 0, 0, 0 } };
+	rowfile in, out;
+	convpipe cp, *cpp = &cp;
+	threaddata *tdata = NULL;
+	unsigned int flags;
+	int i, l, nw, nh, ftype, res;
+
+
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+	memset(&cp, 0, sizeof(cp));
+	in.s.pal = in.pal;
+	out.s.pal = out.pal;
+	out.write = TRUE;
+	cp.in = &in;
+	cp.out = &out;
+
+	/* Check what is going to be written */
+	ftype = file_type_by_ext(dest_name, FF_IMAGE);
+	if (ftype == FT_NONE) return (WRONG_FORMAT);
+	flags = file_formats[ftype].flags;
+
+	/* Open the source */
+	i = detect_image_format(src_name);
+	if (i < 0) return (-1);
+	if ((res = open_rows(&in, src_name, i))) goto fail;
+
+	/* Decide the geometry */
+	nw = cs->width;
+	nh = cs->height;
+	if (!nw && nh) nw = ((double)in.s.width * nh) / in.s.height + 0.5;
+	if (!nh && nw) nh = ((double)in.s.height * nw) / in.s.width + 0.5;
+	if (!nw) nw = in.s.width;
+	if (!nh) nh = in.s.height;
+	res = TOO_BIG;
+	if ((nw < 1) || (nw > MAX_WIDTH) || (nh < 1)) goto fail;
+
+	/* Decide the pixel format */
+	cp.level = cs->threshold;
+	cp.bpp = in.s.bpp;
+	cp.alpha = in.alpha;
+	if ((ftype == FT_PBM) && !cp.level &&
+		((in.s.bpp != 1) || (in.s.colors > 2)))
+		cp.level = 128; // Must be black and white
+	if (!(flags & FF_ALPHAR) || cp.level) cp.alpha = FALSE;
+	if (cp.level || cs->rgb || !(flags & FF_IDX) || cp.alpha) cp.bpp = 3;
+	if (!(flags & FF_RGB) && !cp.level && (cp.bpp == 3))
+	{
+		res = WRONG_FORMAT;
+		goto fail;
+	}
+	/* Reader needn't bother with alpha if it gets dropped */
+	in.alpha = cp.alpha;
+	cp.w = in.s.width;
+
+	/* Prepare the destination */
+	out.s.width = nw;
+	out.s.height = nh;
+	out.s.bpp = cp.level && (flags & FF_IDX) ? 1 : cp.bpp;
+	out.s.jpeg_quality = jpeg_quality;
+	out.s.png_compression = png_compression;
+	out.alpha = cp.alpha;
+	if (out.s.bpp != 1); // RGB
+	else if (cp.level) memcpy(out.s.pal, wb, sizeof(wb)) , out.s.colors = 2;
+	else mem_pal_copy(out.s.pal, in.s.pal) , out.s.colors = in.s.colors;
+
+	/* Allocate buffers */
+	res = FILE_MEM_ERROR;
+	if (!(i = mem_rowscale_init(&cp.rs, cp.w, in.s.height, nw, nh, cp.bpp,
+		cp.alpha, cs->scale_type, cs->gcor, cs->sharp))) goto fail;
+	cp.ring = ((i + STREAM_BAND - 1) / STREAM_BAND + 2) * STREAM_BAND;
+	if ((double)cp.ring * cp.w * 4 > (double)0x7FFFFFFF) goto fail2;
+	l = nw * out.s.bpp * STREAM_BAND;
+	if (!multialloc(MA_SKIP_ZEROSIZE, &cp.img, cp.ring * cp.w * cp.bpp,
+		&cp.imga, cp.alpha ? cp.ring * cp.w : 0,
+		&cp.tmp, cp.bpp != in.s.bpp ? STREAM_BAND * cp.w : 0,
+		&cp.trow, cp.level ? nw * 3 : 0,
+		&cp.buf[0], l, &cp.buf[1], l,
+		&cp.bufa[0], cp.alpha ? nw * STREAM_BAND : 0,
+		&cp.bufa[1], cp.alpha ? nw * STREAM_BAND : 0, NULL)) goto fail2;
+
+	if ((res = open_rows(&out, dest_name, ftype))) goto fail3;
+
+	/* Run the stages on separate threads if possible */
+#ifdef U_THREADS
+	if (!threads_running) tdata = talloc(MA_SKIP_ZEROSIZE | MA_FLAG_NONE,
+		3, &cpp, sizeof(cpp), NULL, NULL);
+	if (tdata == MEM_NONE) tdata = NULL; // Only one thread
+#endif
+	if (tdata)
+	{
+		tdata->chunks = 3;
+		tdata->silent = TRUE;
+	}
+	while (cp.wrote < nh)
+	{
+		cp.lo = cp.dec;
+		if (cp.next < nh) mem_rowscale_rows(&cp.rs, cp.next, &cp.lo, &i);
+		cp.ndec = cp.dec;
+		cp.nnext = cp.next;
+		i = cp.wrote;
+		if (tdata) launch_threads(conv_stages, tdata, NULL, 3);
+		else
+		{
+			cp.res[0] = conv_decode(cpp);
+			cp.res[1] = conv_process(cpp);
+			cp.res[2] = conv_encode(cpp);
+		}
+		if ((res = cp.res[0] ? cp.res[0] : cp.res[1] ? cp.res[1] :
+			cp.res[2])) break;
+		/* No progress means a bug */
+		res = -1;
+		if ((cp.ndec == cp.dec) && (cp.nnext == cp.next) &&
+			(cp.wrote == i)) break;
+		res = 0;
+		cp.dec = cp.ndec;
+		cp.next = cp.nnext;
+		cp.step++;
+	}
+	free(tdata);
+
+fail3:	i = close_rows(&out, !res);
+	if (!res) res = i;
+	/* Leave no partial files behind */
+	if (res && out.fp) remove(dest_name);
+	free(cp.img);
+fail2:	mem_rowscale_free(&cp.rs);
+fail:	close_rows(&in, FALSE);
+	return (res);
+}
+
 static void store_image_extras(image_info *image, image_state *state,
 	ls_settings *settings)
 {
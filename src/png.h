@@ -140,6 +140,7 @@ extern tiff_format tiff_formats[];
 int tiff_lzma, tiff_zstd; /* LZMA2 & ZSTD compression supported */
 
 extern char *webp_presets[];
+extern char *png_profiles[];
 
 /* All-in-one transport container for save/load */
 typedef struct {
@@ -147,9 +148,10 @@ typedef struct {
 	int mode, ftype;
 	int xpm_trans;
 	int hot_x, hot_y;
-	int req_w, req_h; // Size request for scalable formats
+	int req_w, req_h; // Size request: exact for scalable formats, least for others
 	int jpeg_quality;
 	int png_compression;
+	int png_profile;
 	int lzma_preset;
 	int zstd_level;
 	int tiff_type;
@@ -171,6 +173,8 @@ typedef struct {
 } ls_settings;
 
 int silence_limit, jpeg_quality, png_compression;
+int png_profile, png_budget;	/* Save profile & time budget in ms */
+double png_stats[3];		/* Last saved PNG: size, % of raw size, ms */
 int tga_RLE, tga_565, tga_defdir, jp2_rate;
 int lzma_preset, zstd_level, tiff_predictor, tiff_rtype, tiff_itype, tiff_btype;
 int webp_preset, webp_quality, webp_compression;
@@ -182,6 +186,16 @@ int file_type_by_ext(char *name, guint32 mask);
 int save_image(char *file_name, ls_settings *settings);
 int save_mem_image(unsigned char **buf, int *len, ls_settings *settings);
 
+/* Settings for streamed conversion */
+typedef struct {
+	int width, height;	// Size to scale to, 0 to keep
+	int scale_type, gcor, sharp;
+	int rgb;		// Expand palette to RGB
+	int threshold;		// Reduce to black & white at this level
+} conv_settings;
+
+int convert_image(char *src_name, char *dest_name, conv_settings *cs);
+
 int load_image(char *file_name, int mode, int ftype);
 int load_mem_image(unsigned char *buf, int len, int mode, int ftype);
 int load_image_scale(char *file_name, int mode, int ftype, int w, int h);
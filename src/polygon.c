@@ -25,22 +25,150 @@ int poly_points;
 int poly_mem[MAX_POLY][2];
 		// Coords in poly_mem are raw coords as plotted over image
 int poly_xy[4];
+int poly_smooth;
 
 
-static int cmp_spans(const void *span1, const void *span2)
+typedef struct {
+	int x0, x1, y0, y1; // Ordered by increasing Y
+	int dir; // 1 if went downward originally, -1 if upward
+} poly_edge;
+
+static int cmp_edges(const void *edge1, const void *edge2)
 {
-	return (((int *)span1)[2] - ((int *)span2)[2]);
+	return (((poly_edge *)edge1)->y0 - ((poly_edge *)edge2)->y0);
+}
+
+/* Collect polygon edges ordered by upper end, skipping horizontal ones */
+static int poly_edges(poly_edge *edges, int y0, int y1)
+{
+	poly_edge *edge = edges;
+	int i, j, k;
+
+	j = poly_points - 1;
+	for (i = 0; i < poly_points; j = i++)
+	{
+		// No use for horizontal edges
+		if (poly_mem[j][1] == poly_mem[i][1]) continue;
+		// Order points by increasing Y
+		k = poly_mem[j][1] > poly_mem[i][1];
+		edge->x0 = poly_mem[k ? i : j][0];
+		edge->y0 = poly_mem[k ? i : j][1];
+		edge->x1 = poly_mem[k ? j : i][0];
+		edge->y1 = poly_mem[k ? j : i][1];
+		edge->dir = 1 - k * 2;
+		// Check vertical boundaries
+		if ((edge->y1 <= y0) || (edge->y0 >= y1)) continue;
+		// Accept the edge
+		edge++;
+	}
+	k = edge - edges;
+	qsort(edges, k, sizeof(poly_edge), cmp_edges);
+	return (k);
+}
+
+/* Fill polygon with analytic coverage: for each pixel row, edges deposit
+ * their signed area into an accumulation row, which then gets integrated;
+ * vertices are at pixel centers, and the winding sum is folded by even-odd
+ * rule, same as for the plain fill */
+static void poly_smooth_fill(unsigned char *buf, int wbuf, int *rxy)
+{
+	poly_edge edges[MAX_POLY];
+	int act[MAX_POLY];
+	float *acc;
+	int i, j, n, nact, e, y, w = rxy[2] - rxy[0] + 1;
+
+
+	if (!(acc = calloc(w + 2, sizeof(float)))) return;
+	n = poly_edges(edges, rxy[1] - 1, rxy[3] + 1);
+
+	for (y = rxy[1] , nact = e = 0; y <= rxy[3]; y++)
+	{
+		unsigned char *dest = buf + y * wbuf + rxy[0];
+		double yt = y - 0.5, yb = y + 0.5, sum;
+
+		/* Drop edges which ended, add ones which started */
+		for (i = j = 0; i < nact; i++)
+			if (edges[act[i]].y1 > yt) act[j++] = act[i];
+		for (nact = j; (e < n) && (edges[e].y0 < yb); e++)
+			if (edges[e].y1 > yt) act[nact++] = e;
+		if (!nact)
+		{
+			if (e >= n) break; // No more edges
+			continue;
+		}
+
+		/* Deposit areas */
+		for (i = 0; i < nact; i++)
+		{
+			poly_edge *edge = edges + act[i];
+			double x0, x1, y0, y1, d, dxdy, xa, xb, xm, s, a0, a1, am;
+			int x0i, x1i;
+
+			/* Clip the edge to row, in row-relative coordinates */
+			dxdy = (double)(edge->x1 - edge->x0) / (edge->y1 - edge->y0);
+			y0 = edge->y0 < yt ? yt : edge->y0;
+			y1 = edge->y1 > yb ? yb : edge->y1;
+			x0 = edge->x0 + (y0 - edge->y0) * dxdy - rxy[0] + 0.5;
+			x1 = edge->x0 + (y1 - edge->y0) * dxdy - rxy[0] + 0.5;
+			/* Points beyond sides only matter by which side it is */
+			x0 = x0 < 0 ? 0 : x0 > w ? w : x0;
+			x1 = x1 < 0 ? 0 : x1 > w ? w : x1;
+			/* Signed by direction, for winding */
+			d = (y1 - y0) * edge->dir;
+			if (x0 > x1) xa = x1 , xb = x0;
+			else xa = x0 , xb = x1;
+			x0i = floor(xa);
+			x1i = ceil(xb);
+			if (x1i <= x0i + 1) /* Within one pixel */
+			{
+				xm = 0.5 * (xa + xb) - x0i;
+				acc[x0i] += d - d * xm;
+				acc[x0i + 1] += d * xm;
+				continue;
+			}
+			s = 1.0 / (xb - xa);
+			xm = xa - x0i;
+			a0 = 0.5 * s * (1.0 - xm) * (1.0 - xm);
+			xm = xb - x1i + 1.0;
+			am = 0.5 * s * xm * xm;
+			acc[x0i] += d * a0;
+			if (x1i == x0i + 2) acc[x0i + 1] += d * (1.0 - a0 - am);
+			else
+			{
+				a1 = s * (1.5 - (xa - x0i));
+				acc[x0i + 1] += d * (a1 - a0);
+				for (j = x0i + 2; j < x1i - 1; j++) acc[j] += d * s;
+				acc[x1i - 1] += d * (1.0 - a1 -
+					(x1i - x0i - 3) * s - am);
+			}
+			acc[x1i] += d * am;
+		}
+
+		/* Integrate the row */
+		for (i = 0 , sum = 0.0; i < w; i++)
+		{
+			double c;
+
+			sum += acc[i];
+			acc[i] = 0.0;
+			/* Odd windings are inside, even ones outside */
+			c = sum - 2.0 * floor(sum * 0.5);
+			if (c > 1.0) c = 2.0 - c;
+			dest[i] = (int)(c * 255.0 + 0.5);
+		}
+		acc[w] = acc[w + 1] = 0.0;
+	}
+	free(acc);
 }
 
 /* !!! This code clips polygon to image boundaries, and when using buffer
  * assumes it covers the intersection area - WJ */
 void poly_draw(int filled, unsigned char *buf, int wbuf)
 {
-#define SPAN_STEP 5 /* x0, x1, y0, y1, next */
 	linedata line;
-	unsigned char borders[MAX_WIDTH];
-	int spans[(MAX_POLY + 1) * SPAN_STEP], *span, *span2;
-	int i, j, k, nspans, y, rxy[4];
+	poly_edge edges[MAX_POLY];
+	int act[MAX_POLY], xs[MAX_POLY + 1];
+	int i, j, k, n, nact, e, y, rxy[4];
 	int oldmode = mem_undo_opacity;
 
 
@@ -52,7 +180,15 @@ void poly_draw(int filled, unsigned char *buf, int wbuf)
 	/* Adjust buffer pointer */
 	if (buf) buf -= rxy[1] * wbuf + rxy[0];
 
+	/* Antialiased mask needs no hard outline */
+	if (buf && (filled > 1))
+	{
+		poly_smooth_fill(buf, wbuf, rxy);
+		return;
+	}
+
 	mem_undo_opacity = TRUE;
+	if (!filled) init_spans();
 
 	j = poly_points - 1;
 	for (i = 0; i < poly_points; j = i++)
@@ -80,101 +216,74 @@ void poly_draw(int filled, unsigned char *buf, int wbuf)
 		// Outline is needed to properly edge the polygon
 	}
 
-	if (!filled) goto done;	// If drawing outline only, finish now
-
-	/* Build array of vertical spans */
-	span = spans + SPAN_STEP;
-	j = poly_points - 1;
-	for (i = 0; i < poly_points; j = i++)
+	if (!filled) // If drawing outline only, finish now
 	{
-		int x0 = poly_mem[j][0], y0 = poly_mem[j][1];
-		int x1 = poly_mem[i][0], y1 = poly_mem[i][1];
-
-		// No use for horizontal spans
-		if (y0 == y1) continue;
-		// Order points by increasing Y
-		k = y0 > y1;
-		span[k] = x0;
-		span[k + 2] = y0;
-		k ^= 1;
-		span[k] = x1;
-		span[k + 2] = y1;
-		// Check vertical boundaries
-		if ((span[3] <= 0) || (span[2] >= mem_height - 1)) continue;
-		// Accept the span
-		span += SPAN_STEP;
+		render_spans();
+		goto done;
 	}
-	nspans = (span - spans) / SPAN_STEP - 1;
-	if (!nspans) goto done; // No interior to fill
-
-	/* Sort and link spans */
-	qsort(spans + SPAN_STEP, nspans, SPAN_STEP * sizeof(int), cmp_spans);
-	for (i = 0; i < nspans; i++) spans[i * SPAN_STEP + 4] = i + 1;
-	spans[nspans * SPAN_STEP + 4] = 0; // Chain terminator
-	spans[2] = spans[3] = MAX_HEIGHT; // Loops breaker
-
-	/* Let's scan! */
-	memset(borders, 0, mem_width);
-	y = spans[SPAN_STEP + 2] + 1;
+
+	/* Build array of edges */
+	n = poly_edges(edges, 0, mem_height - 1);
+	if (!n) goto done; // No interior to fill
+
+	/* Let's scan, keeping active edges ordered by X */
+	y = edges[0].y0 + 1;
 	if (y < 0) y = 0;
-	for (; y < mem_height; y++)
+	for (nact = e = 0; y < mem_height; y++)
 	{
-		unsigned char tv = 0;
-		int i, x, x0 = mem_width, x1 = 0;
+		/* Drop edges which ended, add ones which started */
+		for (i = j = 0; i < nact; i++)
+			if (edges[act[i]].y1 >= y) act[j++] = act[i];
+		for (nact = j; (e < n) && (edges[e].y0 < y); e++)
+			if (edges[e].y1 >= y) act[nact++] = e;
+		if (!nact)
+		{
+			if (e >= n) break; // No more edges
+			continue;
+		}
 
-		/* Label the intersections */
-		if (!spans[4]) break; // List is empty
-		span = spans;
-		while (TRUE)
+		/* Find the intersections, and sort them */
+		for (i = 0; i < nact; i++)
 		{
-			int dx, dy;
-
-			// Unchain used-up spans
-			while ((span2 = spans + span[4] * SPAN_STEP)[3] < y)
-				span[4] = span2[4];
-			if (y <= span2[2]) break; // Y too small yet
-			span = span2;
-			dx = span[1] - span[0];
-			dy = span[3] - span[2];
-			x = (dx * 2 * (y - span[2]) + dy) / (dy * 2) + span[0];
-			if (x >= mem_width) x1 = mem_width; // Fill to end
-			else
+			poly_edge *edge = edges + act[i];
+			int x, dx, dy, a = act[i];
+
+			dx = edge->x1 - edge->x0;
+			dy = edge->y1 - edge->y0;
+			x = (dx * 2 * (y - edge->y0) + dy) / (dy * 2) + edge->x0;
+			x = x < 0 ? 0 : x > mem_width ? mem_width : x;
+			/* Order changes little from row to row */
+			for (j = i; (j > 0) && (xs[j - 1] > x); j--)
 			{
-				if (x < 0) x = 0;
-				if (x0 > x) x0 = x;
-				if (x1 <= x) x1 = x + 1;
-				borders[x] ^= 1;
+				xs[j] = xs[j - 1];
+				act[j] = act[j - 1];
 			}
+			xs[j] = x;
+			act[j] = a;
 		}
 
-		/* Draw the runs */
-		if (x0 >= mem_width) continue; // No pixels
-		for (i = x0; i < x1; i++)
+		/* Draw the runs between odd and even intersections; an odd one
+		 * left over gets a single pixel */
+		xs[nact] = xs[nact - 1] + 1;
+		for (i = 0; i < nact; i += 2)
 		{
-			tv ^= borders[i];
-// !!! "&" is for larger-than-byte char type; normally, GCC will optimize it out
-			borders[i] = (~tv + 1) & 255;
-		}
-		x1 -= x0;
-		if (!buf) put_pixel_row(x0, y, x1, borders + x0);
-		else
-		{
-			unsigned char *dest = buf + y * wbuf + x0;
-			unsigned char *src = borders + x0;
-			for (i = 0; i < x1; i++) dest[i] |= src[i];
+			int x0 = xs[i], x1 = xs[i + 1];
+
+			if (x1 > mem_width) x1 = mem_width;
+			if ((x1 -= x0) <= 0) continue;
+			if (!buf) put_pixel_row(x0, y, x1, NULL);
+			else memset(buf + y * wbuf + x0, 255, x1);
 		}
-		memset(borders + x0, 0, x1);
 	}	
 
 done:	mem_undo_opacity = oldmode;
-#undef SPAN_STEP
 }
 
 void poly_mask()	// Paint polygon onto clipboard mask
 {
 	mem_clip_mask_init(0);		/* Clear mask */
 	if (!mem_clip_mask) return;	/* Failed to get memory */
-	poly_draw(TRUE, mem_clip_mask, mem_clip_w);
+	poly_draw(poly_smooth ? 2 : TRUE, mem_clip_mask, mem_clip_w);
 }
 
 void poly_paint()	// Paint polygon onto image
@@ -213,99 +322,40 @@ void poly_bounds()
 }
 
 
-void flood_fill_poly( int x, int y, unsigned int target )
-{
-	int minx = x, maxx = x, ended = 0, newx = 0;
-
-	mem_clip_mask[ x + y*mem_clip_w ] = 1;
-	while ( ended == 0 )				// Search left for target pixels
-	{
-		minx--;
-		if ( minx < 0 ) ended = 1;
-		else
-		{
-			if ( mem_clipboard[ minx + y*mem_clip_w ] == target )
-				mem_clip_mask[ minx + y*mem_clip_w ] = 1;
-			else ended = 1;
-		}
-	}
-	minx++;
-
-	ended = 0;
-	while ( ended == 0 )				// Search right for target pixels
-	{
-		maxx++;
-		if ( maxx >= mem_clip_w ) ended = 1;
-		else
-		{
-			if ( mem_clipboard[ maxx + y*mem_clip_w ] == target )
-				mem_clip_mask[ maxx + y*mem_clip_w ] = 1;
-			else ended = 1;
-		}
-	}
-	maxx--;
-
-	if ( (y-1) >= 0 )				// Recurse upwards
-		for ( newx = minx; newx <= maxx; newx++ )
-			if ( mem_clipboard[ newx + (y-1)*mem_clip_w ] == target &&
-				mem_clip_mask[newx + mem_clip_w*(y-1)] != 1 )
-					flood_fill_poly( newx, y-1, target );
-
-	if ( (y+1) < mem_clip_h )			// Recurse downwards
-		for ( newx = minx; newx <= maxx; newx++ )
-			if ( mem_clipboard[ newx + (y+1)*mem_clip_w ] == target &&
-				mem_clip_mask[newx + mem_clip_w*(y+1)] != 1 )
-					flood_fill_poly( newx, y+1, target );
-}
+typedef struct {
+	fillmaps fm;
+	int col;
+} lassod;
 
-void flood_fill24_poly( int x, int y, int target )
+static void lasso_band(void *data, unsigned char *buf, int start, int cnt)
 {
-	int minx = x, maxx = x, ended = 0, newx = 0;
-
-	mem_clip_mask[ x + y*mem_clip_w ] = 1;
-	while ( ended == 0 )				// Search left for target pixels
+	lassod *ld = data;
+	unsigned char *cmap, *src;
+	int x, y, y1, bit, w = ld->fm.w, bpp = mem_clip_bpp;
+
+	y = start * 8;
+	y1 = (start + cnt) * 8;
+	if (y1 > ld->fm.h) y1 = ld->fm.h;
+	for (; y < y1; y++)
 	{
-		minx--;
-		if ( minx < 0 ) ended = 1;
-		else
+		cmap = ld->fm.cmap + (y >> 3) * w;
+		src = mem_clipboard + y * w * bpp;
+		bit = 1 << (y & 7);
+		if (bpp == 3)
 		{
-			if ( MEM_2_INT(mem_clipboard, 3*(minx + mem_clip_w*y) ) == target )
-				mem_clip_mask[ minx + y*mem_clip_w ] = 1;
-			else ended = 1;
+			for (x = 0; x < w; x++ , src += 3)
+				if (MEM_2_INT(src, 0) == ld->col) cmap[x] |= bit;
 		}
+		else for (x = 0; x < w; x++)
+			if (src[x] == ld->col) cmap[x] |= bit;
 	}
-	minx++;
-
-	ended = 0;
-	while ( ended == 0 )				// Search right for target pixels
-	{
-		maxx++;
-		if ( maxx >= mem_clip_w ) ended = 1;
-		else
-		{
-			if ( MEM_2_INT(mem_clipboard, 3*(maxx + mem_clip_w*y) ) == target )
-				mem_clip_mask[ maxx + y*mem_clip_w ] = 1;
-			else ended = 1;
-		}
-	}
-	maxx--;
-
-	if ( (y-1) >= 0 )				// Recurse upwards
-		for ( newx = minx; newx <= maxx; newx++ )
-			if ( MEM_2_INT(mem_clipboard, 3*(newx + mem_clip_w*(y-1)) ) == target
-				&& mem_clip_mask[newx + mem_clip_w*(y-1)] != 1 )
-					flood_fill24_poly( newx, y-1, target );
-
-	if ( (y+1) < mem_clip_h )			// Recurse downwards
-		for ( newx = minx; newx <= maxx; newx++ )
-			if ( MEM_2_INT(mem_clipboard, 3*(newx + mem_clip_w*(y+1)) ) == target
-				&& mem_clip_mask[newx + mem_clip_w*(y+1)] != 1 )
-					flood_fill24_poly( newx, y+1, target );
 }
 
 void poly_lasso(int poly)	// Lasso around current clipboard
 {
-	int i, j, x = 0, y = 0;
+	lassod ld;
+	unsigned char *bmap;
+	int i, j, l, x = 0, y = 0;
 
 	if (!mem_clip_mask) return;	/* Nothing to do */
 
@@ -319,20 +369,30 @@ void poly_lasso(int poly)	// Lasso around current clipboard
 			x = y = 0; // Point is outside clipboard
 	}
 
-	if ( mem_clip_bpp == 1 )
+	/* Fill the area of seed's colour, then clear it from mask */
+	ld.fm.w = mem_clip_w;
+	ld.fm.h = mem_clip_h;
+	ld.fm.emap[0] = ld.fm.emap[1] = ld.fm.ready = NULL;
+	ld.col = mem_clip_bpp == 3 ? MEM_2_INT(mem_clipboard,
+		(x + y * mem_clip_w) * 3) : mem_clipboard[x + y * mem_clip_w];
+	l = ((mem_clip_h + 7) >> 3) * mem_clip_w;
+	if (!(ld.fm.cmap = calloc(2, l)))
 	{
-		j = mem_clipboard[x + y*mem_clip_w];
-		flood_fill_poly( x, y, j );
+		memory_errors(1);
+		return;
 	}
-	if ( mem_clip_bpp == 3 )
+	bmap = ld.fm.cmap + l;
+	mem_bands(lasso_band, &ld, mem_clip_w * 8, (mem_clip_h + 7) >> 3, 0);
+	mem_fill_bitmap(x, y, bmap, &ld.fm);
+
+	for (j = 0; j < mem_clip_h; j++)
 	{
-		i = 3*(x + y*mem_clip_w);
-		j = MEM_2_INT(mem_clipboard, i);
-		flood_fill24_poly( x, y, j );
-	}
+		unsigned char *mask = mem_clip_mask + j * mem_clip_w;
+		unsigned char *src = bmap + (j >> 3) * mem_clip_w;
+		int bit = 1 << (j & 7);
 
-	j = mem_clip_w*mem_clip_h;
-	for ( i=0; i<j; i++ )
-		if ( mem_clip_mask[i] == 1 ) mem_clip_mask[i] = 0;
-			// Turn flood (1) into clear (0)
+		for (i = 0; i < mem_clip_w; i++)
+			if (src[i] & bit) mask[i] = 0; // Turn flood into clear
+	}
+	free(ld.fm.cmap);
 }
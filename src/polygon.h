@@ -27,6 +27,7 @@ int poly_points;
 int poly_mem[MAX_POLY][2];
 		// Coords in poly_mem are raw coords as plotted over image
 int poly_xy[4];
+int poly_smooth;	// Antialias polygon selection
 
 #define poly_min_x poly_xy[0]
 #define poly_min_y poly_xy[1]
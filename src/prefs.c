@@ -218,13 +218,15 @@ static void *pref_code[] = {
 	WDONE,
 ///	---- TAB4 - FILES
 	PAGE(_("Files")), GROUPN,
-	TABLE2(8),
+	TABLE2(10),
 	TSPINa(_("Transparency index"), trans),
 	TSPINa(_("XBM X hotspot"), hot_x),
 	TSPINa(_("XBM Y hotspot"), hot_y),
 	TSPINv(_("JPEG Save Quality (100=High)"), jpeg_quality, 0, 100),
 	TSPINv(_("JPEG2000 Compression (0=Lossless)"), jp2_rate, 0, 100),
 	TSPINv(_("PNG Compression (0=None)"), png_compression, 0, 9),
+	TOPTv(_("PNG Save Profile"), png_profiles, 0, png_profile),
+	TSPINv(_("PNG Time Budget (ms, 0=None)"), png_budget, 0, 60000),
 	TSPINv(_("Recently Used Files"), recent_files, 0, MAX_RECENT),
 	TSPINv(_("Progress bar silence limit"), silence_limit, 0, 28),
 	WDONE,
@@ -326,7 +326,7 @@ static int escape_filename(char *buf, char *name, int tail)
 #undef EF
 }
 
-static char *pat_chars = "%fNxywhXYWHCTBASM";
+static char *pat_chars = "%fNxywhXYWHCTBASMZRE";
 enum
 {
 	PAT_percent = 0,
@@ -346,6 +346,9 @@ enum
 	PAT_A,
 	PAT_S,
 	PAT_M,
+	PAT_Z,
+	PAT_R,
+	PAT_E,
 	PAT_NONE
 };
 
@@ -455,6 +458,11 @@ char *interpolate_line(char *pattern, int cmd)
 			case PAT_M:
 				j = !!mem_img[CHN_ALPHA + i - PAT_A];
 				break;
+			/* Last PNG save: size, ratio in %, time in ms */
+			case PAT_Z:
+			case PAT_R:
+			case PAT_E:
+				break;
 			/* Doubled percent sign */
 			case PAT_percent:
 				p++;
@@ -465,8 +473,11 @@ char *interpolate_line(char *pattern, int cmd)
 				l++;
 				continue;
 			}
-			/* Anything expanding to a number */
-			j = sprintf(buf, "%d", j);
+			/* Anything expanding to a number; file size can exceed
+			 * int range */
+			if ((i >= PAT_Z) && (i <= PAT_E))
+				j = sprintf(buf, "%.0f", png_stats[i - PAT_Z]);
+			else j = sprintf(buf, "%d", j);
 			if (line) memcpy(line + l, buf, j);
 			l += j;
 			p++;
@@ -78,6 +78,24 @@ static int numcpus()
 
 #endif
 
+/* Set while the thread runs its share of some launch, so that threaded code
+ * called from there runs serially instead of launching threads of its own;
+ * without thread-local storage, set while any launch runs at all */
+#ifdef HAVE__TLS
+static __thread int on_helper;
+#define helper_enter() (on_helper++)
+#define helper_leave() (on_helper--)
+#else
+static volatile int on_helper;
+#define helper_enter() thread_xadd(&on_helper, 1)
+#define helper_leave() thread_xadd(&on_helper, -1)
+#endif
+
+int thread_nested()
+{
+	return (on_helper);
+}
+
 int helper_threads()
 {
 	int nt = maxthreads;
@@ -128,7 +146,7 @@ threaddata *talloc(int flags, int tmax, void *data, int dsize, ...)
 
 	if (tmax < 1) tmax = 1; // No less than 1 thread
 
-	nt = helper_threads();
+	nt = thread_nested() ? 1 : helper_threads();
 
 	if (tmax > nt) tmax = nt;
 
@@ -237,6 +255,8 @@ int thread_progress(tcb *thread)
 	tcb **tp = thread->tdata->threads;
 	int i, j, n = thread->count;
 
+	/* Progressbar belongs to the outer launch */
+	if (thread->tdata->nested) return (FALSE);
 	for (i = j = 0; i < n; i++) j += tp[i]->progress;
 	if (!progress_update((float)j / thread->tsteps)) return (FALSE);
 
@@ -250,6 +270,7 @@ static void thread_chunk(tcb *thread)
 	thread_func tf = tdata->what;
 	int nx, step = thread->nsteps;
 
+	helper_enter();
 	while (TRUE)
 	{
 		tf(thread);
@@ -259,9 +280,19 @@ static void thread_chunk(tcb *thread)
 		thread->step0 = nx;
 		thread->nsteps = step > tdata->total - nx ? tdata->total - nx : step;
 	}
+	helper_leave();
 	thread_done(thread);
 }
 
+static void thread_whole(tcb *thread)
+{
+	thread_func tf = thread->tdata->what;
+
+	helper_enter();
+	tf(thread); // Can free the TCB when done, so touch it no more
+	helper_leave();
+}
+
 int threads_running;
 
 int launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
@@ -273,7 +304,22 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 	pthread_t tid;
 	pthread_attr_t attr;
 	int attr_failed;
+#endif
+
+	/* Run serially inside another launch, leaving its state alone */
+	if ((tdata->nested = thread_nested()))
+	{
+		tp = tdata->threads[0];
+		tp->stop = FALSE; tp->stopped = FALSE;
+		tp->progress = 0;
+		tp->step0 = 0;
+		tp->tsteps = tp->nsteps = tdata->total = total;
+		tdata->done = total;
+		thread(tp);
+		return (0);
+	}
 
+#if GTK_MAJOR_VERSION == 1
 	attr_failed = pthread_attr_init(&attr) ||
 #ifdef PTHREAD_SCOPE_SYSTEM
 		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM) ||
@@ -290,7 +336,7 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 
 	/* Launch aux threads */
 	tdata->what = thread;
-	if (tdata->chunks >= 0) thread = thread_chunk;
+	thread = tdata->chunks >= 0 ? thread_chunk : thread_whole;
 	threads_running = TRUE;
 	for (i -= 1; i > 0; i--)
 	{
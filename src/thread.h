@@ -43,6 +43,7 @@ struct threaddata {
 	int count;		// Number of threads
 	int chunks;		// Number of chunks per thread
 	int silent;		// No progressbar & error window
+	int nested;		// Launched from inside another launch
 	thread_func what;	// Function to run
 	tcb *threads[1];	// Threads' TCBs
 };
@@ -62,6 +63,8 @@ int threads_running;
 
 //	Max threads to be used
 int helper_threads();
+//	Check if the calling thread is doing some launch's work
+int thread_nested();
 //	Estimate how many threads is enough for image
 int image_threads(int w, int h);
 //	Update progressbar from main thread
@@ -102,6 +105,7 @@ int thread_xadd(volatile int *var, int n);
 #else /* Only one actual thread */
 
 #define helper_threads() 1
+#define thread_nested() 0
 #define image_threads(w,h) 1
 
 static inline int thread_step(tcb *thread, int i, int tlim, int steps)
@@ -30,6 +30,7 @@
 #include "mainwindow.h"
 #include "otherwindow.h"
 #include "canvas.h"
+#include "polygon.h"
 #include "toolbar.h"
 #include "layer.h"
 #include "viewer.h"
@@ -225,7 +226,8 @@ void clone_settings()
 
 #define WBbase filterwindow_dd
 static void *lasso_code[] = {
-	CHECKv(_("By selection channel"), lasso_sel), RET };
+	CHECKv(_("By selection channel"), lasso_sel),
+	CHECKv(_("Antialiased polygon"), poly_smooth), RET };
 #undef WBbase
 
 void lasso_settings() /* Lasso selection channel */
@@ -2653,6 +2653,112 @@ GtkWidget *canvasimg(void **r, int w, int h, int bkg)
 
 //	CANVAS widget
 
+#if GTK_MAJOR_VERSION >= 2
+
+#define MERGE_MAX 64 /* Beyond this, only neighbours get merged */
+
+/* Bounding box of two rectangles, and how many pixels it adds */
+static int rect_waste(int *a, int *b, int *rxy)
+{
+	rxy[0] = a[0] < b[0] ? a[0] : b[0];
+	rxy[1] = a[1] < b[1] ? a[1] : b[1];
+	rxy[2] = a[2] > b[2] ? a[2] : b[2];
+	rxy[3] = a[3] > b[3] ? a[3] : b[3];
+	return ((rxy[2] - rxy[0]) * (rxy[3] - rxy[1]) -
+		(a[2] - a[0]) * (a[3] - a[1]) - (b[2] - b[0]) * (b[3] - b[1]));
+}
+
+/* Merge rectangles (x0, y0, x1, y1) of a region while the pixels this adds
+ * cost less than repainting separately does; return the new count */
+static int merge_rects(int *xy, int n, int cost)
+{
+	int i, j, d, bd, bi, bj, rxy[4];
+
+	if (n < 2) return (n);
+
+	/* Only bother with separate rectangles if worth it */
+	copy4(rxy, xy);
+	for (d = i = 0; i < n; i++)
+	{
+		d += (xy[i * 4 + 2] - xy[i * 4]) * (xy[i * 4 + 3] - xy[i * 4 + 1]);
+		if (rxy[0] > xy[i * 4]) rxy[0] = xy[i * 4];
+		if (rxy[1] > xy[i * 4 + 1]) rxy[1] = xy[i * 4 + 1];
+		if (rxy[2] < xy[i * 4 + 2]) rxy[2] = xy[i * 4 + 2];
+		if (rxy[3] < xy[i * 4 + 3]) rxy[3] = xy[i * 4 + 3];
+	}
+	if ((rxy[2] - rxy[0]) * (rxy[3] - rxy[1]) - d <= cost * (n - 1))
+	{
+		copy4(xy, rxy);
+		return (1);
+	}
+
+	/* Regions are banded in Y, so neighbours are tried first, in one pass */
+	for (i = 0 , j = 1; j < n; j++)
+	{
+		if (rect_waste(xy + i * 4, xy + j * 4, rxy) <= cost)
+			copy4(xy + i * 4, rxy);
+		else copy4(xy + ++i * 4, xy + j * 4);
+	}
+	n = i + 1;
+
+	/* Then the best pairs, while there are few enough to search */
+	while ((n > 1) && (n <= MERGE_MAX))
+	{
+		bd = cost + 1; bi = bj = 0;
+		for (i = 0; i < n - 1; i++)
+		for (j = i + 1; j < n; j++)
+		{
+			if ((d = rect_waste(xy + i * 4, xy + j * 4, rxy)) >= bd)
+				continue;
+			bd = d; bi = i; bj = j;
+		}
+		if (bd > cost) break;
+		rect_waste(xy + bi * 4, xy + bj * 4, rxy);
+		copy4(xy + bi * 4, rxy);
+		copy4(xy + bj * 4, xy + --n * 4);
+	}
+	return (n);
+}
+
+/* Paint rectangles in canvas coordinates, merging them where worth it */
+static void paint_rects(GtkWidget *widget, void **slot, int *xy, int n,
+	int cost)
+{
+	void **base = slot[0], **desc = slot[1];
+	rgbcontext ctx;
+	int i, s, m, *rxy;
+#if GTK_MAJOR_VERSION == 2
+	int vport[4];
+
+	wjcanvas_get_vport(widget, vport);
+#endif
+
+	n = merge_rects(xy, n, cost);
+	for (i = m = 0 , rxy = xy; i < n; i++ , rxy += 4)
+		if (m < (s = (rxy[2] - rxy[0]) * (rxy[3] - rxy[1]))) m = s;
+	if (!(ctx.rgb = malloc(m * 3))) return;
+	for (i = 0 , rxy = xy; i < n; i++ , rxy += 4)
+	{
+		copy4(ctx.xy, rxy);
+		if (!((evtxr_fn)desc[1])(GET_DDATA(base), base,
+			(int)desc[0] & WB_OPMASK, slot, &ctx)) continue;
+// !!! Allow drawing area to be reduced, or ignored altogether
+#if GTK_MAJOR_VERSION == 3
+		wjcanvas_draw_rgb(widget, ctx.xy[0], ctx.xy[1],
+			ctx.xy[2] - ctx.xy[0], ctx.xy[3] - ctx.xy[1],
+			ctx.rgb, (ctx.xy[2] - ctx.xy[0]) * 3, 0, FALSE);
+#else /* if GTK_MAJOR_VERSION == 2 */
+		gdk_draw_rgb_image(widget->window, widget->style->black_gc,
+			ctx.xy[0] - vport[0], ctx.xy[1] - vport[1],
+			ctx.xy[2] - ctx.xy[0], ctx.xy[3] - ctx.xy[1],
+			GDK_RGB_DITHER_NONE, ctx.rgb, (ctx.xy[2] - ctx.xy[0]) * 3);
+#endif
+	}
+	free(ctx.rgb);
+}
+
+#endif
+
 #if GTK_MAJOR_VERSION == 3
 
 typedef struct {
@@ -2663,94 +2769,81 @@ static void expose_canvas_(GtkWidget *widget, cairo_region_t *clip_r,
 	gpointer user_data)
 {
 	void **slot = user_data, **wslot = PREV_SLOT(slot);
-	void **base = slot[0], **desc = slot[1];
 	canvas_data *cd = wslot[2];
-	cairo_rectangle_int_t re, rex;
-	rgbcontext ctx;
-	int m, s, sz, cost = (int)GET_DESCV(wslot, 2);
-	int i, n, wh, r1 = 0;
+	cairo_rectangle_int_t re;
+	int i, n, *xy, cost = (int)GET_DESCV(wslot, 2);
 
-	/* Analyze what we got */
-	cairo_region_get_extents(clip_r, &rex);
-	wh = rex.width * rex.height;
 	n = cairo_region_num_rectangles(clip_r);
-	for (i = m = sz = 0; i < n; i++)
+	if (!(xy = malloc(n * 4 * sizeof(int)))) return;
+	for (i = 0; i < n; i++)
 	{
 		cairo_region_get_rectangle(clip_r, i, &re);
-		sz += (s = re.width * re.height);
-		if (m < s) m = s;
+		xy[i * 4 + 2] = (xy[i * 4 + 0] = re.x) + re.width;
+		xy[i * 4 + 3] = (xy[i * 4 + 1] = re.y) + re.height;
 	}
-	/* Only bother with regions if worth it */
-	if (wh - sz <= cost * (n - 1)) r1 = n = 1 , m = wh , re = rex;
 
 	cd->expose++;
-	ctx.rgb = malloc(m * 3);
-	for (i = 0; i < n; i++)
-	{
-		if (!r1) cairo_region_get_rectangle(clip_r, i, &re);
-		ctx.xy[2] = (ctx.xy[0] = re.x) + re.width;
-		ctx.xy[3] = (ctx.xy[1] = re.y) + re.height;
-
-		if (((evtxr_fn)desc[1])(GET_DDATA(base), base,
-			(int)desc[0] & WB_OPMASK, slot, &ctx))
-// !!! Allow drawing area to be reduced, or ignored altogether
-			wjcanvas_draw_rgb(widget, ctx.xy[0], ctx.xy[1],
-				ctx.xy[2] - ctx.xy[0], ctx.xy[3] - ctx.xy[1],
-				ctx.rgb, (ctx.xy[2] - ctx.xy[0]) * 3, 0, FALSE);
-	}
-	free(ctx.rgb);
+	paint_rects(widget, slot, xy, n, cost);
 	cd->expose--;
+	free(xy);
 }
 
-#else /* if GTK_MAJOR_VERSION <= 2 */
+#elif GTK_MAJOR_VERSION == 2
 
 static gboolean expose_canvas_(GtkWidget *widget, GdkEventExpose *event,
 	gpointer user_data)
 {
 	void **slot = user_data;
-	void **base = slot[0], **desc = slot[1];
-	GdkRectangle *r = &event->area;
-	rgbcontext ctx;
-	int vport[4];
-	int i, cnt = 1, wh = r->width * r->height;
-#if GTK_MAJOR_VERSION == 2 /* Maybe use regions */
 	GdkRectangle *rects;
 	gint nrects;
-	int m, s, sz, cost = (int)GET_DESCV(PREV_SLOT(slot), 2);
+	int i, vport[4], *xy, cost = (int)GET_DESCV(PREV_SLOT(slot), 2);
  
 	gdk_region_get_rectangles(event->region, &rects, &nrects);
-	for (i = m = sz = 0; i < nrects; i++)
+	wjcanvas_get_vport(widget, vport);
+	if ((xy = malloc(nrects * 4 * sizeof(int))))
 	{
-		sz += (s = rects[i].width * rects[i].height);
-		if (m < s) m = s;
+		for (i = 0; i < nrects; i++)
+		{
+			xy[i * 4 + 2] = (xy[i * 4 + 0] = vport[0] + rects[i].x) +
+				rects[i].width;
+			xy[i * 4 + 3] = (xy[i * 4 + 1] = vport[1] + rects[i].y) +
+				rects[i].height;
+		}
+		paint_rects(widget, slot, xy, nrects, cost);
+		free(xy);
 	}
+	g_free(rects);
+
+	return (FALSE);
+}
+
+#else /* if GTK_MAJOR_VERSION == 1 */
+
+static gboolean expose_canvas_(GtkWidget *widget, GdkEventExpose *event,
+	gpointer user_data)
+{
+	void **slot = user_data;
+	void **base = slot[0], **desc = slot[1];
+	GdkRectangle *r = &event->area;
+	rgbcontext ctx;
+	int vport[4];
 
-	/* Only bother with regions if worth it */
-	if (wh - sz > cost * (nrects - 1))
-		r = rects , cnt = nrects , wh = m;
-#endif
 	wjcanvas_get_vport(widget, vport);
 
-	ctx.rgb = malloc(wh * 3);
-	for (i = 0; i < cnt; i++)
-	{
-		ctx.xy[2] = (ctx.xy[0] = vport[0] + r[i].x) + r[i].width;
-		ctx.xy[3] = (ctx.xy[1] = vport[1] + r[i].y) + r[i].height;
+	ctx.rgb = malloc(r->width * r->height * 3);
+	ctx.xy[2] = (ctx.xy[0] = vport[0] + r->x) + r->width;
+	ctx.xy[3] = (ctx.xy[1] = vport[1] + r->y) + r->height;
 
-		if (((evtxr_fn)desc[1])(GET_DDATA(base), base,
-			(int)desc[0] & WB_OPMASK, slot, &ctx))
+	if (((evtxr_fn)desc[1])(GET_DDATA(base), base,
+		(int)desc[0] & WB_OPMASK, slot, &ctx))
 // !!! Allow drawing area to be reduced, or ignored altogether
-			gdk_draw_rgb_image(widget->window, widget->style->black_gc,
-				ctx.xy[0] - vport[0], ctx.xy[1] - vport[1],
-				ctx.xy[2] - ctx.xy[0], ctx.xy[3] - ctx.xy[1],
-				GDK_RGB_DITHER_NONE, ctx.rgb,
-				(ctx.xy[2] - ctx.xy[0]) * 3);
-	}
+		gdk_draw_rgb_image(widget->window, widget->style->black_gc,
+			ctx.xy[0] - vport[0], ctx.xy[1] - vport[1],
+			ctx.xy[2] - ctx.xy[0], ctx.xy[3] - ctx.xy[1],
+			GDK_RGB_DITHER_NONE, ctx.rgb,
+			(ctx.xy[2] - ctx.xy[0]) * 3);
 	free(ctx.rgb);
 
-#if GTK_MAJOR_VERSION == 2
-	g_free(rects);
-#endif
 	return (FALSE);
 }
 
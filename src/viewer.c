@@ -149,21 +149,25 @@ typedef struct {
 
 void draw_pan_thumb(pan_dd *dt, int x1, int y1, int x2, int y2)
 {
-	int i, j, k, ix, iy, zoom = 1, scale = 1;
+	int i, j, k, ix, iy, zoom = 1, scale = 1, step = 1;
 	int pan_w = dt->wh[0], pan_h = dt->wh[1];
-	unsigned char *dest, *src;
+	unsigned char *dest, *src, **img = mem_img, **mip;
+
+	/* Sample the coarsest decimated copy that is fine enough, if any */
+	for (k = 2; (k * pan_w <= mem_width) && (k * pan_h <= mem_height); k += k)
+		if ((mip = mem_mip_get(&mem_image, k))) img = mip , step = k;
 
 	/* Create thumbnail */
 	dest = dt->rgb;
 	for (i = 0; i < pan_h; i++)
 	{
-		iy = (i * mem_height) / pan_h;
-		src = mem_img[CHN_IMAGE] + iy * mem_width * mem_img_bpp;
+		iy = (i * mem_height) / pan_h / step;
+		src = img[CHN_IMAGE] + iy * ceil_div(mem_width, step) * mem_img_bpp;
 		if (mem_img_bpp == 3) /* RGB */
 		{
 			for (j = 0; j < pan_w; j++ , dest += 3)
 			{
-				ix = ((j * mem_width) / pan_w) * 3;
+				ix = ((j * mem_width) / pan_w / step) * 3;
 				dest[0] = src[ix + 0];
 				dest[1] = src[ix + 1];
 				dest[2] = src[ix + 2];
@@ -173,7 +177,7 @@ void draw_pan_thumb(pan_dd *dt, int x1, int y1, int x2, int y2)
 		{
 			for (j = 0; j < pan_w; j++ , dest += 3)
 			{
-				ix = src[(j * mem_width) / pan_w];
+				ix = src[(j * mem_width) / pan_w / step];
 				dest[0] = mem_pal[ix].red;
 				dest[1] = mem_pal[ix].green;
 				dest[2] = mem_pal[ix].blue;
@@ -373,16 +377,197 @@ static void **vw_scrolledwindow;
 void **vw_drawing;
 int vw_focus_on;
 
+/* Layers below the selected one only change when it isn't selected, so their
+ * composite at 100% zoom gets kept while it is; nearest-pixel sampling makes
+ * rendering it at any zoom identical to rendering them one by one */
+
+typedef struct {
+	chanlist img;
+	int x, y, w, h, bpp, trans, opacity, visible;
+} flat_key;
+
+static struct {
+	image_info image;	// Composite, RGB
+	int x, y;		// Its position, in layer coordinates
+	int dirty[4];		// Area to refresh, in composite's coordinates
+	int ready;		// Usable by render_layers()
+	int sel, bkg, alpha;	// Conditions it was made under
+	flat_key keys[MAX_LAYERS + 1];
+} flat;
+
+/* Mark changed area of a layer in the composite */
+static void flat_dirty(int lr, int x, int y, int w, int h)
+{
+	int *d = flat.dirty, x1, y1;
+
+	if (!flat.image.img[CHN_IMAGE] || (lr >= flat.sel)) return;
+	x += layer_table_p[lr].x - flat.x;
+	y += layer_table_p[lr].y - flat.y;
+	x1 = x + w; y1 = y + h;
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x1 > flat.image.width) x1 = flat.image.width;
+	if (y1 > flat.image.height) y1 = flat.image.height;
+	if ((x >= x1) || (y >= y1)) return;
+	if (d[0] >= d[2]) /* Was clean */
+	{
+		d[0] = x; d[1] = y; d[2] = x1; d[3] = y1;
+		return;
+	}
+	if (d[0] > x) d[0] = x;
+	if (d[1] > y) d[1] = y;
+	if (d[2] < x1) d[2] = x1;
+	if (d[3] < y1) d[3] = y1;
+}
+
+static void flat_rows(void *data, unsigned char *buf, int start, int cnt)
+{
+	int *d = data, pw = flat.image.width * 3, cxy[4];
+
+	cxy[0] = d[0] + flat.x - layer_table_p[layer_selected].x;
+	cxy[1] = d[1] + start + flat.y - layer_table_p[layer_selected].y;
+	cxy[2] = cxy[0] + d[2] - d[0];
+	cxy[3] = cxy[1] + cnt;
+	buf = flat.image.img[CHN_IMAGE] + (d[1] + start) * pw + d[0] * 3;
+	render_layers(buf, cxy, pw, 1, 1, 0, layer_selected - 1, FALSE);
+}
+
+/* Bring composite of layers below selected one up to date, if worth having;
+ * call from main thread, before render threads get to it */
+void prepare_flat()
+{
+	flat_key keys[MAX_LAYERS + 1];
+	image_info *image;
+	layer_node *t;
+	unsigned char *dest;
+	int i, l, n, x0, y0, x1, y1, *d = flat.dirty;
+
+	flat.ready = FALSE;
+	/* Tracing image makes background vary inside zoomed-in pixels */
+	if ((layer_selected < 2) || (bkg_flag && bkg_rgb)) return;
+
+	memset(keys, 0, sizeof(flat_key) * layer_selected);
+	x0 = y0 = INT_MAX; x1 = y1 = INT_MIN;
+	for (i = n = 0; i < layer_selected; i++)
+	{
+		t = layer_table_p + i;
+		if (!t->visible) continue;
+		image = &t->image->image_;
+		memcpy(keys[i].img, image->img, sizeof(chanlist));
+		keys[i].x = t->x;
+		keys[i].y = t->y;
+		keys[i].w = image->width;
+		keys[i].h = image->height;
+		keys[i].bpp = image->bpp;
+		keys[i].trans = image->trans;
+		keys[i].opacity = t->opacity;
+		keys[i].visible = TRUE;
+		if (x0 > t->x) x0 = t->x;
+		if (y0 > t->y) y0 = t->y;
+		if (x1 < t->x + image->width) x1 = t->x + image->width;
+		if (y1 < t->y + image->height) y1 = t->y + image->height;
+		n++;
+	}
+	/* A single layer renders as fast as its composite would */
+	if (n < 2) return;
+
+	/* Keep only the part under the selected layer; render_layers() does
+	 * the rest of canvas, such as its margins, from the layers themselves */
+	t = layer_table_p + layer_selected;
+	if (x0 < t->x) x0 = t->x;
+	if (y0 < t->y) y0 = t->y;
+	if (x1 > t->x + mem_width) x1 = t->x + mem_width;
+	if (y1 > t->y + mem_height) y1 = t->y + mem_height;
+	if ((x0 >= x1) || (y0 >= y1)) return;
+
+	/* Set up anew if anything changed */
+	if (!flat.image.img[CHN_IMAGE] || (flat.sel != layer_selected) ||
+		(flat.bkg != mem_background) || (flat.alpha != overlay_alpha) ||
+		(flat.x != x0) || (flat.y != y0) ||
+		(flat.image.width != x1 - x0) || (flat.image.height != y1 - y0) ||
+		memcmp(flat.keys, keys, sizeof(flat_key) * layer_selected))
+	{
+		mem_mip_free(flat.image.img);
+		free(flat.image.img[CHN_IMAGE]);
+		memset(&flat.image, 0, sizeof(flat.image));
+		flat.image.img[CHN_IMAGE] = malloc((size_t)(x1 - x0) * (y1 - y0) * 3);
+		if (!flat.image.img[CHN_IMAGE]) return;
+		flat.image.width = x1 - x0;
+		flat.image.height = y1 - y0;
+		flat.image.bpp = 3;
+		flat.image.trans = -1;
+		flat.x = x0;
+		flat.y = y0;
+		flat.sel = layer_selected;
+		flat.bkg = mem_background;
+		flat.alpha = overlay_alpha;
+		memcpy(flat.keys, keys, sizeof(flat_key) * layer_selected);
+		d[0] = d[1] = 0;
+		d[2] = flat.image.width;
+		d[3] = flat.image.height;
+	}
+
+	/* Refresh the changed part */
+	if (d[0] < d[2])
+	{
+		l = (d[2] - d[0]) * 3;
+		dest = flat.image.img[CHN_IMAGE] + (d[1] * flat.image.width + d[0]) * 3;
+		for (i = d[1]; i < d[3]; i++ , dest += flat.image.width * 3)
+			memset(dest, mem_background, l);
+		mem_bands(flat_rows, d, d[2] - d[0], d[3] - d[1], 0);
+		mem_mip_dirty(&flat.image, d[0], d[1], d[2] - d[0], d[3] - d[1]);
+		d[0] = d[1] = d[2] = d[3] = 0;
+	}
+	flat.ready = TRUE;
+}
+
+/* Render image at (x, y) into rxy part of canvas */
+static void render_part(unsigned char *rgb, int *rxy, int px, int py, int pw,
+	int zoom, int scale, image_info *image, int x, int y, int xpm, int opac)
+{
+	renderstate rs;
+	unsigned char *tmp, **img, **mip;
+	int i, j, step, ddx, ddy, mx, mw, my, mh;
+
+	/* Use decimated copy if aligned with it */
+	img = image->img;
+	step = mem_mip_step(zoom);
+	if (!step || ((x | y) & (step - 1)) ||
+		!(mip = mem_mip_get(image, step))) step = 1;
+	else img = mip;
+
+	mw = rxy[2] - (mx = rxy[0]);
+	setup_row(&rs, mx, mw, zoom / step, scale,
+		ceil_div(image->width, step), xpm, opac,
+		image->bpp, image->pal);
+	mh = rxy[3] - (my = rxy[1]);
+	tmp = rgb + (my - py) * pw + (mx - px) * 3;
+	ddx = floor_div(mx * zoom, scale) - x;
+	ddy = floor_div(my * zoom, scale) - y;
+
+	i = my % scale;
+	if (i < 0) i += scale;
+	mh = mh * zoom + i;
+	for (j = -1; i < mh; i += zoom , tmp += pw)
+	{
+		if ((i / scale == j) && !async_bk)
+		{
+			memcpy(tmp, tmp - pw, mw * 3);
+			continue;
+		}
+		j = i / scale;
+		render_row(&rs, tmp, img, ddx / step, (ddy + j) / step, NULL);
+	}
+}
+
 size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
 	int lr0, int lr1, int view)
 {
-	renderstate rs;
-	int rxy[4], txy[4] = { cxy[2], cxy[3], cxy[0], cxy[1] };
+	int rxy[4], fxy[4], pxy[4][4], txy[4] = { cxy[2], cxy[3], cxy[0], cxy[1] };
 	image_info *image;
-	unsigned char *tmp, **img;
-	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac;
-	int dx, dy, ddx, ddy, mx, mw, my, mh;
-	int px = cxy[0], py = cxy[1];
+	int i, j, k, n, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac;
+	int dx, dy, ddx, ddy, m0, m1;
+	int px = cxy[0], py = cxy[1], flatten = FALSE;
 	size_t npix = 0, nrow = 0;
 
 	/* Align view on background, canvas on image */
@@ -415,15 +600,42 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 	wx1 = floor_div((cxy[2] - 1) * zoom, scale);
 	wy1 = floor_div((cxy[3] - 1) * zoom, scale);
 
-	for (ll = lr0; ll <= lr1; ll++)
+	/* Layers below selected one can come flattened; the composite covers
+	 * only the selected layer's area, they get rendered as usual outside it */
+	if (!view && !lr0 && (lr1 == layer_selected - 1) && flat.ready)
 	{
-		layer_node *t = (view ? layer_table : layer_table_p) + ll;
+		i = flat.x - dx;
+		j = flat.y - dy;
+		fxy[0] = ceil_div(i * scale, zoom);
+		fxy[1] = ceil_div(j * scale, zoom);
+		fxy[2] = floor_div((i + flat.image.width) * scale - 1, zoom) + 1;
+		fxy[3] = floor_div((j + flat.image.height) * scale - 1, zoom) + 1;
+		/* Too small to show at this zoom - not worth bothering */
+		if ((fxy[0] < fxy[2]) && (fxy[1] < fxy[3])) lr0 = -1 , flatten = TRUE;
+	}
 
-		image = ll == layer_selected ? &mem_image : &t->image->image_;
-		/* !!! When sizing canvas, do not skip selected layer */
-		if (!t->visible && (view || (ll != layer_selected))) continue;
-		i = t->x - dx;
-		j = t->y - dy;
+	for (ll = lr0; ll <= lr1; ll++)
+	{
+		if (ll < 0) /* Flattened layers */
+		{
+			image = &flat.image;
+			i = flat.x - dx;
+			j = flat.y - dy;
+			xpm = -1;
+			opac = 255;
+		}
+		else
+		{
+			layer_node *t = (view ? layer_table : layer_table_p) + ll;
+
+			image = ll == layer_selected ? &mem_image : &t->image->image_;
+			/* !!! When sizing canvas, do not skip selected layer */
+			if (!t->visible && (view || (ll != layer_selected))) continue;
+			i = t->x - dx;
+			j = t->y - dy;
+			xpm = ll ? image->trans : -1; // above background
+			opac = (t->opacity * 255 + 50) / 100;
+		}
 		ii = i + image->width;
 		jj = j + image->height;
 		if ((i > wx1) || (j > wy1) || (ii <= wx0) || (jj <= wy0))
@@ -447,30 +659,50 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		}
 #endif
 
-		xpm = ll ? image->trans : -1; // above background
-		opac = (t->opacity * 255 + 50) / 100;
-		mw = rxy[2] - (mx = rxy[0]);
-		setup_row(&rs, mx, mw, zoom, scale, image->width, xpm, opac,
-			image->bpp, image->pal);
-		mh = rxy[3] - (my = rxy[1]);
-		tmp = rgb + (my - py) * pw + (mx - px) * 3;
-		ddx = floor_div(mx * zoom, scale) - i;
-		ddy = floor_div(my * zoom, scale) - j;
+		if (!flatten || (ll < 0) || (ll >= layer_selected))
+		{
+			render_part(rgb, rxy, px, py, pw, zoom, scale, image,
+				i, j, xpm, opac);
+			continue;
+		}
 
-		i = my % scale;
-		if (i < 0) i += scale;
-		mh = mh * zoom + i;
-		img = image->img;
-		for (j = -1; i < mh; i += zoom , tmp += pw)
+		/* Parts of a flattened layer outside the composite: above,
+		 * below, then left & right of it */
+		n = 0;
+		m0 = rxy[1] > fxy[1] ? rxy[1] : fxy[1];
+		m1 = rxy[3] < fxy[3] ? rxy[3] : fxy[3];
+		if (rxy[1] < fxy[1])
+		{
+			copy4(pxy[n], rxy);
+			if (pxy[n][3] > fxy[1]) pxy[n][3] = fxy[1];
+			n++;
+		}
+		if (fxy[3] < rxy[3])
 		{
-			if ((i / scale == j) && !async_bk)
+			copy4(pxy[n], rxy);
+			if (pxy[n][1] < fxy[3]) pxy[n][1] = fxy[3];
+			n++;
+		}
+		if (m0 < m1)
+		{
+			if (rxy[0] < fxy[0])
 			{
-				memcpy(tmp, tmp - pw, mw * 3);
-				continue;
+				copy4(pxy[n], rxy);
+				pxy[n][1] = m0; pxy[n][3] = m1;
+				if (pxy[n][2] > fxy[0]) pxy[n][2] = fxy[0];
+				n++;
+			}
+			if (fxy[2] < rxy[2])
+			{
+				copy4(pxy[n], rxy);
+				pxy[n][1] = m0; pxy[n][3] = m1;
+				if (pxy[n][0] < fxy[2]) pxy[n][0] = fxy[2];
+				n++;
 			}
-			j = i / scale;
-			render_row(&rs, tmp, img, ddx, ddy + j, NULL);
 		}
+		for (k = 0; k < n; k++)
+			render_part(rgb, pxy[k], px, py, pw, zoom, scale, image,
+				i, j, xpm, opac);
 	}
 
 #ifdef U_THREADS
@@ -485,6 +717,32 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 	return (npix);
 }
 
+/* Refresh decimated copies of layers which render_layers() can use */
+void prepare_layers(int zoom, int lr0, int lr1, int view)
+{
+	layer_node *t;
+	int ll, dx, dy, step = mem_mip_step(zoom);
+
+	if (!step) return;
+	t = view ? layer_table : layer_table_p;
+	dx = t[view ? 0 : layer_selected].x;
+	dy = t[view ? 0 : layer_selected].y;
+	/* Layers below selected one can come flattened */
+	if (!view && !lr0 && (lr1 >= layer_selected) && flat.ready)
+	{
+		if (!(((flat.x - dx) | (flat.y - dy)) & (step - 1)))
+			mem_mip_prepare(&flat.image, step);
+		lr0 = layer_selected;
+	}
+	for (ll = lr0; ll <= lr1; ll++)
+	{
+		if (!t[ll].visible && (view || (ll != layer_selected))) continue;
+		if (((t[ll].x - dx) | (t[ll].y - dy)) & (step - 1)) continue;
+		mem_mip_prepare(ll == layer_selected ? &mem_image :
+			&t[ll].image->image_, step);
+	}
+}
+
 typedef struct {
 	unsigned char *rgb;
 	int cxy[4];
@@ -531,6 +789,13 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 	if (czoom < 1.0) ls.zoom = rint(1.0 / czoom);
 	else ls.scale = rint(czoom);
 
+	/* Refresh decimated copies, before threads get to them */
+	if (ls.zoom > 1)
+	{
+		mem_mip_prepare(NULL, 0);
+		prepare_layers(ls.zoom, 0, layers_total, TRUE);
+	}
+
 #ifdef U_THREADS
 	/* Calculate amount of work for threads */
 	vpix = render_layers(NULL, ls.cxy, 0, ls.zoom, ls.scale,
@@ -819,6 +1084,13 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 {
 	int mx, my, zoom, scale, rxy[4];
 
+	if (lr < LR_ANIM)
+	{
+		mem_mip_dirty(lr == layer_selected ? &mem_image :
+			&layer_table[lr].image->image_, x, y, w, h);
+		flat_dirty(lr, x, y, w, h);
+	}
+
 	if ((lr < LR_ANIM) && (show_layers_main || (lr == layer_selected)))
 	{
 		mx = x + layer_table_p[lr].x - layer_table_p[layer_selected].x;
@@ -53,6 +53,8 @@ void vw_focus_idle();						// Same but done in idle cycles
 void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double czoom );
 size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
 	int lr0, int lr1, int view);
+void prepare_layers(int zoom, int lr0, int lr1, int view);	// Refresh their decimated copies
+void prepare_flat();	// Refresh composite of layers below selected one
 void lr_update_area(int lr, int x, int y, int w, int h);	// Update x,y,w,h area of a layer
 #define LR_ANIM 0x10000 /* Update only view window */
 